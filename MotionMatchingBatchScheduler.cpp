@@ -0,0 +1,100 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#include "MotionMatchingBatchScheduler.h"
+#include "EngineLogs.h"
+#include "HAL/PlatformMisc.h"
+#include "Misc/ScopeLock.h"
+#include "Tasks/Task.h"
+
+FMMBatchScheduler& FMMBatchScheduler::Get()
+{
+    static FMMBatchScheduler Scheduler;
+    return Scheduler;
+}
+
+void FMMBatchScheduler::Submit(FJob&& Job)
+{
+    {
+        FScopeLock ScopeLock(&Lock);
+
+        if (NumRunning > 0 || NumQueued > 0) {
+            UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Queued '%s' (estimated %.1f MB, %.1f MB in flight, %d waiting)"),
+                *Job.Name, Job.EstimatedBytes / (1024.0 * 1024.0), BytesInFlight / (1024.0 * 1024.0), NumQueued);
+        }
+
+        Queue.Enqueue(MoveTemp(Job));
+        ++NumQueued;
+    }
+
+    Pump();
+}
+
+int64 FMMBatchScheduler::GetBytesInFlight() const
+{
+    FScopeLock ScopeLock(&Lock);
+    return BytesInFlight;
+}
+
+int32 FMMBatchScheduler::GetNumQueued() const
+{
+    FScopeLock ScopeLock(&Lock);
+    return NumQueued;
+}
+
+void FMMBatchScheduler::Pump()
+{
+    // Take every job that fits off the front of the queue, then launch them outside the lock.
+
+    TArray<FJob> Admitted;
+
+    {
+        FScopeLock ScopeLock(&Lock);
+
+        const int32 MaxRunning = FMath::Max(FPlatformMisc::NumberOfWorkerThreadsToSpawn(), 1);
+
+        while (NumRunning < MaxRunning) {
+            const FJob* Next = Queue.Peek();
+            if (!Next || (BytesInFlight > 0 && BytesInFlight + Next->EstimatedBytes > Next->BudgetBytes)) {
+                break;
+            }
+
+            BytesInFlight += Next->EstimatedBytes;
+            ++NumRunning;
+            Queue.Dequeue(Admitted.AddDefaulted_GetRef());
+            --NumQueued;
+        }
+    }
+
+    for (FJob& Job : Admitted) {
+        UE::Tasks::Launch(UE_SOURCE_LOCATION, [Work = MoveTemp(Job.Work), EstimatedBytes = Job.EstimatedBytes]() mutable {
+            Work(MakeShared<FReservation>(EstimatedBytes));
+            Get().OnJobFinished();
+        });
+    }
+}
+
+void FMMBatchScheduler::OnJobFinished()
+{
+    // Frees the worker slot. The bytes go when the job lets go of its reservation.
+    {
+        FScopeLock ScopeLock(&Lock);
+        --NumRunning;
+    }
+
+    Pump();
+}
+
+void FMMBatchScheduler::ReleaseBytes(const int64 Bytes)
+{
+    {
+        FScopeLock ScopeLock(&Lock);
+        BytesInFlight -= Bytes;
+    }
+
+    Pump();
+}
+
+FMMBatchScheduler::FReservation::~FReservation()
+{
+    Get().ReleaseBytes(Bytes);
+}
@@ -0,0 +1,68 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Containers/Queue.h"
+#include "HAL/CriticalSection.h"
+
+// Admits background applies under a memory budget. Applying the modifier to a whole folder of long
+// takes starts one background apply per sequence, and each of them holds the sampled poses of every
+// frame plus all the output keys until it's done. Running them all at once can exhaust RAM, so jobs
+// are queued with an estimate of their peak working set, and only started while the estimates of
+// the running jobs, plus the new one, stay under the budget. A job larger than the budget still
+// runs, but only on its own.
+//
+// A job's estimate stays counted until its reservation is released, not just until its work
+// returns. A background apply still holds all of its output keys while the commit waits for the
+// game thread, so it keeps the reservation until then. Otherwise many short jobs could pile up
+// finished results outside the budget.
+//
+// Jobs are admitted in submission order, so a large job at the front holds back the smaller ones
+// behind it instead of being starved by them. Admitted jobs run as regular tasks, which the task
+// scheduler's workers balance between themselves. The number of running jobs is also capped at the
+// number of workers, since more than that only adds memory without adding throughput.
+class GAMEANIMATIONSAMPLE2_API FMMBatchScheduler
+{
+public:
+    // Counts a started job's estimate against the budget until the last reference goes away. Work
+    // gets it, and keeps it for as long as its results are alive.
+    class FReservation
+    {
+    public:
+        explicit FReservation(const int64 InBytes) : Bytes(InBytes) {}
+        ~FReservation();
+
+    private:
+        int64 Bytes = 0;
+    };
+
+    struct FJob
+    {
+        FString Name;
+        int64 EstimatedBytes = 0;
+        int64 BudgetBytes = 0; // Budget the job is admitted under, from the modifier that submitted it
+        TUniqueFunction<void(TSharedRef<FReservation>)> Work; // Runs on a worker thread
+    };
+
+    static FMMBatchScheduler& Get();
+
+    // Queues a job and starts it, and any other job it doesn't hold back, as soon as it fits.
+    void Submit(FJob&& Job);
+
+    int64 GetBytesInFlight() const;
+    int32 GetNumQueued() const;
+
+private:
+    void Pump();
+    void OnJobFinished();
+    void ReleaseBytes(const int64 Bytes);
+
+    // Jobs are only ever taken off the front, so a queue keeps admission constant time however many
+    // sequences a batch submits. Every access holds the lock, which also covers the count.
+    mutable FCriticalSection Lock;
+    TQueue<FJob> Queue;
+    int32 NumQueued = 0;
+    int64 BytesInFlight = 0;
+    int32 NumRunning = 0;
+};
@@ -0,0 +1,185 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#include "MotionMatchingCapsuleSimulator.h"
+#include "Math/VectorRegister.h"
+
+namespace
+{
+    float HalflifeToDamping(const float Halflife)
+    {
+        return (4.0f * 0.69314718f) / (Halflife + UE_KINDA_SMALL_NUMBER);
+    }
+
+    // Critically damped spring towards a goal velocity. Advances position, velocity and
+    // acceleration of four lanes by one time step.
+    FORCEINLINE void StepVelocitySpring(
+        VectorRegister4Float& Position, VectorRegister4Float& Velocity, VectorRegister4Float& Acceleration,
+        const VectorRegister4Float& Goal, const VectorRegister4Float& Damping, const VectorRegister4Float& InvDamping,
+        const VectorRegister4Float& InvDampingSquared, const VectorRegister4Float& Decay, const VectorRegister4Float& Dt)
+    {
+        const VectorRegister4Float J0 = VectorSubtract(Velocity, Goal);
+        const VectorRegister4Float J1 = VectorMultiplyAdd(J0, Damping, Acceleration);
+        const VectorRegister4Float J1Dt = VectorMultiply(J1, Dt);
+
+        // Decay * (-J1 / y^2 + (-J0 - J1 * dt) / y) + J1 / y^2 + J0 / y + Goal * dt + Position
+        const VectorRegister4Float Decaying = VectorMultiplyAdd(
+            VectorNegate(VectorAdd(J0, J1Dt)), InvDamping, VectorMultiply(VectorNegate(J1), InvDampingSquared));
+        const VectorRegister4Float Steady = VectorMultiplyAdd(J1, InvDampingSquared, VectorMultiplyAdd(J0, InvDamping, VectorMultiplyAdd(Goal, Dt, Position)));
+        Position = VectorMultiplyAdd(Decay, Decaying, Steady);
+
+        Velocity = VectorMultiplyAdd(Decay, VectorAdd(J0, J1Dt), Goal);
+        Acceleration = VectorMultiply(Decay, VectorSubtract(Acceleration, VectorMultiply(J1Dt, Damping)));
+    }
+
+    // Critically damped spring towards a goal value. Advances value and velocity of four lanes by
+    // one time step.
+    FORCEINLINE void StepValueSpring(
+        VectorRegister4Float& Value, VectorRegister4Float& Velocity, const VectorRegister4Float& Goal,
+        const VectorRegister4Float& Damping, const VectorRegister4Float& Decay, const VectorRegister4Float& Dt)
+    {
+        const VectorRegister4Float J0 = VectorSubtract(Value, Goal);
+        const VectorRegister4Float J1 = VectorMultiplyAdd(J0, Damping, Velocity);
+        const VectorRegister4Float J1Dt = VectorMultiply(J1, Dt);
+
+        Value = VectorMultiplyAdd(Decay, VectorAdd(J0, J1Dt), Goal);
+        Velocity = VectorMultiply(Decay, VectorSubtract(Velocity, VectorMultiply(J1Dt, Damping)));
+    }
+}
+
+void FMMCapsuleSimulator::Reset(const TArray<float>& PositionHalflives, const TArray<float>& RotationHalflives, const float InDeltaTime)
+{
+    check(PositionHalflives.Num() == RotationHalflives.Num());
+
+    NumLanes = PositionHalflives.Num();
+    NumPaddedLanes = Align(NumLanes, LaneWidth);
+    NumFrames = 0;
+    DeltaTime = InDeltaTime;
+
+    PositionDamping.SetNumUninitialized(NumPaddedLanes);
+    PositionInvDamping.SetNumUninitialized(NumPaddedLanes);
+    PositionInvDampingSquared.SetNumUninitialized(NumPaddedLanes);
+    PositionDecay.SetNumUninitialized(NumPaddedLanes);
+    RotationDamping.SetNumUninitialized(NumPaddedLanes);
+    RotationDecay.SetNumUninitialized(NumPaddedLanes);
+
+    for (int32 Lane = 0; Lane < NumPaddedLanes; ++Lane) {
+        // Padding lanes get a harmless halflife so they don't produce NaNs.
+        const float PositionHalflife = (Lane < NumLanes) ? PositionHalflives[Lane] : 1.0f;
+        const float RotationHalflife = (Lane < NumLanes) ? RotationHalflives[Lane] : 1.0f;
+
+        const float PositionSpringDamping = HalflifeToDamping(PositionHalflife) / 2.0f;
+        PositionDamping[Lane] = PositionSpringDamping;
+        PositionInvDamping[Lane] = 1.0f / PositionSpringDamping;
+        PositionInvDampingSquared[Lane] = 1.0f / (PositionSpringDamping * PositionSpringDamping);
+        PositionDecay[Lane] = FMath::Exp(-PositionSpringDamping * DeltaTime);
+
+        const float RotationSpringDamping = HalflifeToDamping(RotationHalflife) / 2.0f;
+        RotationDamping[Lane] = RotationSpringDamping;
+        RotationDecay[Lane] = FMath::Exp(-RotationSpringDamping * DeltaTime);
+    }
+
+    PositionX.SetNumZeroed(NumPaddedLanes);
+    PositionY.SetNumZeroed(NumPaddedLanes);
+    VelocityX.SetNumZeroed(NumPaddedLanes);
+    VelocityY.SetNumZeroed(NumPaddedLanes);
+    AccelerationX.SetNumZeroed(NumPaddedLanes);
+    AccelerationY.SetNumZeroed(NumPaddedLanes);
+    Yaw.SetNumZeroed(NumPaddedLanes);
+    YawVelocity.SetNumZeroed(NumPaddedLanes);
+}
+
+void FMMCapsuleSimulator::SetInitialState(const int32 Lane, const FVector2D& Position, const FVector2D& Velocity, const float InYaw)
+{
+    check(Lane >= 0 && Lane < NumLanes);
+
+    PositionX[Lane] = static_cast<float>(Position.X);
+    PositionY[Lane] = static_cast<float>(Position.Y);
+    VelocityX[Lane] = static_cast<float>(Velocity.X);
+    VelocityY[Lane] = static_cast<float>(Velocity.Y);
+    AccelerationX[Lane] = 0.0f;
+    AccelerationY[Lane] = 0.0f;
+    Yaw[Lane] = InYaw;
+    YawVelocity[Lane] = 0.0f;
+}
+
+void FMMCapsuleSimulator::Simulate(const TArray<FVector2D>& DesiredVelocities, const TArray<float>& DesiredYaws)
+{
+    check(DesiredVelocities.Num() == DesiredYaws.Num());
+
+    NumFrames = DesiredVelocities.Num();
+
+    OutPositionX.SetNumUninitialized(NumFrames * NumPaddedLanes);
+    OutPositionY.SetNumUninitialized(NumFrames * NumPaddedLanes);
+    OutVelocityX.SetNumUninitialized(NumFrames * NumPaddedLanes);
+    OutVelocityY.SetNumUninitialized(NumFrames * NumPaddedLanes);
+    OutYaw.SetNumUninitialized(NumFrames * NumPaddedLanes);
+
+    if (NumFrames == 0) {
+        return;
+    }
+
+    const VectorRegister4Float Dt = VectorSetFloat1(DeltaTime);
+
+    for (int32 Frame = 0; Frame < NumFrames; ++Frame) {
+        const VectorRegister4Float GoalX = VectorSetFloat1(static_cast<float>(DesiredVelocities[Frame].X));
+        const VectorRegister4Float GoalY = VectorSetFloat1(static_cast<float>(DesiredVelocities[Frame].Y));
+        const VectorRegister4Float GoalYaw = VectorSetFloat1(DesiredYaws[Frame]);
+        const int32 RowOffset = Frame * NumPaddedLanes;
+
+        for (int32 Lane = 0; Lane < NumPaddedLanes; Lane += LaneWidth) {
+            VectorRegister4Float PX = VectorLoad(PositionX.GetData() + Lane);
+            VectorRegister4Float PY = VectorLoad(PositionY.GetData() + Lane);
+            VectorRegister4Float VX = VectorLoad(VelocityX.GetData() + Lane);
+            VectorRegister4Float VY = VectorLoad(VelocityY.GetData() + Lane);
+            VectorRegister4Float R = VectorLoad(Yaw.GetData() + Lane);
+            VectorRegister4Float W = VectorLoad(YawVelocity.GetData() + Lane);
+
+            // The first frame is the initial state, every later frame is one step further.
+            if (Frame > 0) {
+                VectorRegister4Float AX = VectorLoad(AccelerationX.GetData() + Lane);
+                VectorRegister4Float AY = VectorLoad(AccelerationY.GetData() + Lane);
+
+                const VectorRegister4Float Damping = VectorLoad(PositionDamping.GetData() + Lane);
+                const VectorRegister4Float InvDamping = VectorLoad(PositionInvDamping.GetData() + Lane);
+                const VectorRegister4Float InvDampingSquared = VectorLoad(PositionInvDampingSquared.GetData() + Lane);
+                const VectorRegister4Float Decay = VectorLoad(PositionDecay.GetData() + Lane);
+
+                StepVelocitySpring(PX, VX, AX, GoalX, Damping, InvDamping, InvDampingSquared, Decay, Dt);
+                StepVelocitySpring(PY, VY, AY, GoalY, Damping, InvDamping, InvDampingSquared, Decay, Dt);
+                StepValueSpring(R, W, GoalYaw, VectorLoad(RotationDamping.GetData() + Lane), VectorLoad(RotationDecay.GetData() + Lane), Dt);
+
+                VectorStore(PX, PositionX.GetData() + Lane);
+                VectorStore(PY, PositionY.GetData() + Lane);
+                VectorStore(VX, VelocityX.GetData() + Lane);
+                VectorStore(VY, VelocityY.GetData() + Lane);
+                VectorStore(AX, AccelerationX.GetData() + Lane);
+                VectorStore(AY, AccelerationY.GetData() + Lane);
+                VectorStore(R, Yaw.GetData() + Lane);
+                VectorStore(W, YawVelocity.GetData() + Lane);
+            }
+
+            VectorStore(PX, OutPositionX.GetData() + RowOffset + Lane);
+            VectorStore(PY, OutPositionY.GetData() + RowOffset + Lane);
+            VectorStore(VX, OutVelocityX.GetData() + RowOffset + Lane);
+            VectorStore(VY, OutVelocityY.GetData() + RowOffset + Lane);
+            VectorStore(R, OutYaw.GetData() + RowOffset + Lane);
+        }
+    }
+}
+
+FVector2D FMMCapsuleSimulator::GetPosition(const int32 Frame, const int32 Lane) const
+{
+    const int32 Index = Frame * NumPaddedLanes + Lane;
+    return FVector2D(OutPositionX[Index], OutPositionY[Index]);
+}
+
+FVector2D FMMCapsuleSimulator::GetVelocity(const int32 Frame, const int32 Lane) const
+{
+    const int32 Index = Frame * NumPaddedLanes + Lane;
+    return FVector2D(OutVelocityX[Index], OutVelocityY[Index]);
+}
+
+float FMMCapsuleSimulator::GetYaw(const int32 Frame, const int32 Lane) const
+{
+    return OutYaw[Frame * NumPaddedLanes + Lane];
+}
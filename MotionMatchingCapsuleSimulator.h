@@ -0,0 +1,65 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Simulates a batch of gameplay capsules following the same desired velocity and facing, the way a
+// character movement component with spring-damper smoothing would follow the player's input. Every
+// lane has its own position and rotation halflife. Lanes are stored as structure-of-arrays padded to
+// the SIMD width, so each frame advances four lanes per vector instruction, and a whole parameter
+// sweep costs one pass over the frames.
+//
+// The springs are the exact critically damped spring-dampers from Daniel Holden's "Spring-It-On".
+// Since the time step is fixed, the exponential decay is precomputed per lane, and the inner loop is
+// only multiplies and adds.
+class FMMCapsuleSimulator
+{
+public:
+    static constexpr int32 LaneWidth = 4;
+
+    void Reset(const TArray<float>& PositionHalflives, const TArray<float>& RotationHalflives, const float InDeltaTime);
+    void SetInitialState(const int32 Lane, const FVector2D& Position, const FVector2D& Velocity, const float InYaw);
+
+    // DesiredYaws must be unwrapped (continuous across +/- PI), so the rotation spring doesn't spin
+    // the long way around.
+    void Simulate(const TArray<FVector2D>& DesiredVelocities, const TArray<float>& DesiredYaws);
+
+    int32 GetNumLanes() const { return NumLanes; }
+    int32 GetNumFrames() const { return NumFrames; }
+
+    FVector2D GetPosition(const int32 Frame, const int32 Lane) const;
+    FVector2D GetVelocity(const int32 Frame, const int32 Lane) const;
+    float GetYaw(const int32 Frame, const int32 Lane) const;
+
+private:
+    int32 NumLanes = 0;
+    int32 NumPaddedLanes = 0;
+    int32 NumFrames = 0;
+    float DeltaTime = 0.0f;
+
+    // Per-lane spring constants.
+    TArray<float> PositionDamping;
+    TArray<float> PositionInvDamping;
+    TArray<float> PositionInvDampingSquared;
+    TArray<float> PositionDecay;
+    TArray<float> RotationDamping;
+    TArray<float> RotationDecay;
+
+    // Per-lane state.
+    TArray<float> PositionX;
+    TArray<float> PositionY;
+    TArray<float> VelocityX;
+    TArray<float> VelocityY;
+    TArray<float> AccelerationX;
+    TArray<float> AccelerationY;
+    TArray<float> Yaw;
+    TArray<float> YawVelocity;
+
+    // Simulated frames, NumFrames rows of NumPaddedLanes.
+    TArray<float> OutPositionX;
+    TArray<float> OutPositionY;
+    TArray<float> OutVelocityX;
+    TArray<float> OutVelocityY;
+    TArray<float> OutYaw;
+};
@@ -0,0 +1,1222 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#include "MotionMatchingCore.h"
+#include <algorithm>
+#include <array>
+
+namespace MMCore
+{
+    namespace
+    {
+        constexpr double SmallNumber = 1.e-8;
+
+        int32_t RoundToInt(const float Value)
+        {
+            return static_cast<int32_t>(std::floor(Value + 0.5f));
+        }
+
+        // Rounds towards negative infinity, unlike integer division.
+        int32_t FloorDivide(const int32_t Dividend, const int32_t Divisor)
+        {
+            return (Dividend >= 0) ? Dividend / Divisor : -((-Dividend + Divisor - 1) / Divisor);
+        }
+
+        FVec3 GetSafeScaleReciprocal(const FVec3& Scale)
+        {
+            auto Reciprocal = [](const double Value) { return (std::abs(Value) <= SmallNumber) ? 0.0 : 1.0 / Value; };
+            return FVec3(Reciprocal(Scale.X), Reciprocal(Scale.Y), Reciprocal(Scale.Z));
+        }
+
+        FVec3 GetSafeNormal(const FVec3& Vector)
+        {
+            const double SquareSum = FVec3::Dot(Vector, Vector);
+            return (SquareSum > SmallNumber) ? Vector * (1.0 / std::sqrt(SquareSum)) : Vector;
+        }
+
+        // Running average of quaternions in the hemisphere of the first one, which is good enough
+        // for the small spread within a smoothing window. Same as summing them all up front, without
+        // having to keep them.
+        struct FQuatAverage
+        {
+            FQuat4 Sum;
+            int32_t Count = 0;
+
+            void Add(const FQuat4& Quat)
+            {
+                if (Count == 0) {
+                    Sum = Quat;
+                } else {
+                    const double Sign = (FQuat4::Dot(Sum, Quat) < 0.0f) ? -1.0 : 1.0;
+                    Sum.X += Quat.X * Sign;
+                    Sum.Y += Quat.Y * Sign;
+                    Sum.Z += Quat.Z * Sign;
+                    Sum.W += Quat.W * Sign;
+                }
+                ++Count;
+            }
+
+            FQuat4 Get() const
+            {
+                if (Count == 0) {
+                    return FQuat4();
+                }
+
+                FQuat4 Result = Sum;
+                if (Count > 1) {
+                    Result.Normalize();
+                }
+                return Result;
+            }
+        };
+
+        // Values extended by Padding on either side, continuing as a loop of the given period. Only
+        // for values that are the same in every cycle, like speeds and heights relative to the root.
+        std::vector<float> WrapFloats(const std::vector<float>& Values, const int32_t Period, const int32_t Padding)
+        {
+            const int32_t NumValues = static_cast<int32_t>(Values.size());
+            std::vector<float> Result(NumValues + 2 * Padding);
+
+            for (int32_t Index = 0; Index < static_cast<int32_t>(Result.size()); ++Index) {
+                const int32_t Frame = Index - Padding;
+                Result[Index] = (Frame >= 0 && Frame < NumValues) ? Values[Frame] : Values[Frame - FloorDivide(Frame, Period) * Period];
+            }
+
+            return Result;
+        }
+
+        // Same as SmoothedFloats, but with a running sum, so it's O(N) regardless of the margin.
+        std::vector<float> MovingAverage(const std::vector<float>& Values, const int32_t Margin)
+        {
+            const int32_t NumValues = static_cast<int32_t>(Values.size());
+            std::vector<float> Result(NumValues);
+
+            double Sum = 0.0;
+            int32_t WindowStart = 0;
+            int32_t WindowEnd = -1; // Inclusive
+
+            for (int32_t Index = 0; Index < NumValues; ++Index) {
+                while (WindowEnd < std::min(NumValues - 1, Index + Margin)) {
+                    Sum += Values[++WindowEnd];
+                }
+                while (WindowStart < Index - Margin) {
+                    Sum -= Values[WindowStart++];
+                }
+                Result[Index] = static_cast<float>(Sum / (WindowEnd - WindowStart + 1));
+            }
+
+            return Result;
+        }
+
+        // Same as LowestFloatValueInRange for every index, but in O(N). Candidates holds the indices
+        // of the window that could still become its minimum, with increasing values, so the front is
+        // always the minimum, and every index is added and dropped once.
+        std::vector<float> SlidingMinimum(const std::vector<float>& Values, const int32_t Margin)
+        {
+            const int32_t NumValues = static_cast<int32_t>(Values.size());
+            std::vector<float> Result(NumValues);
+
+            std::vector<int32_t> Candidates(NumValues);
+            int32_t Front = 0;
+            int32_t Back = 0;
+            int32_t WindowEnd = -1; // Inclusive
+
+            for (int32_t Index = 0; Index < NumValues; ++Index) {
+                while (WindowEnd < std::min(NumValues - 1, Index + Margin)) {
+                    ++WindowEnd;
+                    while (Back > Front && Values[Candidates[Back - 1]] >= Values[WindowEnd]) {
+                        --Back;
+                    }
+                    Candidates[Back++] = WindowEnd;
+                }
+                while (Candidates[Front] < Index - Margin) {
+                    ++Front;
+                }
+                Result[Index] = Values[Candidates[Front]];
+            }
+
+            return Result;
+        }
+
+        std::vector<float> SmoothedFloats(const std::vector<float>& Values, const int32_t Margin)
+        {
+            // Takes an arbitrary array of floats, and smoothes it with a rolling average window
+            // clamped to valid index range.
+
+            const int32_t NumValues = static_cast<int32_t>(Values.size());
+
+            std::vector<float> Result;
+            Result.reserve(NumValues);
+
+            for (int32_t Index = 0; Index < NumValues; ++Index) {
+                const int32_t StartIndex = std::max(0, Index - Margin);
+                const int32_t EndIndex = std::min(NumValues - 1, Index + Margin);
+
+                float Sum = 0.0f;
+                int32_t Count = 0;
+
+                for (int32_t i = StartIndex; i <= EndIndex; ++i) {
+                    Sum += Values[i];
+                    ++Count;
+                }
+
+                Result.push_back(Sum / static_cast<float>(Count));
+            }
+
+            return Result;
+        }
+
+        float LowestFloatValueInRange(const std::vector<float>& Values, const int32_t FrameIndex, const int32_t Margin)
+        {
+            const int32_t NumValues = static_cast<int32_t>(Values.size());
+            const int32_t StartIndex = std::max(0, FrameIndex - Margin);
+            const int32_t EndIndex = std::min(NumValues - 1, FrameIndex + Margin);
+
+            if (StartIndex > EndIndex) {
+                return 0;
+            }
+
+            float Result = Values[StartIndex];
+            for (int32_t i = StartIndex + 1; i <= EndIndex; ++i) {
+                Result = std::min(Result, Values[i]);
+            }
+
+            return Result;
+        }
+
+        std::vector<float> SmoothVelocitiesForBones(const std::vector<FPose>& Poses, const std::initializer_list<EBone> Bones, const int32_t Margin, const int32_t FrameRate)
+        {
+            // Smoothed speed of a group of bones, averaged over the bones. All of them are read in
+            // the same pass over the poses.
+
+            std::vector<float> Result;
+            Result.reserve(Poses.size());
+
+            FVec3 PreviousPositions[NumBones];
+
+            for (const FPose& Pose : Poses) {
+                double Speed = 0.0;
+                for (const EBone Bone : Bones) {
+                    const FVec3& Position = Pose[Bone].Translation;
+                    Speed += FrameRate * (Position - PreviousPositions[static_cast<int32_t>(Bone)]).Size();
+
+                    PreviousPositions[static_cast<int32_t>(Bone)] = Position;
+                }
+                Result.push_back(static_cast<float>(Speed / Bones.size()));
+            }
+
+            return SmoothedFloats(Result, Margin);
+        }
+
+        // The bones the root is composed from. They're smoothed together, in one sweep per frame.
+        enum ESmoothedBone : int32_t
+        {
+            SmoothedPelvis,
+            SmoothedLeftThigh,
+            SmoothedRightThigh,
+            SmoothedSpine01,
+            SmoothedLeftFoot,
+            SmoothedRightFoot,
+            SmoothedLeftBall,
+            SmoothedRightBall,
+
+            NumSmoothedBones,
+        };
+
+        constexpr EBone SmoothedBones[NumSmoothedBones] = {
+            EBone::Pelvis, EBone::LeftThigh, EBone::RightThigh, EBone::Spine01,
+            EBone::LeftFoot, EBone::RightFoot, EBone::LeftBall, EBone::RightBall,
+        };
+
+        using FSmoothingMargins = std::array<int32_t, NumSmoothedBones>;
+        using FSmoothedTranslations = std::array<FVec3, NumSmoothedBones>;
+
+        void SmoothBoneTranslations(const std::vector<FPose>& Poses, const int32_t FrameIndex, const FSmoothingMargins& Margins, FSmoothedTranslations& OutTranslations)
+        {
+            // The moving average of every smoothed bone's translation, each in its own window of
+            // plus/minus its margin around FrameIndex. Bones with a negative margin are left alone.
+            //
+            // Only the translations are averaged, which is all the root composition uses. Instead of
+            // walking the window once per bone, every pose in the widest window is read once, and
+            // added to all bones whose window contains it. A pose is one contiguous block, so that's
+            // one pass over memory per frame, however many margins there are. Every bone still sums
+            // its frames in the same order as a walk of its own window would.
+
+            const int32_t MaxMargin = *std::max_element(Margins.begin(), Margins.end());
+            if (MaxMargin < 0) {
+                return;
+            }
+
+            const int32_t TotalFrames = static_cast<int32_t>(Poses.size());
+            const int32_t StartFrame = std::max(0, FrameIndex - MaxMargin);
+            const int32_t EndFrame = std::min(TotalFrames - 1, FrameIndex + MaxMargin);
+
+            FSmoothedTranslations Sums = {};
+            int32_t Counts[NumSmoothedBones] = {};
+
+            for (int32_t Index = StartFrame; Index <= EndFrame; ++Index) {
+                const FPose& Pose = Poses[Index];
+                const int32_t Distance = std::abs(Index - FrameIndex);
+
+                for (int32_t Slot = 0; Slot < NumSmoothedBones; ++Slot) {
+                    if (Distance <= Margins[Slot]) {
+                        Sums[Slot] += Pose[SmoothedBones[Slot]].Translation;
+                        ++Counts[Slot];
+                    }
+                }
+            }
+
+            for (int32_t Slot = 0; Slot < NumSmoothedBones; ++Slot) {
+                if (Counts[Slot] > 0) {
+                    OutTranslations[Slot] = Sums[Slot] / static_cast<float>(Counts[Slot]);
+                }
+            }
+        }
+
+        float CoarseFrameTime(const int32_t FrameIndex, const int32_t DecimationFactor)
+        {
+            // Fractional coarse frame for a full-rate frame. Coarse frames sit at the center of their
+            // block.
+            return (FrameIndex - 0.5f * (DecimationFactor - 1)) / DecimationFactor;
+        }
+
+        void SmoothBoneTranslationsUpsampled(const std::vector<FPose>& CoarsePoses, const int32_t FrameIndex, const FSmoothingMargins& Margins, const int32_t DecimationFactor, FSmoothedTranslations& OutTranslations)
+        {
+            // The full-rate moving averages approximated on the decimated level. The windows are
+            // scaled down to coarse frames, and the averages at the two coarse frames around
+            // FrameIndex are blended, so the result doesn't step once per coarse frame.
+
+            const int32_t LastCoarseFrame = static_cast<int32_t>(CoarsePoses.size()) - 1;
+            const float CoarseTime = std::clamp(CoarseFrameTime(FrameIndex, DecimationFactor), 0.0f, static_cast<float>(LastCoarseFrame));
+            const int32_t CoarseFrame0 = static_cast<int32_t>(std::floor(CoarseTime));
+            const int32_t CoarseFrame1 = std::min(CoarseFrame0 + 1, LastCoarseFrame);
+            const float Alpha = CoarseTime - CoarseFrame0;
+
+            FSmoothingMargins CoarseMargins;
+            for (int32_t Slot = 0; Slot < NumSmoothedBones; ++Slot) {
+                CoarseMargins[Slot] = Margins[Slot] >= 0 ? RoundToInt(static_cast<float>(Margins[Slot]) / DecimationFactor) : -1;
+            }
+
+            FSmoothedTranslations Smooth0;
+            FSmoothedTranslations Smooth1;
+            SmoothBoneTranslations(CoarsePoses, CoarseFrame0, CoarseMargins, Smooth0);
+            SmoothBoneTranslations(CoarsePoses, CoarseFrame1, CoarseMargins, Smooth1);
+
+            for (int32_t Slot = 0; Slot < NumSmoothedBones; ++Slot) {
+                if (Margins[Slot] >= 0) {
+                    OutTranslations[Slot] = FVec3::Lerp(Smooth0[Slot], Smooth1[Slot], Alpha);
+                }
+            }
+        }
+
+        std::vector<FPose> Decimate(const std::vector<FPose>& Poses, const int32_t DecimationFactor)
+        {
+            // Builds the coarse level for multi-resolution analysis. Every coarse frame is the average
+            // of a block of DecimationFactor full-rate frames, which doubles as the anti-aliasing
+            // filter.
+
+            const int32_t NumFrames = static_cast<int32_t>(Poses.size());
+            const int32_t NumCoarseFrames = (NumFrames + DecimationFactor - 1) / DecimationFactor;
+
+            std::vector<FPose> Result(NumCoarseFrames);
+
+            for (int32_t CoarseIndex = 0; CoarseIndex < NumCoarseFrames; ++CoarseIndex) {
+                const int32_t StartFrame = CoarseIndex * DecimationFactor;
+                const int32_t EndFrame = std::min(StartFrame + DecimationFactor, NumFrames);
+
+                for (int32_t Bone = 0; Bone < NumBones; ++Bone) {
+                    FVec3 Location;
+                    FVec3 Scale;
+                    FQuatAverage Orientation;
+
+                    for (int32_t Index = StartFrame; Index < EndFrame; ++Index) {
+                        const FXform& BoneTransform = Poses[Index].Bones[Bone];
+                        Location += BoneTransform.Translation;
+                        Scale += BoneTransform.Scale;
+                        Orientation.Add(BoneTransform.Rotation);
+                    }
+
+                    const float Count = static_cast<float>(EndFrame - StartFrame);
+                    Result[CoarseIndex].Bones[Bone] = FXform(Orientation.Get(), Location / Count, Scale / Count);
+                }
+            }
+
+            return Result;
+        }
+
+        std::vector<float> UpsampleFloats(const std::vector<float>& CoarseValues, const int32_t DecimationFactor, const int32_t NumFrames)
+        {
+            // Linear interpolation of a coarse level array back to full rate.
+
+            std::vector<float> Result;
+            Result.reserve(NumFrames);
+
+            const int32_t LastCoarseFrame = static_cast<int32_t>(CoarseValues.size()) - 1;
+
+            for (int32_t FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+                const float CoarseTime = std::clamp(CoarseFrameTime(FrameIndex, DecimationFactor), 0.0f, static_cast<float>(LastCoarseFrame));
+                const int32_t CoarseFrame0 = static_cast<int32_t>(std::floor(CoarseTime));
+                const int32_t CoarseFrame1 = std::min(CoarseFrame0 + 1, LastCoarseFrame);
+                const float Alpha = CoarseTime - CoarseFrame0;
+
+                Result.push_back(CoarseValues[CoarseFrame0] + Alpha * (CoarseValues[CoarseFrame1] - CoarseValues[CoarseFrame0]));
+            }
+
+            return Result;
+        }
+
+        // Maps Value from the input range to the output range, clamped to the output range.
+        double MapRangeClamped(const double InA, const double InB, const double OutA, const double OutB, const double Value)
+        {
+            const double Divisor = InB - InA;
+            const double Percent = (std::abs(Divisor) <= SmallNumber) ? ((Value >= InB) ? 1.0 : 0.0) : (Value - InA) / Divisor;
+            return OutA + std::clamp(Percent, 0.0, 1.0) * (OutB - OutA);
+        }
+
+        // Where a pose stands on the ground: the pelvis projected on the ground, facing the same way
+        // as the root does.
+        FXform GetGroundFrame(const FPose& Pose, const EFacingAxis FacingAxis)
+        {
+            FPositionTrack ThighL;
+            FPositionTrack ThighR;
+            FPositionTrack Spine;
+            ThighL.Add(Pose[EBone::LeftThigh].Translation);
+            ThighR.Add(Pose[EBone::RightThigh].Translation);
+            Spine.Add(Pose[EBone::Spine01].Translation);
+
+            const FVec3& PelvisLocation = Pose[EBone::Pelvis].Translation;
+
+            return FXform(FacingRotationsFromHips(ThighL, ThighR, Spine, FacingAxis)[0], FVec3(PelvisLocation.X, PelvisLocation.Y, 0.0));
+        }
+
+        template <typename ElementType>
+        int64_t GetAllocatedSize(const std::vector<ElementType>& Array)
+        {
+            return static_cast<int64_t>(Array.capacity() * sizeof(ElementType));
+        }
+    }
+
+    FQuat4 FQuat4::operator*(const FQuat4& Other) const
+    {
+        return FQuat4(
+            W * Other.X + X * Other.W + Y * Other.Z - Z * Other.Y,
+            W * Other.Y - X * Other.Z + Y * Other.W + Z * Other.X,
+            W * Other.Z + X * Other.Y - Y * Other.X + Z * Other.W,
+            W * Other.W - X * Other.X - Y * Other.Y - Z * Other.Z
+        );
+    }
+
+    FVec3 FQuat4::RotateVector(const FVec3& Vector) const
+    {
+        const FVec3 Axis(X, Y, Z);
+        const FVec3 Twice = FVec3::Cross(Axis, Vector) * 2.0;
+        return Vector + Twice * W + FVec3::Cross(Axis, Twice);
+    }
+
+    void FQuat4::Normalize()
+    {
+        const double SquareSum = Dot(*this, *this);
+        if (SquareSum >= SmallNumber) {
+            const double Scale = 1.0 / std::sqrt(SquareSum);
+            X *= Scale;
+            Y *= Scale;
+            Z *= Scale;
+            W *= Scale;
+        } else {
+            *this = FQuat4();
+        }
+    }
+
+    FQuat4 FQuat4::Slerp(const FQuat4& A, const FQuat4& B, const float Alpha)
+    {
+        const double RawCosom = Dot(A, B);
+        const double Cosom = std::abs(RawCosom);
+
+        double ScaleA;
+        double ScaleB;
+        if (Cosom < 0.9999f) {
+            const double Omega = std::acos(Cosom);
+            const double InvSin = 1.0 / std::sin(Omega);
+            ScaleA = std::sin((1.0f - Alpha) * Omega) * InvSin;
+            ScaleB = std::sin(Alpha * Omega) * InvSin;
+        } else {
+            ScaleA = 1.0f - Alpha;
+            ScaleB = Alpha;
+        }
+
+        ScaleB = (RawCosom >= 0.0) ? ScaleB : -ScaleB;
+
+        FQuat4 Result(ScaleA * A.X + ScaleB * B.X, ScaleA * A.Y + ScaleB * B.Y, ScaleA * A.Z + ScaleB * B.Z, ScaleA * A.W + ScaleB * B.W);
+        Result.Normalize();
+        return Result;
+    }
+
+    FXform FXform::operator*(const FXform& Other) const
+    {
+        return FXform(Other.Rotation * Rotation, Other.Rotation.RotateVector(Other.Scale * Translation) + Other.Translation, Scale * Other.Scale);
+    }
+
+    FXform FXform::Inverse() const
+    {
+        const FQuat4 InverseRotation = Rotation.Inverse();
+        const FVec3 InverseScale = GetSafeScaleReciprocal(Scale);
+        return FXform(InverseRotation, InverseRotation.RotateVector(InverseScale * -Translation), InverseScale);
+    }
+
+    FXform FXform::GetRelativeTransform(const FXform& Other) const
+    {
+        const FVec3 SafeRecipScale = GetSafeScaleReciprocal(Other.Scale);
+        const FQuat4 InverseRotation = Other.Rotation.Inverse();
+        return FXform(InverseRotation * Rotation, InverseRotation.RotateVector(Translation - Other.Translation) * SafeRecipScale, Scale * SafeRecipScale);
+    }
+
+    int64_t FAnalysisOutput::GetAllocatedSize() const
+    {
+        return MMCore::GetAllocatedSize(Root) + MMCore::GetAllocatedSize(Pelvis) + MMCore::GetAllocatedSize(IkLeftFoot) + MMCore::GetAllocatedSize(IkRightFoot)
+            + MMCore::GetAllocatedSize(IkLeftHand) + MMCore::GetAllocatedSize(IkRightHand)
+            + MMCore::GetAllocatedSize(LeftBallSpeeds) + MMCore::GetAllocatedSize(RightBallSpeeds)
+            + MMCore::GetAllocatedSize(LeftFootContact) + MMCore::GetAllocatedSize(RightFootContact)
+            + MMCore::GetAllocatedSize(LeftFootLock) + MMCore::GetAllocatedSize(RightFootLock);
+    }
+
+    int32_t GetDecimationFactor(const FSettings& Settings, const float FrameRate)
+    {
+        return Settings.bMultiResolutionAnalysis ? std::max(1, RoundToInt(FrameRate / Settings.AnalysisFrameRate)) : 1;
+    }
+
+    int32_t GetAnalysisReach(const FSettings& Settings, const float FrameRate)
+    {
+        // How far away, in frames, a source frame can still change the composed root. The root at a
+        // frame averages the widest smoothing window, and the window size comes from the lowest
+        // velocity within the same margin, where every velocity is smoothed over another window and
+        // is a difference to the previous frame. On the coarse level of multi-resolution analysis,
+        // block averaging and interpolation add up to a few coarse frames on top. Must match
+        // ComputeRootTrack.
+
+        const int32_t MaxMargin = static_cast<int32_t>(FrameRate * Settings.TranslationSmoothingMaxSeconds / 2);
+        const int32_t SmoothVelocityMargin = static_cast<int32_t>(0.41f * FrameRate);
+
+        return MaxMargin + SmoothVelocityMargin + 1 + 3 * GetDecimationFactor(Settings, FrameRate);
+    }
+
+    FFrameRange GetAnalysisContext(const FSettings& Settings, const FFrameRange& FrameRange, const int32_t NumFrames, const float FrameRate)
+    {
+        // The frames that have to be sampled to produce FrameRange: the analysis reach on either
+        // side. The start is on a multiple of the decimation factor, so the coarse level of
+        // multi-resolution analysis is built from the same blocks as in a full apply. In cyclic mode,
+        // the context isn't clamped to the clip, and wraps around into the neighbouring cycles
+        // instead.
+
+        const int32_t Reach = GetAnalysisReach(Settings, FrameRate);
+        const int32_t DecimationFactor = GetDecimationFactor(Settings, FrameRate);
+
+        FFrameRange Context;
+
+        if (Settings.bCyclic && NumFrames > 1) {
+            Context.Start = FloorDivide(FrameRange.Start - Reach, DecimationFactor) * DecimationFactor;
+            Context.End = FrameRange.End + Reach;
+        } else {
+            Context.Start = std::max(0, FrameRange.Start - Reach) / DecimationFactor * DecimationFactor;
+            Context.End = std::min(NumFrames, FrameRange.End + Reach);
+        }
+
+        return Context;
+    }
+
+    std::vector<FPose> ExtendCyclic(const std::vector<FPose>& Cycle, const FFrameRange& Context, const EFacingAxis FacingAxis)
+    {
+        // Poses for a context that may extend past either end of a loop. The last frame of the loop
+        // is the first frame of the next cycle, so the loop repeats every NumFrames - 1 frames.
+        // Frames outside the clip are taken from the neighbouring cycle, and moved by the motion of
+        // one cycle per cycle away: the translation and turn on the ground between the first and
+        // last frame. Without that, a walk cycle would jump back to its start at the seam, and the
+        // smoothing windows would average across the jump. This way, every window sees a continuous
+        // path, and the clip is still only sampled once.
+
+        const int32_t NumFrames = static_cast<int32_t>(Cycle.size());
+        const int32_t Period = NumFrames - 1;
+
+        std::vector<FPose> Result(Context.Num());
+
+        if (NumFrames == 0) {
+            return Result;
+        }
+
+        // A single frame doesn't move, so every cycle is the same frame.
+        const FXform CycleTransform = (Period > 0) ? GetGroundFrame(Cycle[0], FacingAxis).Inverse() * GetGroundFrame(Cycle[Period], FacingAxis) : FXform();
+        const FXform InverseCycleTransform = CycleTransform.Inverse();
+
+        for (int32_t Frame = Context.Start; Frame < Context.End; ++Frame) {
+            FPose& Pose = Result[Frame - Context.Start];
+
+            if (Frame >= 0 && Frame < NumFrames) {
+                Pose = Cycle[Frame];
+                continue;
+            }
+
+            if (Period < 1) {
+                Pose = Cycle[0];
+                continue;
+            }
+
+            const int32_t NumCycles = FloorDivide(Frame, Period);
+            Pose = Cycle[Frame - NumCycles * Period];
+
+            FXform Shift;
+            for (int32_t CycleIndex = 0; CycleIndex < std::abs(NumCycles); ++CycleIndex) {
+                Shift = Shift * ((NumCycles > 0) ? CycleTransform : InverseCycleTransform);
+            }
+
+            for (FXform& Bone : Pose.Bones) {
+                Bone = Bone * Shift;
+            }
+        }
+
+        return Result;
+    }
+
+    bool Analyze(const std::vector<FPose>& Poses, const int32_t ContextStart, const FFrameRange& FrameRange, const float FrameRate, const FSettings& Settings, FAnalysisOutput& OutOutput, IAnalysisObserver* Observer)
+    {
+        // Everything up to, but not including, writing to the sequence: velocity table, smoothing,
+        // composing the root, rebasing pelvis and IK bones, the foot speeds, and the foot contact
+        // and lock curves if enabled. Returns false if cancelled.
+        //
+        // Only the frames in FrameRange are produced. The poses cover the analysis reach on either
+        // side, which is everything those frames depend on, so they come out exactly as in a full
+        // apply. Windows only get clamped at the edges of the context, which are too far away to
+        // matter, unless they are the edges of the sequence, where a full apply clamps too.
+
+        const float FrameTime = 1.0f / FrameRate;
+        const int32_t NumOutputFrames = FrameRange.Num();
+
+        OutOutput = FAnalysisOutput();
+        OutOutput.FirstFrame = FrameRange.Start;
+
+        // Reserve space
+        OutOutput.Root.reserve(NumOutputFrames);
+        OutOutput.Pelvis.reserve(NumOutputFrames);
+        OutOutput.IkLeftFoot.reserve(NumOutputFrames);
+        OutOutput.IkRightFoot.reserve(NumOutputFrames);
+        OutOutput.IkLeftHand.reserve(NumOutputFrames);
+        OutOutput.IkRightHand.reserve(NumOutputFrames);
+        OutOutput.LeftBallSpeeds.reserve(NumOutputFrames);
+        OutOutput.RightBallSpeeds.reserve(NumOutputFrames);
+
+        // The world position and the height above the composed root of each foot, collected while
+        // rebasing, for the contact curves.
+        const bool bFootContact = Settings.FootContact.bEnabled;
+        std::vector<FVec3> FootPositions[2];
+        std::vector<float> FootHeights[2];
+        if (bFootContact) {
+            for (int32_t Side = 0; Side < 2; ++Side) {
+                FootPositions[Side].reserve(NumOutputFrames);
+                FootHeights[Side].reserve(NumOutputFrames);
+            }
+        }
+
+        // The output arrays are reserved in full, so they count from the start.
+        if (Observer) {
+            Observer->AddWorkingSet(OutOutput.GetAllocatedSize());
+            if (bFootContact) {
+                Observer->AddWorkingSet(2 * (GetAllocatedSize(FootPositions[0]) + GetAllocatedSize(FootHeights[0])));
+            }
+        }
+
+        // Compose the smoothed root for every frame. The pelvis and IK bones are then rebased onto
+        // it.
+        const std::vector<FXform> RootTrack = ComputeRootTrack(Poses, FrameRate, Settings, Observer);
+
+        if (Observer) {
+            if (Observer->IsCancelled()) {
+                return false;
+            }
+            Observer->AddWorkingSet(GetAllocatedSize(RootTrack));
+            Observer->EnterStage(EStage::Rebasing, NumOutputFrames);
+        }
+
+        // Convert world -> local
+        for (int32_t FrameIndex = FrameRange.Start; FrameIndex < FrameRange.End; ++FrameIndex) {
+            const FPose& FrameWorld = Poses[FrameIndex - ContextStart];
+
+            // Update root (absolute) and pelvis (relative). Originally, without changes, this was
+            // the raw root, with the pelvis relative to it.
+            const FXform& RootWorldShifted = RootTrack[FrameIndex - ContextStart];
+            OutOutput.Root.push_back(RootWorldShifted);
+            OutOutput.Pelvis.push_back(FrameWorld[EBone::Pelvis].GetRelativeTransform(RootWorldShifted));
+
+            // Reconstruct IK Foot positions. The IK bones are attached to root, but since we're now
+            // shifting root around, we need to counter that movement in the IK Bones (which used to
+            // have feet and hands relative to 0, 0, 0).
+            OutOutput.IkLeftFoot.push_back(FrameWorld[EBone::LeftFoot].GetRelativeTransform(RootWorldShifted));
+            OutOutput.IkRightFoot.push_back(FrameWorld[EBone::RightFoot].GetRelativeTransform(RootWorldShifted));
+
+            if (bFootContact) {
+                FootPositions[0].push_back(FrameWorld[EBone::LeftFoot].Translation);
+                FootPositions[1].push_back(FrameWorld[EBone::RightFoot].Translation);
+                FootHeights[0].push_back(static_cast<float>(OutOutput.IkLeftFoot.back().Translation.Z));
+                FootHeights[1].push_back(static_cast<float>(OutOutput.IkRightFoot.back().Translation.Z));
+            }
+
+            // Reconstruct IK Hand positions. The Hand Gun bone is the real right hand (the right
+            // hand bone is just a null transform off of right hand gun). So we set Hand Gun and Left
+            // Hand to the world coordinates of their FK counterparts, and then redo their local
+            // coordinates off of the IK Hand Root, which is just a null transform all the way down to
+            // the ultimate root. But since we've shifted the root around with filtering, we'll get
+            // new local transforms that will maintain the IK positions correctly. We do the
+            // right-hand first, because the left hand is relative to the right hand for the IK bones.
+            const FXform& RightHandWorld = FrameWorld[EBone::RightHand];
+            OutOutput.IkRightHand.push_back(RightHandWorld.GetRelativeTransform(RootWorldShifted));
+            OutOutput.IkLeftHand.push_back(FrameWorld[EBone::LeftHand].GetRelativeTransform(RightHandWorld));
+
+            if (Observer) {
+                Observer->Step();
+            }
+        }
+
+        //
+        // FOOT SPEEDS
+        //
+
+        if (Observer) {
+            if (Observer->IsCancelled()) {
+                return false;
+            }
+            Observer->EnterStage(EStage::Curves, 2);
+        }
+
+        const std::vector<float> LeftBallSpeeds = GetBoneSpeeds(Poses, EBone::LeftBall, FrameTime);
+        const std::vector<float> RightBallSpeeds = GetBoneSpeeds(Poses, EBone::RightBall, FrameTime);
+        OutOutput.LeftBallSpeeds.assign(LeftBallSpeeds.begin() + (FrameRange.Start - ContextStart), LeftBallSpeeds.begin() + (FrameRange.End - ContextStart));
+        OutOutput.RightBallSpeeds.assign(RightBallSpeeds.begin() + (FrameRange.Start - ContextStart), RightBallSpeeds.begin() + (FrameRange.End - ContextStart));
+
+        if (Observer) {
+            Observer->AddWorkingSet(GetAllocatedSize(LeftBallSpeeds) + GetAllocatedSize(RightBallSpeeds));
+        }
+
+        //
+        // FOOT CONTACT AND LOCK
+        //
+        // FrameRange is the whole clip here, so the frames of a loop are the whole cycle.
+
+        if (bFootContact) {
+            const int32_t CyclePeriod = Settings.bCyclic ? NumOutputFrames - 1 : 0;
+            ComputeFootContactCurves(FootPositions[0], FootHeights[0], OutOutput.LeftBallSpeeds, FrameRate, CyclePeriod, Settings.FootContact, OutOutput.LeftFootContact, OutOutput.LeftFootLock);
+            ComputeFootContactCurves(FootPositions[1], FootHeights[1], OutOutput.RightBallSpeeds, FrameRate, CyclePeriod, Settings.FootContact, OutOutput.RightFootContact, OutOutput.RightFootLock);
+        }
+
+        return !Observer || !Observer->IsCancelled();
+    }
+
+    std::vector<FXform> ComputeRootTrack(const std::vector<FPose>& Poses, const float FrameRate, const FSettings& Settings, IAnalysisObserver* Observer)
+    {
+        // Composes the smoothed world-space root for every frame.
+
+        const int32_t NumFrames = static_cast<int32_t>(Poses.size());
+
+        std::vector<FXform> RootTrack;
+        RootTrack.reserve(NumFrames);
+
+        // Create smoothing margins in actual frames, based on window size in seconds. Half the
+        // smoothing window size, adjusted to frame rate.
+        const int32_t TranslationSmoothingMinMargin = static_cast<int32_t>(FrameRate * Settings.TranslationSmoothingMinSeconds / 2);
+        const int32_t TranslationSmoothingMaxMargin = static_cast<int32_t>(FrameRate * Settings.TranslationSmoothingMaxSeconds / 2);
+
+        // Get smoothed velocities of the pelvis bone for the whole sequence. We'll then analyze a
+        // window around current time and use the lowest found velocity to scale the root smoothing
+        // window size. This way, we can have a high degree of smoothing when we're far away from
+        // starts/stops/turns, and a lower degree of smoothing when the character is taking detailed
+        // actions.
+        if (Observer) {
+            Observer->EnterStage(EStage::VelocityTable, 1);
+        }
+
+        //
+        // In multi-resolution mode, this low-frequency analysis, and the wide smoothing windows
+        // below, run on a decimated copy of the tracks and are upsampled back to full rate. The
+        // velocity table and the windowed minimum only need to capture low-frequency motion anyway.
+        const int32_t SmoothVelocityMargin = static_cast<int32_t>(0.41f * FrameRate);
+        const int32_t DecimationFactor = GetDecimationFactor(Settings, FrameRate);
+        const bool bUseCoarseLevel = DecimationFactor > 1;
+
+        std::vector<FPose> CoarsePoses;
+        if (bUseCoarseLevel) {
+            CoarsePoses = Decimate(Poses, DecimationFactor);
+        }
+
+        auto GetLowestVelocities = [&](const std::initializer_list<EBone> Bones) {
+            std::vector<float> Result;
+
+            if (bUseCoarseLevel) {
+                const std::vector<float> CoarseVelocities = SmoothVelocitiesForBones(CoarsePoses, Bones, SmoothVelocityMargin / DecimationFactor, static_cast<int32_t>(FrameRate / DecimationFactor));
+
+                std::vector<float> CoarseLowestVelocities;
+                CoarseLowestVelocities.reserve(CoarseVelocities.size());
+                for (int32_t CoarseIndex = 0; CoarseIndex < static_cast<int32_t>(CoarseVelocities.size()); ++CoarseIndex) {
+                    CoarseLowestVelocities.push_back(LowestFloatValueInRange(CoarseVelocities, CoarseIndex, TranslationSmoothingMaxMargin / DecimationFactor));
+                }
+
+                Result = UpsampleFloats(CoarseLowestVelocities, DecimationFactor, NumFrames);
+            } else {
+                const std::vector<float> SmoothVelocities = SmoothVelocitiesForBones(Poses, Bones, SmoothVelocityMargin, static_cast<int32_t>(FrameRate));
+
+                Result.reserve(NumFrames);
+                for (int32_t FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+                    Result.push_back(LowestFloatValueInRange(SmoothVelocities, FrameIndex, TranslationSmoothingMaxMargin));
+                }
+            }
+
+            return Result;
+        };
+
+        const std::vector<float> LowestVelocities = GetLowestVelocities({ EBone::Pelvis });
+
+        // With separate foot smoothing, the feet and balls get their own margins, from the average
+        // speed of both balls. While walking, one foot is planted and the other swings, so that's
+        // about the speed of the body, but it drops when the feet do detailed work the pelvis
+        // barely shows, like shuffling in place or a quick side step, and keeps those sharper.
+        std::vector<float> FootLowestVelocities;
+        if (Settings.bSeparateFootSmoothing) {
+            FootLowestVelocities = GetLowestVelocities({ EBone::LeftBall, EBone::RightBall });
+        }
+
+        if (Observer) {
+            Observer->EnterStage(EStage::Smoothing, NumFrames);
+        }
+
+        // Smooth the bones of every frame first, and keep the hip triangles in SoA layout, so the
+        // facing of all frames can be computed in one pass before composing the root.
+        std::vector<FVec3> SmoothPelvisLocations;
+        std::vector<FVec3> SmoothFootCenters;
+        FPositionTrack SmoothThighsL;
+        FPositionTrack SmoothThighsR;
+        FPositionTrack SmoothSpines01;
+
+        SmoothPelvisLocations.reserve(NumFrames);
+        SmoothFootCenters.reserve(NumFrames);
+        SmoothThighsL.Reserve(NumFrames);
+        SmoothThighsR.Reserve(NumFrames);
+        SmoothSpines01.Reserve(NumFrames);
+
+        for (int32_t FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+            if (Observer) {
+                if (Observer->IsCancelled()) {
+                    break;
+                }
+                Observer->Step();
+            }
+
+            auto GetSmoothingMargin = [&](const float LowestVelocity) {
+                return static_cast<int32_t>(MapRangeClamped(
+                    Settings.TranslationVelocityMin, Settings.TranslationVelocityMax,
+                    TranslationSmoothingMinMargin, TranslationSmoothingMaxMargin,
+                    LowestVelocity
+                ));
+            };
+
+            const int32_t RootSmoothing = GetSmoothingMargin(LowestVelocities[FrameIndex]);
+            const int32_t FootSmoothing = Settings.bSeparateFootSmoothing ? GetSmoothingMargin(FootLowestVelocities[FrameIndex]) : RootSmoothing;
+
+            FSmoothingMargins Margins;
+            Margins[SmoothedPelvis] = RootSmoothing;
+            Margins[SmoothedLeftThigh] = RootSmoothing;
+            Margins[SmoothedRightThigh] = RootSmoothing;
+            Margins[SmoothedSpine01] = RootSmoothing;
+            Margins[SmoothedLeftFoot] = FootSmoothing;
+            Margins[SmoothedRightFoot] = FootSmoothing;
+            Margins[SmoothedLeftBall] = FootSmoothing;
+            Margins[SmoothedRightBall] = FootSmoothing;
+
+            // Wide windows are averaged on the coarse level. Fine detail is only kept where the
+            // margin is small, i.e. around starts, stops and turns. The two levels each take one
+            // sweep, for the bones whose margins fall on them.
+            FSmoothingMargins FineMargins;
+            FSmoothingMargins CoarseMargins;
+            for (int32_t Slot = 0; Slot < NumSmoothedBones; ++Slot) {
+                const bool bSmoothOnCoarseLevel = bUseCoarseLevel && Margins[Slot] >= 2 * DecimationFactor;
+                FineMargins[Slot] = bSmoothOnCoarseLevel ? -1 : Margins[Slot];
+                CoarseMargins[Slot] = bSmoothOnCoarseLevel ? Margins[Slot] : -1;
+            }
+
+            FSmoothedTranslations Smoothed;
+            SmoothBoneTranslations(Poses, FrameIndex, FineMargins, Smoothed);
+            if (bUseCoarseLevel) {
+                SmoothBoneTranslationsUpsampled(CoarsePoses, FrameIndex, CoarseMargins, DecimationFactor, Smoothed);
+            }
+
+            // Smooth sample pelvis
+            SmoothPelvisLocations.push_back(Smoothed[SmoothedPelvis]);
+
+            // Smooth sample average of balls of foot as an alternative root.
+            SmoothFootCenters.push_back((Smoothed[SmoothedLeftBall] + Smoothed[SmoothedRightBall] + Smoothed[SmoothedLeftFoot] + Smoothed[SmoothedRightFoot]) / 4);
+
+            // The forward vector comes from the normal of thigh_r, thigh_l and spine_01, see below.
+            SmoothThighsR.Add(Smoothed[SmoothedRightThigh]);
+            SmoothThighsL.Add(Smoothed[SmoothedLeftThigh]);
+            SmoothSpines01.Add(Smoothed[SmoothedSpine01]);
+        }
+
+        // Get the forward vector from the normal of thigh_r, thigh_l and spine_01 for all frames.
+        // Then convert to pure yaw and assign to root.
+        const std::vector<FQuat4> FacingRotations = FacingRotationsFromHips(SmoothThighsL, SmoothThighsR, SmoothSpines01, Settings.FacingAxis);
+
+        // This is where the scratch peaks. The caller accounts for the returned root track itself.
+        const int64_t ScratchBytes = GetAllocatedSize(CoarsePoses) + GetAllocatedSize(LowestVelocities) + GetAllocatedSize(FootLowestVelocities)
+            + GetAllocatedSize(SmoothPelvisLocations) + GetAllocatedSize(SmoothFootCenters)
+            + SmoothThighsL.GetAllocatedSize() + SmoothThighsR.GetAllocatedSize() + SmoothSpines01.GetAllocatedSize()
+            + GetAllocatedSize(FacingRotations) + GetAllocatedSize(RootTrack);
+        if (Observer) {
+            Observer->AddWorkingSet(ScratchBytes);
+            Observer->ReleaseWorkingSet(ScratchBytes);
+        }
+
+        for (int32_t FrameIndex = 0; FrameIndex < static_cast<int32_t>(FacingRotations.size()); ++FrameIndex) {
+            const FVec3& SmoothFootCenter = SmoothFootCenters[FrameIndex];
+            const FQuat4& FacingRotation = FacingRotations[FrameIndex];
+
+            // Create the root motion by combining forward motion of pelvis, orientation of hip, and
+            // side-to-side motion of the foot average. The original used the foot center on the
+            // ground on its own.
+            FXform RootWorldShifted = Poses[FrameIndex][EBone::Root];
+            const FVec3 SmoothFootCenterGround(SmoothFootCenter.X, SmoothFootCenter.Y, 0.0);
+            RootWorldShifted.Translation = ComposeGroundMotion(SmoothPelvisLocations[FrameIndex], SmoothFootCenterGround, FacingRotation, Settings.FacingAxis);
+            RootWorldShifted.Rotation = FacingRotation;
+
+            RootTrack.push_back(RootWorldShifted);
+        }
+
+        return RootTrack;
+    }
+
+    std::vector<FQuat4> FacingRotationsFromHips(const FPositionTrack& ThighL, const FPositionTrack& ThighR, const FPositionTrack& Spine, const EFacingAxis FacingAxis)
+    {
+        // The facing of every frame is the normal of thigh_r, thigh_l and spine_01, flattened on the
+        // ground and converted to pure yaw. This runs over whole tracks in SoA layout, without
+        // branches in the loop, so the compiler can vectorize it. That takes -fno-math-errno with GCC
+        // and Clang, which the standalone build sets. Otherwise the sqrt keeps an errno fallback
+        // call, and the loop stays scalar. Check with -fopt-info-vec after changing the loop.
+        //
+        // Flattening only keeps the ground components of the normal, so the vertical one is never
+        // computed, and nothing needs normalizing until the end. Instead of Atan2 followed by the sin
+        // and cos in the quaternion constructor, the yaw quaternion is built straight from the ground
+        // direction: for a direction (C, S) of length L at angle A, (sin A/2, cos A/2) is
+        // proportional to (S, L + C). When facing backwards, L + C cancels out, so there we use the
+        // equivalent (sign(S) * (L - C), |S|). The result matches a rotation of Atan2(S, C) around Z.
+        // Rather than picking one of the two with a branch, both are computed and blended.
+
+        const int32_t NumFrames = ThighL.Num();
+
+        // For Y-forward, rotate the normal 90 degrees: swap X/Y and negate. Z-forward faces along X.
+        const bool bYForward = FacingAxis == EFacingAxis::Y;
+
+        // Written in place, as one output. The compiler has to check at runtime that the output
+        // doesn't overlap any of the nine inputs, and gives up on vectorizing beyond ten checks,
+        // which separate Z and W arrays would take. Plain pointers, so the stores can't alias the
+        // vectors' own data pointers, which would then be reloaded every frame.
+        std::vector<FQuat4> Result(NumFrames);
+        FQuat4* Rotations = Result.data();
+
+        const double* ThighLX = ThighL.X.data();
+        const double* ThighLY = ThighL.Y.data();
+        const double* ThighLZ = ThighL.Z.data();
+        const double* ThighRX = ThighR.X.data();
+        const double* ThighRY = ThighR.Y.data();
+        const double* ThighRZ = ThighR.Z.data();
+        const double* SpineX = Spine.X.data();
+        const double* SpineY = Spine.Y.data();
+        const double* SpineZ = Spine.Z.data();
+
+        for (int32_t Frame = 0; Frame < NumFrames; ++Frame) {
+            // thigh_r to thigh_l (points left), and thigh_r to spine_01 (points up/forward)
+            const double Edge1X = ThighLX[Frame] - ThighRX[Frame];
+            const double Edge1Y = ThighLY[Frame] - ThighRY[Frame];
+            const double Edge1Z = ThighLZ[Frame] - ThighRZ[Frame];
+            const double Edge2X = SpineX[Frame] - ThighRX[Frame];
+            const double Edge2Y = SpineY[Frame] - ThighRY[Frame];
+            const double Edge2Z = SpineZ[Frame] - ThighRZ[Frame];
+
+            // Ground components of Edge2 x Edge1 (swapped order to reverse the direction)
+            const double NormalX = Edge2Y * Edge1Z - Edge2Z * Edge1Y;
+            const double NormalY = Edge2Z * Edge1X - Edge2X * Edge1Z;
+
+            const double Cos = bYForward ? NormalY : NormalX;
+            const double Sin = bYForward ? -NormalX : NormalY;
+            const double Length = std::sqrt(Cos * Cos + Sin * Sin);
+
+            // Both candidates are computed and blended with a 0/1 mask instead of branching. With
+            // L + |C|, the sum never cancels: it's L + C facing forwards, and L - C facing backwards.
+            const double Forward = 0.5 + std::copysign(0.5, Cos);
+            const double LengthPlusAbsCos = Length + std::abs(Cos);
+            const double HalfSinForward = Sin;
+            const double HalfSinBackward = std::copysign(LengthPlusAbsCos, Sin);
+            const double HalfCosForward = LengthPlusAbsCos;
+            const double HalfCosBackward = std::abs(Sin);
+
+            // A collapsed or horizontal hip triangle has no ground direction. All four candidates
+            // are zero then, and adding the mask to HalfCos gives no rotation, like Atan2(0, 0) did.
+            const double Invalid = static_cast<double>(Length <= 0.0);
+
+            const double HalfSin = Forward * HalfSinForward + (1.0 - Forward) * HalfSinBackward;
+            const double HalfCos = Forward * HalfCosForward + (1.0 - Forward) * HalfCosBackward + Invalid;
+            const double InvNorm = 1.0 / std::sqrt(HalfSin * HalfSin + HalfCos * HalfCos);
+
+            Rotations[Frame].Z = HalfSin * InvNorm;
+            Rotations[Frame].W = HalfCos * InvNorm;
+        }
+
+        return Result;
+    }
+
+    FVec3 ComposeGroundMotion(const FVec3& PelvisPos, const FVec3& FootPlanePos, const FQuat4& FootPlaneRot, const EFacingAxis FacingAxis)
+    {
+        // This function composes the ground motion from a combination of pelvis and foot motion. The
+        // most reliable forward/backward movement comes from the pelvis bone, because it moves along
+        // with the body's mass, and has realistic intertia. But this bone has sideways bobbing, and
+        // doesn't do a good job of creating a path through the middle of the character's motion,
+        // which is preferred for motion matching. Conversely, the most reliable lateral position
+        // comes from an average of the foot bones (ball + foot in each side), which creates a sort of
+        // virtual bone suspended between the feet. The sideways motion of this virtual bone is
+        // extremely stable, but its forward motion speeds up and slows down along with the walking
+        // motion.
+        //
+        // This function expects a smoothed PelvisPos and a smoothed FootPlanePos and Rotation. It
+        // projects the pelvis down on to the foot plane, and then projects that plane point onto the
+        // plane's forward axis.
+
+        // 1. Get the foot plane's normal (Z axis) and forward (the chosen facing axis)
+        const FVec3 FootPlaneNormal = FootPlaneRot.GetAxisZ();
+
+        // This honors the chosen forward direction. But to be clear, this worked even by always
+        // getting the X axis, so mathematically, this is not so important. This forward direction
+        // isn't used as deeply as one would think. After all, we're just piecing together a ground
+        // position by duct-taping different axis of several inputs together.
+        const FVec3 FootPlaneForward = GetSafeNormal(GetFacingAxis(FootPlaneRot, FacingAxis));
+
+        // 2. Project pelvis onto the foot plane
+        const FVec3 PelvisToPlane = PelvisPos - FootPlanePos;
+        const float DistanceToPlane = static_cast<float>(FVec3::Dot(PelvisToPlane, FootPlaneNormal));
+        const FVec3 PelvisOnPlane = PelvisPos - (FootPlaneNormal * DistanceToPlane);
+
+        // 3. Project pelvis onto the foot plane's forward axis
+        const FVec3 PelvisOnPlaneDelta = PelvisOnPlane - FootPlanePos;
+        const float ForwardDistance = static_cast<float>(FVec3::Dot(PelvisOnPlaneDelta, FootPlaneForward));
+
+        // 4. Composed position on the plane's forward axis
+        return FootPlanePos + (FootPlaneForward * ForwardDistance);
+    }
+
+    FVec3 GetFacingAxis(const FQuat4& Rotation, const EFacingAxis FacingAxis)
+    {
+        // The axis of a root rotation that points in the chosen facing direction.
+
+        switch (FacingAxis) {
+        case EFacingAxis::Y:
+            return Rotation.GetAxisY();
+        case EFacingAxis::Z:
+            // If you ever use Z, define what "forward on the plane" means here.
+            return Rotation.GetAxisX(); // or some custom mapping
+        case EFacingAxis::X:
+        default:
+            return Rotation.GetAxisX();
+        }
+    }
+
+    std::vector<float> GetBoneSpeeds(const std::vector<FPose>& Poses, const EBone Bone, const float FrameTime)
+    {
+        // Speed of the bone towards the next frame, in units/sec. Used for the foot speed curves.
+
+        const int32_t NumFrames = static_cast<int32_t>(Poses.size());
+
+        std::vector<float> Result;
+        Result.reserve(NumFrames);
+
+        for (int32_t FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+            float Speed = 0.0f;
+
+            // For the last frame, just use the same velocity as the previous frame (or 0 if this is
+            // the only frame).
+            if (FrameIndex == NumFrames - 1) {
+                Speed = Result.empty() ? 0.0f : Result.back();
+            } else {
+                // Normal case: calculate velocity to next frame
+                Speed = static_cast<float>(FVec3::Dist(Poses[FrameIndex + 1][Bone].Translation, Poses[FrameIndex][Bone].Translation) / FrameTime);
+            }
+
+            Result.push_back(Speed);
+        }
+
+        return Result;
+    }
+
+    void ComputeFootContactCurves(const std::vector<FVec3>& FootPositions, const std::vector<float>& FootHeights, const std::vector<float>& BallSpeeds, const float FrameRate, const int32_t CyclePeriod, const FFootContactSettings& Settings, std::vector<float>& OutContact, std::vector<float>& OutLock)
+    {
+        // A foot is in contact while it's both slow and low. Speed is the slower of the foot bone and
+        // the ball, so standing on the heel or rolling over the ball both count, averaged over a few
+        // frames to ignore key noise. Height is relative to the composed root, above the lowest the
+        // foot gets within half a second either side, which serves as the local ground whatever the
+        // ankle height of the rig, and also on slopes and stairs. Starting and ending a contact use
+        // separate thresholds, so noise around a threshold doesn't make the contact flicker.
+        //
+        // Contacts shorter than the minimum are dropped. Lock follows contact, but ramps up and down
+        // over the blend time at either end, for foot IK to blend with. A contact at the start or end
+        // of the sequence is already locked there. Every step is one or two passes over the frames.
+        //
+        // For a loop, a CyclePeriod of more than zero, speeds and heights are extended by a whole
+        // cycle on either side. That's enough for the hysteresis to settle into the same state it has
+        // when coming around from the previous cycle, and contacts across the seam are seen in one
+        // piece.
+
+        const int32_t NumClipFrames = static_cast<int32_t>(FootPositions.size());
+        const float FrameTime = 1.0f / FrameRate;
+
+        OutContact.assign(NumClipFrames, 0.0f);
+        OutLock.assign(NumClipFrames, 0.0f);
+
+        if (NumClipFrames == 0) {
+            return;
+        }
+
+        constexpr float SpeedAveragingSeconds = 0.033f;
+        constexpr float GroundWindowSeconds = 0.5f;
+
+        // Speed towards the next frame, as in GetBoneSpeeds.
+        std::vector<float> Speeds(NumClipFrames);
+
+        float FootSpeed = 0.0f;
+        for (int32_t FrameIndex = 0; FrameIndex < NumClipFrames; ++FrameIndex) {
+            if (FrameIndex < NumClipFrames - 1) {
+                FootSpeed = static_cast<float>(FVec3::Dist(FootPositions[FrameIndex + 1], FootPositions[FrameIndex]) / FrameTime);
+            }
+            Speeds[FrameIndex] = std::min(FootSpeed, BallSpeeds[FrameIndex]);
+        }
+
+        std::vector<float> Heights = FootHeights;
+
+        // The last frame of a loop is the first frame of the next cycle, so it moves like the first.
+        const int32_t Padding = (CyclePeriod > 0) ? CyclePeriod : 0;
+        if (Padding > 0) {
+            Speeds[NumClipFrames - 1] = Speeds[0];
+            Speeds = WrapFloats(Speeds, CyclePeriod, Padding);
+            Heights = WrapFloats(Heights, CyclePeriod, Padding);
+        }
+
+        const int32_t NumFrames = static_cast<int32_t>(Speeds.size());
+
+        Speeds = MovingAverage(Speeds, RoundToInt(SpeedAveragingSeconds * FrameRate));
+
+        const std::vector<float> Ground = SlidingMinimum(Heights, RoundToInt(GroundWindowSeconds * FrameRate));
+
+        std::vector<float> Contact(NumFrames, 0.0f);
+        std::vector<float> Lock(NumFrames, 0.0f);
+
+        // Hysteresis
+        bool bInContact = false;
+        for (int32_t FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+            const float Speed = Speeds[FrameIndex];
+            const float Height = Heights[FrameIndex] - Ground[FrameIndex];
+
+            if (bInContact) {
+                bInContact = Speed <= Settings.ExitSpeed && Height <= Settings.ExitHeight;
+            } else {
+                bInContact = Speed < Settings.EnterSpeed && Height < Settings.EnterHeight;
+            }
+
+            Contact[FrameIndex] = bInContact ? 1.0f : 0.0f;
+        }
+
+        // Drop short contacts and ramp the lock, one contact at a time.
+        const int32_t MinContactFrames = std::max(1, RoundToInt(Settings.MinSeconds * FrameRate));
+        const float BlendFrames = std::max(1.0f, Settings.LockBlendSeconds * FrameRate);
+
+        for (int32_t Start = 0; Start < NumFrames;) {
+            if (Contact[Start] == 0.0f) {
+                ++Start;
+                continue;
+            }
+
+            int32_t End = Start;
+            while (End + 1 < NumFrames && Contact[End + 1] != 0.0f) {
+                ++End;
+            }
+
+            if (End - Start + 1 < MinContactFrames) {
+                for (int32_t FrameIndex = Start; FrameIndex <= End; ++FrameIndex) {
+                    Contact[FrameIndex] = 0.0f;
+                }
+            } else {
+                for (int32_t FrameIndex = Start; FrameIndex <= End; ++FrameIndex) {
+                    const int32_t FromStart = (Start == 0) ? INT32_MAX : FrameIndex - Start + 1;
+                    const int32_t ToEnd = (End == NumFrames - 1) ? INT32_MAX : End - FrameIndex + 1;
+                    Lock[FrameIndex] = std::min(1.0f, std::min(FromStart, ToEnd) / BlendFrames);
+                }
+            }
+
+            Start = End + 1;
+        }
+
+        OutContact.assign(Contact.begin() + Padding, Contact.begin() + Padding + NumClipFrames);
+        OutLock.assign(Lock.begin() + Padding, Lock.begin() + Padding + NumClipFrames);
+    }
+
+    float HighestFloatValueInRange(const std::vector<float>& Values, const int32_t FrameIndex, const int32_t Margin)
+    {
+        const int32_t NumValues = static_cast<int32_t>(Values.size());
+        const int32_t StartIndex = std::max(0, FrameIndex - Margin);
+        const int32_t EndIndex = std::min(NumValues - 1, FrameIndex + Margin);
+
+        if (StartIndex > EndIndex) {
+            return 999;
+        }
+
+        float Result = Values[StartIndex];
+        for (int32_t i = StartIndex + 1; i <= EndIndex; ++i) {
+            Result = std::max(Result, Values[i]);
+        }
+
+        return Result;
+    }
+
+    int32_t WindowSizeFromDivergence(const std::vector<float>& Values, const int32_t FrameIndex, const float PercentDivergence)
+    {
+        // NOTE: Currently not used. Having a dynamic window size this way caused artifacts around
+        // changes in window size, jumping as glitches in the root path.
+        //
+        // Detects a window size we can use for translation and rotation smoothing based on changes in
+        // velocity. We start from a center value, and expand outwards until we find a velocity value
+        // that diverges more than e.g. 10% (PercentDivergence = 0.1). This auto-sizes the window to
+        // velocities that are more or less similar. Returns the margin that can be used for root
+        // smoothing and facing smoothing. NOTE: This expects the Values to be valocity values that
+        // are already smoothed. Without pre-smoothing, we can get some drastic edge effects as the
+        // window size changes from frame to frame and we suddenly include frames in the smoothing or
+        // not. By pre-smoothing, we ensure that there are no surprises lurking right outside the
+        // horizon that suddenly change the averaging when we expand to include them.
+
+        const int32_t NumValues = static_cast<int32_t>(Values.size());
+        const float InitialValue = Values[FrameIndex];
+
+        // When we stop, we want to return the previous spread value, not the current value where we
+        // overshot.
+        int32_t PreviousSpread = 0;
+
+        for (int32_t Spread = 0; Spread < 1000; ++Spread) {
+            const int32_t LeftIndex = FrameIndex - Spread;
+            if (LeftIndex >= 0) {
+                const float ValueAtIndex = Values[LeftIndex];
+                if (std::abs(ValueAtIndex - InitialValue) / InitialValue > PercentDivergence) {
+                    return PreviousSpread;
+                }
+            }
+
+            const int32_t RightIndex = FrameIndex + Spread;
+            if (RightIndex < NumValues) {
+                const float ValueAtIndex = Values[RightIndex];
+                if (std::abs(ValueAtIndex - InitialValue) / InitialValue > PercentDivergence) {
+                    return PreviousSpread;
+                }
+            }
+
+            PreviousSpread = Spread;
+        }
+
+        // Return a zero window size. I don't know exactly what this would mean.
+        return 0;
+    }
+}
@@ -0,0 +1,278 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// The analysis behind UMotionMatchingPrep, without the engine: velocity table, adaptive smoothing,
+// hip facing, composing the ground motion, rebasing the pelvis and IK bones, foot speeds and foot
+// contact. It only depends on the standard library, so the same code runs inside the editor, where
+// the modifier samples the bones and writes the keys, and in the standalone command line tool,
+// which reads and writes the files in MotionMatchingCoreFormat.h.
+//
+// The math types mirror the engine's conventions (Z up, quaternions as X, Y, Z, W, and transforms
+// that apply A first in A * B), and do the same math in the same precision, so the editor and the
+// command line tool produce the same keys from the same poses.
+namespace MMCore
+{
+    struct FVec3
+    {
+        double X = 0.0;
+        double Y = 0.0;
+        double Z = 0.0;
+
+        FVec3() = default;
+        FVec3(const double InX, const double InY, const double InZ) : X(InX), Y(InY), Z(InZ) {}
+
+        FVec3 operator+(const FVec3& Other) const { return FVec3(X + Other.X, Y + Other.Y, Z + Other.Z); }
+        FVec3 operator-(const FVec3& Other) const { return FVec3(X - Other.X, Y - Other.Y, Z - Other.Z); }
+        FVec3 operator*(const FVec3& Other) const { return FVec3(X * Other.X, Y * Other.Y, Z * Other.Z); }
+        FVec3 operator*(const double Scale) const { return FVec3(X * Scale, Y * Scale, Z * Scale); }
+        FVec3 operator/(const double Scale) const { return FVec3(X / Scale, Y / Scale, Z / Scale); }
+        FVec3 operator-() const { return FVec3(-X, -Y, -Z); }
+        FVec3& operator+=(const FVec3& Other) { X += Other.X; Y += Other.Y; Z += Other.Z; return *this; }
+
+        double Size() const { return std::sqrt(X * X + Y * Y + Z * Z); }
+
+        static double Dot(const FVec3& A, const FVec3& B) { return A.X * B.X + A.Y * B.Y + A.Z * B.Z; }
+        static FVec3 Cross(const FVec3& A, const FVec3& B) { return FVec3(A.Y * B.Z - A.Z * B.Y, A.Z * B.X - A.X * B.Z, A.X * B.Y - A.Y * B.X); }
+        static double Dist(const FVec3& A, const FVec3& B) { return (A - B).Size(); }
+        static FVec3 Lerp(const FVec3& A, const FVec3& B, const float Alpha) { return A + (B - A) * Alpha; }
+    };
+
+    struct FQuat4
+    {
+        double X = 0.0;
+        double Y = 0.0;
+        double Z = 0.0;
+        double W = 1.0;
+
+        FQuat4() = default;
+        FQuat4(const double InX, const double InY, const double InZ, const double InW) : X(InX), Y(InY), Z(InZ), W(InW) {}
+
+        // Rotates by Other first, then by this.
+        FQuat4 operator*(const FQuat4& Other) const;
+
+        FQuat4 Inverse() const { return FQuat4(-X, -Y, -Z, W); }
+        FVec3 RotateVector(const FVec3& Vector) const;
+        FVec3 UnrotateVector(const FVec3& Vector) const { return Inverse().RotateVector(Vector); }
+
+        FVec3 GetAxisX() const { return RotateVector(FVec3(1.0, 0.0, 0.0)); }
+        FVec3 GetAxisY() const { return RotateVector(FVec3(0.0, 1.0, 0.0)); }
+        FVec3 GetAxisZ() const { return RotateVector(FVec3(0.0, 0.0, 1.0)); }
+
+        // Unit length, or no rotation if too close to zero to normalize.
+        void Normalize();
+
+        static double Dot(const FQuat4& A, const FQuat4& B) { return A.X * B.X + A.Y * B.Y + A.Z * B.Z + A.W * B.W; }
+        static FQuat4 Slerp(const FQuat4& A, const FQuat4& B, const float Alpha);
+    };
+
+    struct FXform
+    {
+        FQuat4 Rotation;
+        FVec3 Translation;
+        FVec3 Scale = FVec3(1.0, 1.0, 1.0);
+
+        FXform() = default;
+        FXform(const FQuat4& InRotation, const FVec3& InTranslation, const FVec3& InScale = FVec3(1.0, 1.0, 1.0))
+            : Rotation(InRotation)
+            , Translation(InTranslation)
+            , Scale(InScale)
+        {
+        }
+
+        // Applies this first, then Other.
+        FXform operator*(const FXform& Other) const;
+
+        FXform Inverse() const;
+
+        // This relative to Other, i.e. this * Other.Inverse().
+        FXform GetRelativeTransform(const FXform& Other) const;
+
+        FVec3 TransformPosition(const FVec3& Position) const { return Rotation.RotateVector(Scale * Position) + Translation; }
+    };
+
+    // The bones the analysis reads, in the same order as the tracked roles of EMMBoneRole.
+    enum class EBone : uint8_t
+    {
+        Root,
+        Pelvis,
+        LeftThigh,
+        RightThigh,
+        Spine01,
+        LeftFoot,
+        RightFoot,
+        LeftBall,
+        RightBall,
+        LeftHand,
+        RightHand,
+
+        Num,
+    };
+
+    constexpr int32_t NumBones = static_cast<int32_t>(EBone::Num);
+
+    // Component space transforms of every bone at one frame.
+    struct FPose
+    {
+        FXform Bones[NumBones];
+
+        const FXform& operator[](const EBone Bone) const { return Bones[static_cast<int32_t>(Bone)]; }
+        FXform& operator[](const EBone Bone) { return Bones[static_cast<int32_t>(Bone)]; }
+    };
+
+    // Positions of one bone over time as structure-of-arrays, for kernels that process a whole track
+    // several frames at a time.
+    struct FPositionTrack
+    {
+        std::vector<double> X;
+        std::vector<double> Y;
+        std::vector<double> Z;
+
+        void Reserve(const int32_t NumFrames)
+        {
+            X.reserve(NumFrames);
+            Y.reserve(NumFrames);
+            Z.reserve(NumFrames);
+        }
+
+        void Add(const FVec3& Position)
+        {
+            X.push_back(Position.X);
+            Y.push_back(Position.Y);
+            Z.push_back(Position.Z);
+        }
+
+        int32_t Num() const { return static_cast<int32_t>(X.size()); }
+        int64_t GetAllocatedSize() const { return static_cast<int64_t>(X.capacity() + Y.capacity() + Z.capacity()) * sizeof(double); }
+    };
+
+    // Frames from Start up to, but not including, End.
+    struct FFrameRange
+    {
+        int32_t Start = 0;
+        int32_t End = 0;
+
+        int32_t Num() const { return End - Start; }
+    };
+
+    enum class EFacingAxis : uint8_t
+    {
+        X,
+        Y,
+        Z,
+    };
+
+    struct FFootContactSettings
+    {
+        bool bEnabled = false; // Analyze also produces the contact and lock curves
+        float EnterSpeed = 15.0f;
+        float ExitSpeed = 30.0f;
+        float EnterHeight = 5.0f;
+        float ExitHeight = 10.0f;
+        float MinSeconds = 0.1f;
+        float LockBlendSeconds = 0.15f;
+    };
+
+    // The analysis settings of the modifier, with the same defaults.
+    struct FSettings
+    {
+        float TranslationVelocityMin = 5.0f;
+        float TranslationVelocityMax = 25.0f;
+        float TranslationSmoothingMinSeconds = 0.083f;
+        float TranslationSmoothingMaxSeconds = 0.41f;
+        bool bSeparateFootSmoothing = false;
+        EFacingAxis FacingAxis = EFacingAxis::Y;
+        bool bMultiResolutionAnalysis = false;
+        float AnalysisFrameRate = 30.0f;
+        bool bCyclic = false;
+        FFootContactSettings FootContact;
+    };
+
+    enum class EStage : uint8_t
+    {
+        VelocityTable,
+        Smoothing,
+        Rebasing,
+        Curves,
+    };
+
+    // Progress, cancellation and memory accounting of a running analysis. The editor forwards these
+    // to its background apply notification, the command line tool doesn't need any.
+    class IAnalysisObserver
+    {
+    public:
+        virtual ~IAnalysisObserver() = default;
+
+        virtual void EnterStage(const EStage Stage, const int32_t NumSteps) = 0;
+        virtual void Step() = 0;
+        virtual bool IsCancelled() const = 0;
+        virtual void AddWorkingSet(const int64_t Bytes) = 0;
+        virtual void ReleaseWorkingSet(const int64_t Bytes) = 0;
+    };
+
+    // Keys for the frames of one analysis, in the bone spaces they're written in. The root is the
+    // top of the hierarchy, so its keys are also the world space root track.
+    struct FAnalysisOutput
+    {
+        int32_t FirstFrame = 0;
+
+        std::vector<FXform> Root;
+        std::vector<FXform> Pelvis;
+        std::vector<FXform> IkLeftFoot;
+        std::vector<FXform> IkRightFoot;
+        std::vector<FXform> IkLeftHand;  // Relative to the right hand
+        std::vector<FXform> IkRightHand; // Written to the hand gun bone
+
+        std::vector<float> LeftBallSpeeds;
+        std::vector<float> RightBallSpeeds;
+
+        // Only with foot contact enabled, for the same frames as the keys.
+        std::vector<float> LeftFootContact;
+        std::vector<float> RightFootContact;
+        std::vector<float> LeftFootLock;
+        std::vector<float> RightFootLock;
+
+        int32_t Num() const { return static_cast<int32_t>(Root.size()); }
+        int64_t GetAllocatedSize() const;
+    };
+
+    int32_t GetDecimationFactor(const FSettings& Settings, const float FrameRate);
+
+    // How far away, in frames, a source frame can still change the composed root.
+    int32_t GetAnalysisReach(const FSettings& Settings, const float FrameRate);
+
+    // The frames that have to be analyzed to produce FrameRange of a clip of NumFrames frames. In
+    // cyclic mode, the context can extend past either end of the clip.
+    FFrameRange GetAnalysisContext(const FSettings& Settings, const FFrameRange& FrameRange, const int32_t NumFrames, const float FrameRate);
+
+    // The poses of a cyclic analysis context, from the poses of the whole loop.
+    std::vector<FPose> ExtendCyclic(const std::vector<FPose>& Cycle, const FFrameRange& Context, const EFacingAxis FacingAxis);
+
+    // Everything from the poses of the analysis context to the keys of FrameRange. Poses[0] is the
+    // frame ContextStart. With foot contact enabled, FrameRange has to be the whole clip, since a
+    // contact depends on every frame before it. Returns false if cancelled.
+    bool Analyze(const std::vector<FPose>& Poses, const int32_t ContextStart, const FFrameRange& FrameRange, const float FrameRate, const FSettings& Settings, FAnalysisOutput& OutOutput, IAnalysisObserver* Observer = nullptr);
+
+    // The smoothed world space root of every frame. The offline evaluator sweeps the velocity range
+    // of the settings.
+    std::vector<FXform> ComputeRootTrack(const std::vector<FPose>& Poses, const float FrameRate, const FSettings& Settings, IAnalysisObserver* Observer = nullptr);
+
+    std::vector<FQuat4> FacingRotationsFromHips(const FPositionTrack& ThighL, const FPositionTrack& ThighR, const FPositionTrack& Spine, const EFacingAxis FacingAxis);
+    FVec3 ComposeGroundMotion(const FVec3& PelvisPos, const FVec3& FootPlanePos, const FQuat4& FootPlaneRot, const EFacingAxis FacingAxis);
+    FVec3 GetFacingAxis(const FQuat4& Rotation, const EFacingAxis FacingAxis);
+
+    // Speed of the bone towards the next frame, in units/sec.
+    std::vector<float> GetBoneSpeeds(const std::vector<FPose>& Poses, const EBone Bone, const float FrameTime);
+
+    // Contact (0 or 1) and lock (0 to 1) of one foot. A CyclePeriod of more than zero treats the
+    // frames as a loop of that period.
+    void ComputeFootContactCurves(const std::vector<FVec3>& FootPositions, const std::vector<float>& FootHeights, const std::vector<float>& BallSpeeds, const float FrameRate, const int32_t CyclePeriod, const FFootContactSettings& Settings, std::vector<float>& OutContact, std::vector<float>& OutLock);
+
+    // Experimental helpers from development, kept for reference.
+    float HighestFloatValueInRange(const std::vector<float>& Values, const int32_t FrameIndex, const int32_t Margin);
+    int32_t WindowSizeFromDivergence(const std::vector<float>& Values, const int32_t FrameIndex, const float PercentDivergence);
+}
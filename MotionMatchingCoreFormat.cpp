@@ -0,0 +1,250 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#include "MotionMatchingCoreFormat.h"
+#include <algorithm>
+#include <cstring>
+
+namespace MMCore
+{
+    namespace
+    {
+        // The files are little-endian, and so is every platform the editor and the farm run on, so
+        // values are copied as they are in memory.
+
+        constexpr int32_t DoublesPerTransform = 10;
+
+        class FByteWriter
+        {
+        public:
+            explicit FByteWriter(std::vector<uint8_t>& InBytes) : Bytes(InBytes) {}
+
+            template <typename ValueType>
+            void Write(const ValueType& Value)
+            {
+                const size_t Offset = Bytes.size();
+                Bytes.resize(Offset + sizeof(ValueType));
+                std::memcpy(Bytes.data() + Offset, &Value, sizeof(ValueType));
+            }
+
+            void WriteTransform(const FXform& Transform)
+            {
+                const double Values[DoublesPerTransform] = {
+                    Transform.Rotation.X, Transform.Rotation.Y, Transform.Rotation.Z, Transform.Rotation.W,
+                    Transform.Translation.X, Transform.Translation.Y, Transform.Translation.Z,
+                    Transform.Scale.X, Transform.Scale.Y, Transform.Scale.Z,
+                };
+                Write(Values);
+            }
+
+            void WriteName(const std::string& Name)
+            {
+                char Padded[TrackNameLength] = {};
+                std::memcpy(Padded, Name.data(), std::min(Name.size(), static_cast<size_t>(TrackNameLength - 1)));
+                Write(Padded);
+            }
+
+        private:
+            std::vector<uint8_t>& Bytes;
+        };
+
+        class FByteReader
+        {
+        public:
+            explicit FByteReader(const std::vector<uint8_t>& InBytes) : Bytes(InBytes) {}
+
+            // Returns false, and leaves Value alone, past the end of the data.
+            template <typename ValueType>
+            bool Read(ValueType& Value)
+            {
+                if (Bytes.size() - Offset < sizeof(ValueType)) {
+                    return false;
+                }
+                std::memcpy(&Value, Bytes.data() + Offset, sizeof(ValueType));
+                Offset += sizeof(ValueType);
+                return true;
+            }
+
+            bool ReadTransform(FXform& Transform)
+            {
+                double Values[DoublesPerTransform];
+                if (!Read(Values)) {
+                    return false;
+                }
+                Transform = FXform(FQuat4(Values[0], Values[1], Values[2], Values[3]), FVec3(Values[4], Values[5], Values[6]), FVec3(Values[7], Values[8], Values[9]));
+                return true;
+            }
+
+            bool ReadName(std::string& Name)
+            {
+                char Padded[TrackNameLength];
+                if (!Read(Padded)) {
+                    return false;
+                }
+                Name.assign(Padded, std::find(Padded, Padded + TrackNameLength, '\0'));
+                return true;
+            }
+
+            size_t GetRemaining() const { return Bytes.size() - Offset; }
+
+        private:
+            const std::vector<uint8_t>& Bytes;
+            size_t Offset = 0;
+        };
+    }
+
+    std::vector<uint8_t> SavePoseFile(const std::vector<FPose>& Poses, const float FrameRate)
+    {
+        FPoseFileHeader Header;
+        Header.NumFrames = static_cast<int32_t>(Poses.size());
+        Header.FrameRate = FrameRate;
+
+        std::vector<uint8_t> Bytes;
+        Bytes.reserve(sizeof(Header) + Poses.size() * NumBones * DoublesPerTransform * sizeof(double));
+
+        FByteWriter Writer(Bytes);
+        Writer.Write(Header);
+
+        for (const FPose& Pose : Poses) {
+            for (const FXform& Bone : Pose.Bones) {
+                Writer.WriteTransform(Bone);
+            }
+        }
+
+        return Bytes;
+    }
+
+    bool LoadPoseFile(const std::vector<uint8_t>& Bytes, std::vector<FPose>& OutPoses, float& OutFrameRate, std::string& OutError)
+    {
+        FByteReader Reader(Bytes);
+
+        FPoseFileHeader Header;
+        if (!Reader.Read(Header) || Header.Magic != FPoseFileHeader::ExpectedMagic) {
+            OutError = "Not a pose file";
+            return false;
+        }
+
+        if (Header.Version != FPoseFileHeader::CurrentVersion) {
+            OutError = "Unsupported pose file version " + std::to_string(Header.Version);
+            return false;
+        }
+
+        if (Header.NumBones != NumBones) {
+            OutError = "Pose file has " + std::to_string(Header.NumBones) + " bones, expected " + std::to_string(NumBones);
+            return false;
+        }
+
+        if (Header.NumFrames < 0 || Header.FrameRate <= 0.0f) {
+            OutError = "Invalid frame count or frame rate";
+            return false;
+        }
+
+        const size_t PoseBytes = NumBones * DoublesPerTransform * sizeof(double);
+        if (Reader.GetRemaining() != Header.NumFrames * PoseBytes) {
+            OutError = "Pose file size doesn't match its frame count";
+            return false;
+        }
+
+        OutPoses.resize(Header.NumFrames);
+        for (FPose& Pose : OutPoses) {
+            for (FXform& Bone : Pose.Bones) {
+                Reader.ReadTransform(Bone);
+            }
+        }
+
+        OutFrameRate = Header.FrameRate;
+        return true;
+    }
+
+    std::vector<uint8_t> SaveTrackFile(const FTrackFile& TrackFile)
+    {
+        FTrackFileHeader Header;
+        Header.NumFrames = TrackFile.NumFrames;
+        Header.FirstFrame = TrackFile.FirstFrame;
+        Header.NumKeys = !TrackFile.TransformTracks.empty() ? static_cast<int32_t>(TrackFile.TransformTracks[0].Keys.size())
+            : !TrackFile.Curves.empty() ? static_cast<int32_t>(TrackFile.Curves[0].Keys.size())
+            : 0;
+        Header.FrameRate = TrackFile.FrameRate;
+        Header.NumTransformTracks = static_cast<int32_t>(TrackFile.TransformTracks.size());
+        Header.NumCurves = static_cast<int32_t>(TrackFile.Curves.size());
+
+        std::vector<uint8_t> Bytes;
+        FByteWriter Writer(Bytes);
+        Writer.Write(Header);
+
+        for (const FTransformTrack& Track : TrackFile.TransformTracks) {
+            Writer.WriteName(Track.Name);
+            for (const FXform& Key : Track.Keys) {
+                Writer.WriteTransform(Key);
+            }
+        }
+
+        for (const FCurveTrack& Curve : TrackFile.Curves) {
+            Writer.WriteName(Curve.Name);
+            for (const float Key : Curve.Keys) {
+                Writer.Write(Key);
+            }
+        }
+
+        return Bytes;
+    }
+
+    bool LoadTrackFile(const std::vector<uint8_t>& Bytes, FTrackFile& OutTrackFile, std::string& OutError)
+    {
+        FByteReader Reader(Bytes);
+
+        FTrackFileHeader Header;
+        if (!Reader.Read(Header) || Header.Magic != FTrackFileHeader::ExpectedMagic) {
+            OutError = "Not a track file";
+            return false;
+        }
+
+        if (Header.Version != FTrackFileHeader::CurrentVersion) {
+            OutError = "Unsupported track file version " + std::to_string(Header.Version);
+            return false;
+        }
+
+        if (Header.NumFrames < 0 || Header.FirstFrame < 0 || Header.NumKeys < 0 || Header.FirstFrame > Header.NumFrames - Header.NumKeys
+            || Header.FrameRate <= 0.0f || Header.NumTransformTracks < 0 || Header.NumCurves < 0) {
+            OutError = "Invalid track file header";
+            return false;
+        }
+
+        // The track counts are checked by dividing the remaining size, so a hostile header can't
+        // overflow the expected size into a match.
+        const uint64_t Remaining = Reader.GetRemaining();
+        const uint64_t TransformTrackBytes = TrackNameLength + static_cast<uint64_t>(Header.NumKeys) * DoublesPerTransform * sizeof(double);
+        const uint64_t CurveBytes = TrackNameLength + static_cast<uint64_t>(Header.NumKeys) * sizeof(float);
+
+        if (static_cast<uint64_t>(Header.NumTransformTracks) > Remaining / TransformTrackBytes
+            || static_cast<uint64_t>(Header.NumCurves) > (Remaining - Header.NumTransformTracks * TransformTrackBytes) / CurveBytes
+            || Remaining != Header.NumTransformTracks * TransformTrackBytes + Header.NumCurves * CurveBytes) {
+            OutError = "Track file size doesn't match its header";
+            return false;
+        }
+
+        OutTrackFile = FTrackFile();
+        OutTrackFile.NumFrames = Header.NumFrames;
+        OutTrackFile.FirstFrame = Header.FirstFrame;
+        OutTrackFile.FrameRate = Header.FrameRate;
+
+        OutTrackFile.TransformTracks.resize(Header.NumTransformTracks);
+        for (FTransformTrack& Track : OutTrackFile.TransformTracks) {
+            Reader.ReadName(Track.Name);
+            Track.Keys.resize(Header.NumKeys);
+            for (FXform& Key : Track.Keys) {
+                Reader.ReadTransform(Key);
+            }
+        }
+
+        OutTrackFile.Curves.resize(Header.NumCurves);
+        for (FCurveTrack& Curve : OutTrackFile.Curves) {
+            Reader.ReadName(Curve.Name);
+            Curve.Keys.resize(Header.NumKeys);
+            for (float& Key : Curve.Keys) {
+                Reader.Read(Key);
+            }
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,87 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#pragma once
+
+#include "MotionMatchingCore.h"
+#include <string>
+
+// Files for running the core analysis outside the editor. The modifier can export the sampled poses
+// of a clip as a pose file, and the command line tool turns pose files into track files, with the
+// same keys and curves the modifier would write.
+//
+// Both are flat little-endian binaries: a fixed header followed by the data. Transforms are stored as
+// 10 doubles: rotation X, Y, Z, W, translation X, Y, Z, and scale X, Y, Z.
+//
+// Pose file (.mmpose):
+//   FPoseFileHeader
+//   NumFrames * NumBones transforms, frame by frame, bones in the order of MMCore::EBone, in
+//   component space
+//
+// Track file (.mmtrack):
+//   FTrackFileHeader
+//   NumTransformTracks times: name, then NumKeys transforms
+//   NumCurves times: name, then NumKeys floats
+//
+// Names are fixed size, zero padded. The keys start at FirstFrame of a clip of NumFrames frames.
+namespace MMCore
+{
+    constexpr int32_t TrackNameLength = 32;
+
+    struct FPoseFileHeader
+    {
+        static constexpr uint32_t ExpectedMagic = 0x53504D4D; // "MMPS"
+        static constexpr uint32_t CurrentVersion = 1;
+
+        uint32_t Magic = ExpectedMagic;
+        uint32_t Version = CurrentVersion;
+        int32_t NumFrames = 0;
+        int32_t NumBones = MMCore::NumBones;
+        float FrameRate = 0.0f;
+        uint32_t Reserved = 0;
+    };
+
+    struct FTrackFileHeader
+    {
+        static constexpr uint32_t ExpectedMagic = 0x4B544D4D; // "MMTK"
+        static constexpr uint32_t CurrentVersion = 1;
+
+        uint32_t Magic = ExpectedMagic;
+        uint32_t Version = CurrentVersion;
+        int32_t NumFrames = 0;
+        int32_t FirstFrame = 0;
+        int32_t NumKeys = 0;
+        float FrameRate = 0.0f;
+        int32_t NumTransformTracks = 0;
+        int32_t NumCurves = 0;
+    };
+
+    struct FTransformTrack
+    {
+        std::string Name;
+        std::vector<FXform> Keys;
+    };
+
+    struct FCurveTrack
+    {
+        std::string Name;
+        std::vector<float> Keys;
+    };
+
+    struct FTrackFile
+    {
+        int32_t NumFrames = 0;
+        int32_t FirstFrame = 0;
+        float FrameRate = 0.0f;
+
+        std::vector<FTransformTrack> TransformTracks;
+        std::vector<FCurveTrack> Curves;
+    };
+
+    std::vector<uint8_t> SavePoseFile(const std::vector<FPose>& Poses, const float FrameRate);
+    bool LoadPoseFile(const std::vector<uint8_t>& Bytes, std::vector<FPose>& OutPoses, float& OutFrameRate, std::string& OutError);
+
+    // Every track and curve has to have the same number of keys. Names longer than TrackNameLength - 1
+    // are cut off.
+    std::vector<uint8_t> SaveTrackFile(const FTrackFile& TrackFile);
+    bool LoadTrackFile(const std::vector<uint8_t>& Bytes, FTrackFile& OutTrackFile, std::string& OutError);
+}
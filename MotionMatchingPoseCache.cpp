@@ -0,0 +1,350 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#include "MotionMatchingPoseCache.h"
+#include "MotionMatchingSkeletonBinding.h"
+#include "Animation/AnimData/IAnimationDataModel.h"
+#include "Animation/AnimSequence.h"
+#include "Animation/Skeleton.h"
+#include "AnimationBlueprintLibrary.h"
+#include "Async/Async.h"
+#include "Misc/ScopeLock.h"
+
+FMMPoseCache& FMMPoseCache::Get()
+{
+    static FMMPoseCache Cache;
+    return Cache;
+}
+
+void FMMPoseCache::RequestBones(const UAnimSequence* Sequence, const TArray<FName>& Bones)
+{
+    check(IsInGameThread());
+
+    if (!Sequence) {
+        return;
+    }
+
+    TSharedPtr<FEntry> Entry;
+
+    {
+        FScopeLock ScopeLock(&Lock);
+        Entry = FindOrAddEntry(Sequence);
+    }
+
+    FScopeLock EntryLock(&Entry->Lock);
+    AddBones(*Entry, Sequence, Bones);
+}
+
+TSharedPtr<FMMPoseCache::FPin> FMMPoseCache::Pin(const UAnimSequence* Sequence)
+{
+    check(IsInGameThread());
+
+    FScopeLock ScopeLock(&Lock);
+
+    const TSharedRef<FEntry>* Entry = Entries.Find(Sequence);
+    if (!Entry) {
+        return nullptr;
+    }
+
+    ++(*Entry)->NumPins;
+
+    const TSharedRef<FPin> Pin = MakeShared<FPin>();
+    Pin->Entry = *Entry;
+    return Pin;
+}
+
+FMMPoseCache::FPin::~FPin()
+{
+    if (Entry.IsValid()) {
+        FScopeLock ScopeLock(&Get().Lock);
+        --Entry->NumPins;
+    }
+}
+
+bool FMMPoseCache::GetBoneTracks(const UAnimSequence* Sequence, const TArray<FName>& Bones, const int32 StartFrame, const int32 NumFrames, TArray<TArray<FTransform>>& OutTracks)
+{
+    return GetBoneTracks(Sequence, Bones, StartFrame, NumFrames, OutTracks, []() { return true; });
+}
+
+bool FMMPoseCache::GetBoneTracks(const UAnimSequence* Sequence, const TArray<FName>& Bones, const int32 StartFrame, const int32 NumFrames, TArray<TArray<FTransform>>& OutTracks, TFunctionRef<bool()> OnFrameSampled)
+{
+    if (!Sequence) {
+        return false;
+    }
+
+    TSharedPtr<FEntry> Entry;
+
+    {
+        FScopeLock ScopeLock(&Lock);
+
+        if (const TSharedRef<FEntry>* Found = Entries.Find(Sequence)) {
+            Entry = *Found;
+            Entry->LastUsed = ++UseCounter;
+        }
+    }
+
+    // The entry is gone if the sequence changed since its bones were requested. Readers don't
+    // recreate it, since that resolves the binding from the skeleton, which is only safe on the
+    // game thread, and the poses would no longer match what the caller was set up for anyway.
+    if (!Entry.IsValid()) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: '%s' changed since its bones were requested, or they never were"), *Sequence->GetName());
+        return false;
+    }
+
+    {
+        FScopeLock EntryLock(&Entry->Lock);
+
+        for (const FName& Bone : Bones) {
+            if (!Entry->Bones.Contains(Bone)) {
+                UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Bone '%s' of '%s' wasn't requested from the pose cache"), *Bone.ToString(), *Sequence->GetName());
+                return false;
+            }
+        }
+
+        if (StartFrame < 0 || StartFrame + NumFrames > Entry->NumFrames) {
+            UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Frames %d to %d are outside of '%s'"), StartFrame, StartFrame + NumFrames, *Sequence->GetName());
+            return false;
+        }
+
+        // Sample the frames that aren't cached yet, for all bones of the entry, from the keys copied
+        // when the bones were requested. The binding lists every bone we need in parent-first
+        // order, so each bone's parent transform has always been computed by the time we get to it.
+        const TArray<FName>& RequiredBoneNames = Entry->Binding->GetRequiredBoneNames();
+        const TArray<int32>& RequiredParentSlots = Entry->Binding->GetRequiredParentSlots();
+        const TArray<int32>& TrackedBoneSlots = Entry->Binding->GetTrackedBoneSlots();
+
+        TArray<FTransform, TInlineAllocator<64>> ComponentSpaceTransforms;
+        ComponentSpaceTransforms.SetNumUninitialized(RequiredBoneNames.Num());
+
+        for (int32 FrameIndex = StartFrame; FrameIndex < StartFrame + NumFrames; ++FrameIndex) {
+            if (!Entry->SampledFrames[FrameIndex]) {
+                for (int32 Slot = 0; Slot < RequiredBoneNames.Num(); ++Slot) {
+                    const TArray<FTransform>& Keys = Entry->SourceKeys[Slot];
+                    const FTransform& LocalTransform = Keys[FMath::Min(FrameIndex, Keys.Num() - 1)];
+
+                    const int32 ParentSlot = RequiredParentSlots[Slot];
+                    ComponentSpaceTransforms[Slot] = (ParentSlot != INDEX_NONE) ? LocalTransform * ComponentSpaceTransforms[ParentSlot] : LocalTransform;
+                }
+
+                for (int32 BoneIndex = 0; BoneIndex < TrackedBoneSlots.Num(); ++BoneIndex) {
+                    Entry->Tracks[BoneIndex][FrameIndex] = ComponentSpaceTransforms[TrackedBoneSlots[BoneIndex]];
+                }
+
+                Entry->SampledFrames[FrameIndex] = true;
+            }
+
+            if (!OnFrameSampled()) {
+                return false;
+            }
+        }
+
+        OutTracks.SetNum(Bones.Num());
+        for (int32 Index = 0; Index < Bones.Num(); ++Index) {
+            const TArray<FTransform>& Track = Entry->Tracks[Entry->Bones.IndexOfByKey(Bones[Index])];
+            OutTracks[Index] = TArray<FTransform>(Track.GetData() + StartFrame, NumFrames);
+        }
+    }
+
+    FScopeLock ScopeLock(&Lock);
+    Trim(Entry.Get());
+
+    return true;
+}
+
+uint32 FMMPoseCache::GetRevision(const UAnimSequence* Sequence) const
+{
+    FScopeLock ScopeLock(&Lock);
+
+    const TSharedRef<FEntry>* Entry = Entries.Find(Sequence);
+    return Entry ? (*Entry)->Revision : 0;
+}
+
+void FMMPoseCache::Invalidate(const UAnimSequence* Sequence)
+{
+    // Readers still holding the old entry finish on it. The next reader starts a new revision.
+    FScopeLock ScopeLock(&Lock);
+
+    if (const TSharedRef<FEntry>* Found = Entries.Find(Sequence)) {
+        Unwatch(**Found);
+        Entries.Remove(Sequence);
+    }
+}
+
+void FMMPoseCache::InvalidateAll()
+{
+    FScopeLock ScopeLock(&Lock);
+
+    for (const auto& Pair : Entries) {
+        Unwatch(*Pair.Value);
+    }
+    Entries.Empty();
+}
+
+TSharedRef<FMMPoseCache::FEntry> FMMPoseCache::FindOrAddEntry(const UAnimSequence* Sequence)
+{
+    // Called on the game thread with the cache lock held. A new entry watches the data model for
+    // changes that invalidate it, until it's dropped from the cache.
+
+    if (const TSharedRef<FEntry>* Found = Entries.Find(Sequence)) {
+        (*Found)->LastUsed = ++UseCounter;
+        return *Found;
+    }
+
+    const TSharedRef<FEntry> Entry = MakeShared<FEntry>();
+    Entry->Revision = NextRevision++;
+    Entry->LastUsed = ++UseCounter;
+    UAnimationBlueprintLibrary::GetNumFrames(Sequence, Entry->NumFrames);
+
+    if (IAnimationDataModel* DataModel = Sequence->GetDataModel()) {
+        Entry->DataModel = DataModel->_getUObject();
+        Entry->ModelModifiedHandle = DataModel->GetModifiedEvent().AddRaw(this, &FMMPoseCache::OnModelModified, TWeakObjectPtr<const UAnimSequence>(Sequence));
+    }
+
+    Entries.Add(Sequence, Entry);
+    return Entry;
+}
+
+void FMMPoseCache::Unwatch(FEntry& Entry)
+{
+    // Called with the cache lock held, when an entry is dropped from the cache. Readers may still
+    // hold it, but nothing invalidates it anymore. Delegates are only changed on the game thread,
+    // where the model broadcasts them, so an entry trimmed by a reader on a worker unbinds there.
+
+    if (!Entry.ModelModifiedHandle.IsValid()) {
+        return;
+    }
+
+    auto RemoveHandle = [DataModel = Entry.DataModel, Handle = Entry.ModelModifiedHandle]() {
+        if (IAnimationDataModel* Model = Cast<IAnimationDataModel>(DataModel.Get())) {
+            Model->GetModifiedEvent().Remove(Handle);
+        }
+    };
+
+    Entry.ModelModifiedHandle.Reset();
+
+    if (IsInGameThread()) {
+        RemoveHandle();
+    } else {
+        AsyncTask(ENamedThreads::GameThread, MoveTemp(RemoveHandle));
+    }
+}
+
+bool FMMPoseCache::AddBones(FEntry& Entry, const UAnimSequence* Sequence, const TArray<FName>& Bones)
+{
+    // Called on the game thread with the entry lock held. Adding bones resolves a new binding for
+    // the union, and drops the samples of the old bones, since every sampled frame has to cover
+    // every bone.
+    //
+    // This is also where the keys of every required bone are copied out of the data model. Doing
+    // it here, on the game thread, is what lets readers sample on a worker while the sequence is
+    // being edited. The model is only ever changed on the game thread, and any change that moves
+    // bones invalidates the entry, so the copy always matches the revision. A bone without a track
+    // holds its reference pose, as when the model is evaluated.
+
+    check(IsInGameThread());
+
+    TArray<FName> UnionBones = Entry.Bones;
+    for (const FName& Bone : Bones) {
+        UnionBones.AddUnique(Bone);
+    }
+
+    if (UnionBones.Num() == Entry.Bones.Num() && Entry.Binding.IsValid()) {
+        return true;
+    }
+
+    const TSharedPtr<const FMMSkeletonBinding> Binding = FMMSkeletonBinding::Get(Sequence->GetSkeleton(), UnionBones, {});
+    if (!Binding.IsValid()) {
+        return false;
+    }
+
+    const IAnimationDataModel* DataModel = Sequence->GetDataModel();
+    const TArray<FTransform>& RefBonePose = Sequence->GetSkeleton()->GetReferenceSkeleton().GetRefBonePose();
+    const TArray<FName>& RequiredBoneNames = Binding->GetRequiredBoneNames();
+    const TArray<int32>& RequiredBoneIndices = Binding->GetRequiredBoneIndices();
+
+    int64 NumSourceKeys = 0;
+    Entry.SourceKeys.SetNum(RequiredBoneNames.Num());
+    for (int32 Slot = 0; Slot < RequiredBoneNames.Num(); ++Slot) {
+        TArray<FTransform>& Keys = Entry.SourceKeys[Slot];
+        Keys.Reset();
+
+        if (DataModel && DataModel->IsValidBoneTrackName(RequiredBoneNames[Slot])) {
+            DataModel->GetBoneTrackTransforms(RequiredBoneNames[Slot], Keys);
+        }
+        if (Keys.IsEmpty()) {
+            Keys.Add(RefBonePose[RequiredBoneIndices[Slot]]);
+        }
+
+        NumSourceKeys += Keys.Num();
+    }
+
+    Entry.Bones = MoveTemp(UnionBones);
+    Entry.Binding = Binding;
+    Entry.Tracks.SetNum(Entry.Bones.Num());
+    for (TArray<FTransform>& Track : Entry.Tracks) {
+        Track.SetNumUninitialized(Entry.NumFrames);
+    }
+    Entry.SampledFrames.Init(false, Entry.NumFrames);
+    Entry.AllocatedBytes = (static_cast<int64>(Entry.Bones.Num()) * Entry.NumFrames + NumSourceKeys) * sizeof(FTransform);
+
+    return true;
+}
+
+void FMMPoseCache::Trim(const FEntry* InUse)
+{
+    // Called with the cache lock held. Drops the least recently used sequences until the rest fit
+    // the budget. The entry that was just read stays, even if it's larger than the budget, and so
+    // do the entries pinned by background jobs that are queued or running. Evicting those would
+    // make the jobs fail when they get to read.
+
+    for (auto It = Entries.CreateIterator(); It; ++It) {
+        if (!It.Key().IsValid()) {
+            Unwatch(*It.Value());
+            It.RemoveCurrent();
+        }
+    }
+
+    int64 TotalBytes = 0;
+    for (const auto& Pair : Entries) {
+        TotalBytes += Pair.Value->AllocatedBytes;
+    }
+
+    while (TotalBytes > BudgetBytes) {
+        const TWeakObjectPtr<const UAnimSequence>* Oldest = nullptr;
+        uint64 OldestUse = MAX_uint64;
+
+        for (const auto& Pair : Entries) {
+            if (&Pair.Value.Get() != InUse && Pair.Value->NumPins == 0 && Pair.Value->LastUsed < OldestUse) {
+                Oldest = &Pair.Key;
+                OldestUse = Pair.Value->LastUsed;
+            }
+        }
+
+        if (!Oldest) {
+            break;
+        }
+
+        const TWeakObjectPtr<const UAnimSequence> OldestKey = *Oldest;
+        TotalBytes -= Entries[OldestKey]->AllocatedBytes;
+        Unwatch(*Entries[OldestKey]);
+        Entries.Remove(OldestKey);
+    }
+}
+
+void FMMPoseCache::OnModelModified(const EAnimDataModelNotifyType& NotifyType, IAnimationDataModel* Model, const FAnimDataModelNotifPayload& Payload, TWeakObjectPtr<const UAnimSequence> Sequence)
+{
+    // Only changes that can move bones start a new revision. Curves, attributes and brackets don't.
+    switch (NotifyType) {
+    case EAnimDataModelNotifyType::TrackAdded:
+    case EAnimDataModelNotifyType::TrackChanged:
+    case EAnimDataModelNotifyType::TrackRemoved:
+    case EAnimDataModelNotifyType::SequenceLengthChanged:
+    case EAnimDataModelNotifyType::FrameRateChanged:
+    case EAnimDataModelNotifyType::SkeletonChanged:
+    case EAnimDataModelNotifyType::Populated:
+    case EAnimDataModelNotifyType::Reset:
+        Invalidate(Sequence.Get());
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,106 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Animation/AnimData/AnimDataNotifications.h"
+#include "HAL/CriticalSection.h"
+#include <atomic>
+
+class FMMSkeletonBinding;
+class IAnimationDataModel;
+class UAnimSequence;
+
+// Component space bone transforms per sequence, shared by every modifier that samples the same
+// sequence. Sampling bone poses is the most expensive part of most modifiers, and when several are
+// stacked on a clip, they'd otherwise each sample the same bones again.
+//
+// Modifiers announce the bones they're going to read on the game thread, and then read tracks from
+// any thread. Announcing creates the sequence's entry, resolves its skeleton binding, and copies
+// the local keys of the bones out of the data model, so readers never touch the skeleton or the
+// sequence, and a background reader can't see a data model that's halfway through an edit on the
+// game thread. Frames are sampled from those keys on first read, for the union of all announced bones
+// at once, so a frame is only sampled once however many modifiers read it. Entries belong to a
+// revision of the sequence. Any change to its bone tracks, length, frame rate or skeleton starts a
+// new, empty revision. Curve changes don't, so a modifier writing curves doesn't throw away the
+// poses. Least recently used sequences are dropped when the cache grows past its budget, except
+// those pinned by background jobs that are queued or running.
+class GAMEANIMATIONSAMPLE2_API FMMPoseCache
+{
+private:
+    struct FEntry;
+
+public:
+    // Keeps an entry from being trimmed while it's held. An entry that's invalidated by a change to
+    // the sequence still goes away, and readers then fail, since its poses are out of date.
+    class FPin
+    {
+    public:
+        ~FPin();
+
+    private:
+        friend class FMMPoseCache;
+        TSharedPtr<FEntry> Entry;
+    };
+
+    static FMMPoseCache& Get();
+
+    // Adds bones to the ones sampled for the sequence, resolves the skeleton binding for them, copies
+    // their keys, and starts watching its data model for changes until the entry is dropped. Game
+    // thread only.
+    void RequestBones(const UAnimSequence* Sequence, const TArray<FName>& Bones);
+
+    // Pins the entry of a sequence whose bones have been requested, for a background job to hold
+    // from the time it's queued until it's done. Returns null if there's no entry. Game thread only.
+    TSharedPtr<FPin> Pin(const UAnimSequence* Sequence);
+
+    // Component space transforms of Bones for NumFrames frames from StartFrame, one track per bone
+    // in the order given. The bones have to have been requested. A reader that finds no entry, or
+    // a bone that wasn't requested, fails instead of creating it, since that would read the
+    // skeleton off the game thread. OnFrameSampled is called once per frame and can return false
+    // to cancel. Returns false if cancelled or on any of those failures. Thread safe.
+    bool GetBoneTracks(const UAnimSequence* Sequence, const TArray<FName>& Bones, const int32 StartFrame, const int32 NumFrames, TArray<TArray<FTransform>>& OutTracks, TFunctionRef<bool()> OnFrameSampled);
+    bool GetBoneTracks(const UAnimSequence* Sequence, const TArray<FName>& Bones, const int32 StartFrame, const int32 NumFrames, TArray<TArray<FTransform>>& OutTracks);
+
+    // Changes whenever the sequence's bone data changes, and never repeats. Zero while nothing is
+    // cached for the sequence. Thread safe.
+    uint32 GetRevision(const UAnimSequence* Sequence) const;
+
+    void Invalidate(const UAnimSequence* Sequence);
+    void InvalidateAll();
+
+private:
+    // Poses of one sequence at one revision. The entry lock is held while sampling, so concurrent
+    // readers of the same sequence wait for each other, and readers of other sequences don't.
+    struct FEntry
+    {
+        FCriticalSection Lock;
+        uint32 Revision = 0;
+        uint64 LastUsed = 0;
+        int32 NumFrames = 0;
+        TArray<FName> Bones;
+        TSharedPtr<const FMMSkeletonBinding> Binding;
+        TArray<TArray<FTransform>> SourceKeys; // Per required bone, local, as stored in the data model
+        TArray<TArray<FTransform>> Tracks; // Per bone, NumFrames long
+        TBitArray<> SampledFrames;
+        std::atomic<int64> AllocatedBytes = 0;
+        int32 NumPins = 0; // Guarded by the cache lock
+        TWeakObjectPtr<UObject> DataModel; // Watched for changes while the entry is in the cache
+        FDelegateHandle ModelModifiedHandle;
+    };
+
+    // Budget for the poses of all sequences together.
+    static constexpr int64 BudgetBytes = 512ll * 1024 * 1024;
+
+    TSharedRef<FEntry> FindOrAddEntry(const UAnimSequence* Sequence);
+    bool AddBones(FEntry& Entry, const UAnimSequence* Sequence, const TArray<FName>& Bones);
+    void Trim(const FEntry* InUse);
+    static void Unwatch(FEntry& Entry);
+
+    void OnModelModified(const EAnimDataModelNotifyType& NotifyType, IAnimationDataModel* Model, const FAnimDataModelNotifPayload& Payload, TWeakObjectPtr<const UAnimSequence> Sequence);
+
+    mutable FCriticalSection Lock;
+    TMap<TWeakObjectPtr<const UAnimSequence>, TSharedRef<FEntry>> Entries;
+    uint64 UseCounter = 0;
+    uint32 NextRevision = 1;
+};
@@ -1,11 +1,24 @@
 ﻿// Created by Hollywood Camera Work - Public Domain
 
 #include "MotionMatchingPrep.h"
+#include "MotionMatchingBatchScheduler.h"
+#include "MotionMatchingCapsuleSimulator.h"
+#include "MotionMatchingCoreFormat.h"
+#include "MotionMatchingPoseCache.h"
+#include "MotionMatchingRootTrajectory.h"
+#include "MotionMatchingSkeletonBinding.h"
 #include "Animation/AnimSequence.h"
 #include "Animation/AnimData/IAnimationDataController.h"
 #include "Animation/AnimData/IAnimationDataModel.h"
 #include "AnimationBlueprintLibrary.h"
 #include "Animation/Skeleton.h"
+#include "Async/Async.h"
+#include "Containers/Ticker.h"
+#include "Misc/AsyncTaskNotification.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Tasks/Task.h"
+#include "UObject/StrongObjectPtr.h"
 
 // TODO:
 //
@@ -20,59 +33,506 @@
 //
 // This is currently built around the UE5 Manny/Quinn skeletons.
 
+namespace
+{
+    FName SpeedCurveName(const FName BoneName)
+    {
+        return FName(BoneName.ToString() + "_speed");
+    }
+
+    FName ContactCurveName(const FName BoneName)
+    {
+        return FName(BoneName.ToString() + "_contact");
+    }
+
+    FName LockCurveName(const FName BoneName)
+    {
+        return FName(BoneName.ToString() + "_lock");
+    }
+
+    // Bit-exact hash of a bone key. The keys are stored as floats, so converting them back gives
+    // the same doubles every time.
+    uint32 HashBoneKey(const FTransform& Key, const uint32 Hash)
+    {
+        const FVector Location = Key.GetLocation();
+        const FQuat Rotation = Key.GetRotation();
+        const FVector Scale = Key.GetScale3D();
+
+        uint32 Result = FCrc::MemCrc32(&Location, sizeof(Location), Hash);
+        Result = FCrc::MemCrc32(&Rotation, sizeof(Rotation), Result);
+        return FCrc::MemCrc32(&Scale, sizeof(Scale), Result);
+    }
+
+    // The analysis itself lives in MotionMatchingCore, which has its own math types. These convert
+    // at the edges, where bones come in from the pose cache and keys go out to the controller.
+    MMCore::FVec3 ToCore(const FVector& Vector)
+    {
+        return MMCore::FVec3(Vector.X, Vector.Y, Vector.Z);
+    }
+
+    MMCore::FQuat4 ToCore(const FQuat& Quat)
+    {
+        return MMCore::FQuat4(Quat.X, Quat.Y, Quat.Z, Quat.W);
+    }
+
+    MMCore::FXform ToCore(const FTransform& Transform)
+    {
+        return MMCore::FXform(ToCore(Transform.GetRotation()), ToCore(Transform.GetTranslation()), ToCore(Transform.GetScale3D()));
+    }
+
+    FVector FromCore(const MMCore::FVec3& Vector)
+    {
+        return FVector(Vector.X, Vector.Y, Vector.Z);
+    }
+
+    FQuat FromCore(const MMCore::FQuat4& Quat)
+    {
+        return FQuat(Quat.X, Quat.Y, Quat.Z, Quat.W);
+    }
+
+    FTransform FromCore(const MMCore::FXform& Transform)
+    {
+        return FTransform(FromCore(Transform.Rotation), FromCore(Transform.Translation), FromCore(Transform.Scale));
+    }
+
+    TArray<FTransform> FromCore(const std::vector<MMCore::FXform>& Transforms)
+    {
+        TArray<FTransform> Result;
+        Result.Reserve(Transforms.size());
+        for (const MMCore::FXform& Transform : Transforms) {
+            Result.Add(FromCore(Transform));
+        }
+        return Result;
+    }
+
+    MMCore::EFacingAxis ToCore(const EMMFacingDirection FacingDirection)
+    {
+        switch (FacingDirection) {
+        case EMMFacingDirection::X:
+            return MMCore::EFacingAxis::X;
+        case EMMFacingDirection::Z:
+            return MMCore::EFacingAxis::Z;
+        case EMMFacingDirection::Y:
+        default:
+            return MMCore::EFacingAxis::Y;
+        }
+    }
+
+    // Forwards the progress of the core analysis to a background apply, whose stages continue where
+    // sampling leaves off.
+    class FCoreProgress final : public MMCore::IAnalysisObserver
+    {
+    public:
+        explicit FCoreProgress(FMMApplyProgress& InProgress) : Progress(InProgress) {}
+
+        virtual void EnterStage(const MMCore::EStage Stage, const int32_t NumSteps) override
+        {
+            switch (Stage) {
+            case MMCore::EStage::VelocityTable:
+                Progress.EnterStage(FMMApplyProgress::EStage::VelocityTable, NumSteps);
+                break;
+            case MMCore::EStage::Smoothing:
+                Progress.EnterStage(FMMApplyProgress::EStage::Smoothing, NumSteps);
+                break;
+            case MMCore::EStage::Rebasing:
+                Progress.EnterStage(FMMApplyProgress::EStage::Rebasing, NumSteps);
+                break;
+            case MMCore::EStage::Curves:
+                Progress.EnterStage(FMMApplyProgress::EStage::Curves, NumSteps);
+                break;
+            }
+        }
+
+        virtual void Step() override { Progress.Step(); }
+        virtual bool IsCancelled() const override { return Progress.IsCancelled(); }
+        virtual void AddWorkingSet(const int64_t Bytes) override { Progress.AddWorkingSet(Bytes); }
+        virtual void ReleaseWorkingSet(const int64_t Bytes) override { Progress.ReleaseWorkingSet(Bytes); }
+
+    private:
+        FMMApplyProgress& Progress;
+    };
+}
+
 UMotionMatchingPrep::UMotionMatchingPrep()
 {
+    // Past and future samples roughly matching the default Pose Search trajectory channel.
+    TrajectoryFeatureOffsets = { -0.4f, -0.2f, 0.2f, 0.4f, 0.6f, 0.8f, 1.0f };
 }
 
 void UMotionMatchingPrep::OnApply_Implementation(UAnimSequence* AnimationSequence)
 {
-    BoneNames = {
-        RootBoneName,
-        PelvisBoneName,
-        LeftThighBoneName,
-        RightThighBoneName,
-        Spine01BoneName,
-        // Spine02BoneName, // Center of gravity calculation is disabled. Didn't meaningfully improve path
-        // Spine03BoneName,
-        // Neck01BoneName,
-        LeftFootBoneName,
-        RightFootBoneName,
-        LeftBallBoneName,
-        RightBallBoneName,
-        LeftHandBoneName,
-        RightHandBoneName,
-    };
+    if (!PrepareBoneNames(AnimationSequence)) {
+        return;
+    }
 
-    if (!AnimationSequence) {
-        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Invalid animation sequence"));
+    int32 NumFrames;
+    UAnimationBlueprintLibrary::GetNumFrames(AnimationSequence, NumFrames);
+
+    if (NumFrames <= 0) {
+        UE_LOG(LogAnimation, Warning, TEXT("MotionMatchingPrep: Animation has no frames"));
         return;
     }
 
-    USkeleton* Skeleton = AnimationSequence->GetSkeleton();
-    if (!Skeleton) {
-        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: No skeleton found"));
+    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Processing %d frames..."), NumFrames);
+
+    // Timing
+    const float SequenceLength = AnimationSequence->GetPlayLength();
+    const float FrameRate = (NumFrames > 1) ? (NumFrames - 1) / SequenceLength : 30.0f;
+    const float FrameTime = 1.0f / FrameRate;
+
+    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: SequenceLength=%f, FrameRate=%f, FrameTime=%f"), SequenceLength, FrameRate, FrameTime);
+
+    // Everything below runs with these, including a background apply that only starts later.
+    const FMMApplySettings Settings = CaptureApplySettings(NumFrames, FrameRate);
+
+    FInt32Range FrameRange;
+    if (!GetDirtyFrameRange(AnimationSequence, Settings, NumFrames, FrameRate, FrameRange)) {
+        UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: '%s' hasn't changed since the last apply"), *AnimationSequence->GetName());
+        return;
+    }
+
+    if (bExportCorePoses) {
+        ExportCorePoses(AnimationSequence, NumFrames, FrameRate);
+    }
+
+    if (bApplyInBackground) {
+        ApplyInBackground(AnimationSequence, Settings, NumFrames, FrameRate, FrameRange);
+        return;
+    }
+
+    FMMApplyResult Result;
+    if (!AnalyzeSequence(AnimationSequence, Settings, NumFrames, FrameRate, FrameRange, Result, nullptr)) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Failed to process '%s'"), *AnimationSequence->GetName());
+        return;
+    }
+
+    CommitResult(AnimationSequence, Settings, Result);
+}
+
+FMMApplySettings UMotionMatchingPrep::CaptureApplySettings(const int32 NumFrames, const float FrameRate) const
+{
+    // Game thread only, after PrepareBoneNames has set up the profile and the binding.
+
+    check(IsInGameThread());
+
+    FMMApplySettings Settings;
+    Settings.Core = GetCoreSettings();
+    Settings.Profile = Profile;
+    Settings.Binding = SkeletonBinding;
+    Settings.Hash = HashApplySettings(NumFrames, FrameRate);
+
+    return Settings;
+}
+
+void UMotionMatchingPrep::ApplyInBackground(UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const int32 NumFrames, const float FrameRate, const FInt32Range& FrameRange)
+{
+    // Runs AnalyzeSequence as a background task, so the editor stays responsive while long clips
+    // are processed. Only CommitResult, which has to go through the data controller, is marshalled
+    // back to the game thread. The worker only reads the settings captured by OnApply and the pose
+    // cache, which copied the keys it samples on the game thread. It doesn't touch the modifier,
+    // and doesn't read the sequence's data model, which may be edited meanwhile. An editor
+    // notification shows the current stage and lets the user cancel, in which case the sequence is
+    // left untouched.
+    //
+    // The task goes through the batch scheduler, which holds it back while the other background
+    // applies would take it over the memory budget.
+    //
+    // NOTE: The modifier framework expects OnApply to have finished its changes when it returns,
+    // so reverting a background apply through the framework is even less reliable than usual.
+
+    if (ActiveProgress.IsValid()) {
+        UE_LOG(LogAnimation, Warning, TEXT("MotionMatchingPrep: '%s' is already being processed"), *AnimationSequence->GetName());
+        return;
+    }
+
+    // PrepareBoneNames has requested the bones, so the entry exists unless resolving them failed.
+    const TSharedPtr<FMMPoseCache::FPin> PosePin = FMMPoseCache::Get().Pin(AnimationSequence);
+    if (!PosePin.IsValid()) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: No poses of '%s' in the pose cache"), *AnimationSequence->GetName());
         return;
     }
 
-    // Verify all bones exist in skeleton
-    const FReferenceSkeleton& RefSkeleton = Skeleton->GetReferenceSkeleton();
-    for (const FName& BoneName : BoneNames) {
-        const int32 BoneIndex = RefSkeleton.FindBoneIndex(BoneName);
-        if (BoneIndex == INDEX_NONE) {
-            UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Bone '%s' not found in skeleton"), *BoneName.ToString());
-            return;
+    const TSharedRef<FMMApplyProgress> Progress = MakeShared<FMMApplyProgress>();
+    ActiveProgress = Progress;
+
+    // Stage events go to the telemetry collector on the game thread, which times the whole batch.
+    Progress->Telemetry = MakeShared<FMMTelemetryChannel>(AnimationSequence->GetName(), bWriteStageTrace ? GetExportDirectory() : FString());
+    FMMTelemetryCollector::Get().AddChannel(Progress->Telemetry.ToSharedRef());
+    Progress->EnterStage(FMMApplyProgress::EStage::Queued, 0);
+
+    FAsyncTaskNotificationConfig NotificationConfig;
+    NotificationConfig.TitleText = FText::Format(NSLOCTEXT("TransferPelvisToRoot", "BackgroundApplyTitle", "Motion Matching Prep: {0}"), FText::FromString(AnimationSequence->GetName()));
+    NotificationConfig.ProgressText = Progress->GetDescription();
+    NotificationConfig.bCanCancel = true;
+    NotificationConfig.LogCategory = &LogAnimation;
+    const TSharedRef<FAsyncTaskNotification> Notification = MakeShared<FAsyncTaskNotification>(NotificationConfig);
+
+    // Strong pointers keep the modifier and sequence alive while the task runs. They're created
+    // here and released in the game thread continuation, never on the worker, which only uses the
+    // sequence as its key in the pose cache. The pin keeps the sequence's poses, and the binding
+    // resolved with them, in the pose cache while the job waits in the queue, so other jobs
+    // finishing meanwhile can't trim them away.
+    struct FBackgroundApply
+    {
+        TStrongObjectPtr<UMotionMatchingPrep> Modifier;
+        TStrongObjectPtr<UAnimSequence> Sequence;
+        TSharedPtr<FMMPoseCache::FPin> PosePin;
+        TSharedPtr<FMMBatchScheduler::FReservation> Reservation;
+        FMMApplySettings Settings;
+        FMMApplyResult Result;
+        bool bAnalyzed = false;
+    };
+
+    const TSharedRef<FBackgroundApply> State = MakeShared<FBackgroundApply>();
+    State->Modifier.Reset(this);
+    State->Sequence.Reset(AnimationSequence);
+    State->PosePin = PosePin;
+    State->Settings = Settings;
+
+    // Poll the notification for the cancel button and keep the progress text current.
+    FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([Progress, Notification](float) {
+        if (Progress->IsFinished()) {
+            return false;
         }
+        if (Notification->GetPromptAction() == EAsyncTaskNotificationPromptAction::Cancel) {
+            Progress->Cancel();
+        }
+        Notification->SetProgressText(Progress->GetDescription());
+        return true;
+    }), 0.1f);
+
+    FMMBatchScheduler::FJob Job;
+    Job.Name = AnimationSequence->GetName();
+    Job.EstimatedBytes = EstimatePeakWorkingSet(Settings, FrameRange, NumFrames, FrameRate);
+    Job.BudgetBytes = static_cast<int64>(FMath::Max(BackgroundMemoryBudgetMB, 1)) * 1024 * 1024;
+    Job.Work = [State, Progress, Notification, NumFrames, FrameRate, FrameRange, EstimatedBytes = Job.EstimatedBytes](TSharedRef<FMMBatchScheduler::FReservation> Reservation) {
+        // The result counts against the memory budget until it's committed and freed on the game
+        // thread, not just until the analysis returns.
+        State->Reservation = Reservation;
+
+        // Cancelled while waiting in the queue.
+        if (!Progress->IsCancelled()) {
+            State->bAnalyzed = AnalyzeSequence(State->Sequence.Get(), State->Settings, NumFrames, FrameRate, FrameRange, State->Result, &Progress.Get());
+        }
+
+        Progress->LeaveStage();
+        Progress->Telemetry->Close();
+
+        AsyncTask(ENamedThreads::GameThread, [State, Progress, Notification, EstimatedBytes]() {
+            const FText SequenceName = FText::FromString(State->Sequence->GetName());
+
+            UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: '%s' peak working set %.1f MB (estimated %.1f MB)"),
+                *State->Sequence->GetName(), Progress->GetPeakWorkingSet() / (1024.0 * 1024.0), EstimatedBytes / (1024.0 * 1024.0));
+
+            if (Progress->IsCancelled()) {
+                UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Cancelled processing of '%s'"), *State->Sequence->GetName());
+                Notification->SetComplete(FText::Format(NSLOCTEXT("TransferPelvisToRoot", "BackgroundApplyCancelled", "Cancelled {0}"), SequenceName), FText(), false);
+            } else if (!State->bAnalyzed) {
+                // Most likely the sequence was edited while the job was queued or running, which
+                // drops its poses from the cache. Applying again processes the edited sequence.
+                UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Failed to process '%s', it may have changed during processing"), *State->Sequence->GetName());
+                Notification->SetComplete(FText::Format(NSLOCTEXT("TransferPelvisToRoot", "BackgroundApplyFailed", "Failed to process {0}"), SequenceName), FText(), false);
+            } else {
+                State->Modifier->CommitResult(State->Sequence.Get(), State->Settings, State->Result);
+                Notification->SetComplete(FText::Format(NSLOCTEXT("TransferPelvisToRoot", "BackgroundApplyDone", "Processed {0}"), SequenceName), FText(), true);
+            }
+
+            Progress->Finish();
+            State->Modifier->ActiveProgress.Reset();
+            State->Modifier.Reset();
+            State->Sequence.Reset();
+            State->PosePin.Reset();
+            State->Settings.Binding.Reset();
+            State->Result = FMMApplyResult();
+            State->Reservation.Reset();
+        });
+    };
+
+    FMMBatchScheduler::Get().Submit(MoveTemp(Job));
+}
+
+bool UMotionMatchingPrep::AnalyzeSequence(UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const int32 NumFrames, const float FrameRate, const FInt32Range& FrameRange, FMMApplyResult& OutResult, FMMApplyProgress* Progress)
+{
+    // Everything up to, but not including, writing to the sequence: sampling, velocity table,
+    // smoothing, composing the root, rebasing pelvis and IK bones, the foot speeds, and the foot
+    // contact and lock curves if enabled. Reads only
+    // Settings and the pose cache, not the modifier, the controller or the data model, so it's
+    // safe to run off the game thread. Returns false if cancelled, or if the poses couldn't be
+    // read, in which case nothing may be committed.
+    //
+    // Only the frames in FrameRange are produced. Bones are sampled with the analysis reach on
+    // either side, which is everything those frames depend on, so they come out exactly as in a
+    // full apply. Windows only get clamped at the edges of the sampled context, which are too far
+    // away to matter, unless they are the edges of the sequence, where a full apply clamps too.
+
+    const int32 FirstFrame = FrameRange.GetLowerBoundValue();
+    const int32 EndFrame = FrameRange.GetUpperBoundValue();
+    const int32 NumOutputFrames = EndFrame - FirstFrame;
+
+    const MMCore::FFrameRange OutputRange = { FirstFrame, EndFrame };
+    const MMCore::FFrameRange Context = MMCore::GetAnalysisContext(Settings.Core, OutputRange, NumFrames, FrameRate);
+    const FInt32Range ContextRange(Context.Start, Context.End);
+
+    OutResult = FMMApplyResult();
+    OutResult.NumFrames = NumFrames;
+    OutResult.FrameRate = FrameRate;
+    OutResult.FirstFrame = FirstFrame;
+
+    UE_LOG(LogTemp, Log, TEXT("Processing animation modifier"));
+
+    // Indexed relative to the start of the context from here on. A cyclic context can extend past
+    // either end of the clip, and continues into the neighbouring cycles there. Analyzing without
+    // the poses would write a root pinned to the origin, so a failed or cancelled read ends here.
+    std::vector<MMCore::FPose> WorldTransforms;
+    if (!GetContextWorldTransforms(AnimationSequence, Settings, ContextRange, NumFrames, WorldTransforms, Progress)) {
+        return false;
     }
 
-    int32 NumFrames;
-    UAnimationBlueprintLibrary::GetNumFrames(AnimationSequence, NumFrames);
+    if (Progress) {
+        Progress->AddWorkingSet(WorldTransforms.capacity() * sizeof(MMCore::FPose));
+    }
 
-    if (NumFrames <= 0) {
-        UE_LOG(LogAnimation, Warning, TEXT("MotionMatchingPrep: Animation has no frames"));
+    //
+    // TRANSFER SMOOTHED PELVIS TRANSLATION/ROTATION TO ROOT, AND USE THE NORMAL OF THREE HIP BONES
+    // AS THE FACING DIRECTION
+    //
+    // The analysis runs in the engine independent core, which is the same code the standalone tool
+    // runs outside the editor.
+
+    TOptional<FCoreProgress> CoreProgress;
+    if (Progress) {
+        CoreProgress.Emplace(*Progress);
+    }
+
+    MMCore::FAnalysisOutput Output;
+    if (!MMCore::Analyze(WorldTransforms, ContextRange.GetLowerBoundValue(), OutputRange, FrameRate, Settings.Core, Output, CoreProgress.GetPtrOrNull())) {
+        return false;
+    }
+
+    // Convert to the float keys the controller takes. The root is the top of the hierarchy, so its
+    // keys are also the world space root track.
+    OutResult.Root.Reserve(NumOutputFrames);
+    OutResult.Pelvis.Reserve(NumOutputFrames);
+    OutResult.IkLeftFoot.Reserve(NumOutputFrames);
+    OutResult.IkRightFoot.Reserve(NumOutputFrames);
+    OutResult.IkLeftHand.Reserve(NumOutputFrames);
+    OutResult.IkRightHand.Reserve(NumOutputFrames);
+
+    for (int32 Index = 0; Index < NumOutputFrames; ++Index) {
+        OutResult.Root.Add(FromCore(Output.Root[Index]));
+        OutResult.Pelvis.Add(FromCore(Output.Pelvis[Index]));
+        OutResult.IkLeftFoot.Add(FromCore(Output.IkLeftFoot[Index]));
+        OutResult.IkRightFoot.Add(FromCore(Output.IkRightFoot[Index]));
+        OutResult.IkLeftHand.Add(FromCore(Output.IkLeftHand[Index]));
+        OutResult.IkRightHand.Add(FromCore(Output.IkRightHand[Index]));
+    }
+
+    OutResult.RootTrack = FromCore(Output.Root);
+    OutResult.LeftBallSpeeds = TArray<float>(Output.LeftBallSpeeds.data(), NumOutputFrames);
+    OutResult.RightBallSpeeds = TArray<float>(Output.RightBallSpeeds.data(), NumOutputFrames);
+
+    if (Settings.Core.FootContact.bEnabled) {
+        OutResult.LeftFootContact = TArray<float>(Output.LeftFootContact.data(), NumOutputFrames);
+        OutResult.RightFootContact = TArray<float>(Output.RightFootContact.data(), NumOutputFrames);
+        OutResult.LeftFootLock = TArray<float>(Output.LeftFootLock.data(), NumOutputFrames);
+        OutResult.RightFootLock = TArray<float>(Output.RightFootLock.data(), NumOutputFrames);
+    }
+
+    if (Progress) {
+        Progress->AddWorkingSet(OutResult.GetAllocatedSize());
+    }
+
+    return !Progress || !Progress->IsCancelled();
+}
+
+MMCore::FSettings UMotionMatchingPrep::GetCoreSettings() const
+{
+    // The modifier settings the core analysis reads.
+
+    MMCore::FSettings Settings;
+    Settings.TranslationVelocityMin = TranslationVelocityMin;
+    Settings.TranslationVelocityMax = TranslationVelocityMax;
+    Settings.TranslationSmoothingMinSeconds = TranslationSmoothingMinSeconds;
+    Settings.TranslationSmoothingMaxSeconds = TranslationSmoothingMaxSeconds;
+    Settings.bSeparateFootSmoothing = bSeparateFootSmoothing;
+    Settings.FacingAxis = ToCore(FinalFacingDirection);
+    Settings.bMultiResolutionAnalysis = bMultiResolutionAnalysis;
+    Settings.AnalysisFrameRate = AnalysisFrameRate;
+    Settings.bCyclic = bCyclic;
+    Settings.FootContact.bEnabled = bBakeFootContact;
+    Settings.FootContact.EnterSpeed = FootContactEnterSpeed;
+    Settings.FootContact.ExitSpeed = FootContactExitSpeed;
+    Settings.FootContact.EnterHeight = FootContactEnterHeight;
+    Settings.FootContact.ExitHeight = FootContactExitHeight;
+    Settings.FootContact.MinSeconds = FootContactMinSeconds;
+    Settings.FootContact.LockBlendSeconds = FootLockBlendSeconds;
+
+    return Settings;
+}
+
+int64 UMotionMatchingPrep::EstimatePeakWorkingSet(const FMMApplySettings& Settings, const FInt32Range& FrameRange, const int32 NumFrames, const float FrameRate)
+{
+    // What AnalyzeSequence holds at its peak, which is at the end of smoothing in
+    // MMCore::ComputeRootTrack. At that point the sampled poses of the context, the scratch of the
+    // root composition and the reserved core output are all alive. The converted keys come later,
+    // when the scratch is gone, but are counted on top to stay on the safe side. Poses hold one
+    // transform per tracked bone role, and the sampling scratch one per bone in the binding, which
+    // includes the ancestors of tracked bones.
+
+    const MMCore::FFrameRange OutputRange = { FrameRange.GetLowerBoundValue(), FrameRange.GetUpperBoundValue() };
+    const MMCore::FFrameRange Context = MMCore::GetAnalysisContext(Settings.Core, OutputRange, NumFrames, FrameRate);
+
+    const int64 NumContextFrames = Context.End - Context.Start;
+    const int64 NumOutputFrames = FrameRange.Size<int32>();
+    const int64 DecimationFactor = MMCore::GetDecimationFactor(Settings.Core, FrameRate);
+    const int64 NumRequiredBones = Settings.Binding.IsValid() ? Settings.Binding->GetRequiredBoneNames().Num() : MMNumTrackedBoneRoles;
+
+    const int64 PoseBytes = NumContextFrames * sizeof(MMCore::FPose);
+    const int64 CoarsePoseBytes = DecimationFactor > 1 ? NumContextFrames / DecimationFactor * sizeof(MMCore::FPose) : 0;
+    const int64 SamplingBytes = NumRequiredBones * sizeof(FTransform);
+
+    // Lowest velocities of the pelvis and the feet, smoothed pelvis and foot centers, the three hip tracks in SoA, the facing
+    // components and facings, and the composed root.
+    const int64 PerFrameScratch = (Settings.Core.bSeparateFootSmoothing ? 2 : 1) * sizeof(float) + 2 * sizeof(MMCore::FVec3) + 11 * sizeof(double) + sizeof(MMCore::FQuat4) + sizeof(MMCore::FXform);
+    const int64 ScratchBytes = NumContextFrames * PerFrameScratch;
+
+    // The six bone tracks and both foot speeds of the core output, and the same converted to
+    // position, rotation and scale keys, along with the world root. Baking foot contact adds the
+    // foot positions and heights it's computed from, and both curves for both feet, twice.
+    const int64 PerFrameOutput = 6 * sizeof(MMCore::FXform) + 2 * sizeof(float)
+        + 6 * (2 * sizeof(FVector3f) + sizeof(FQuat4f)) + sizeof(FTransform) + 2 * sizeof(float);
+    const int64 PerFrameContact = Settings.Core.FootContact.bEnabled ? 2 * (sizeof(MMCore::FVec3) + sizeof(float)) + 2 * 4 * sizeof(float) : 0;
+    const int64 OutputBytes = NumOutputFrames * (PerFrameOutput + PerFrameContact);
+
+    return PoseBytes + CoarsePoseBytes + SamplingBytes + ScratchBytes + OutputBytes;
+}
+
+void UMotionMatchingPrep::CommitResult(UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const FMMApplyResult& Result)
+{
+    // Writes an analyzed result to the sequence in one controller bracket, with the bones and
+    // settings it was analyzed with. Game thread only.
+
+    check(IsInGameThread());
+
+    const int32 NumFrames = Result.NumFrames;
+    const float FrameTime = 1.0f / Result.FrameRate;
+
+    // The sequence may have been edited while a background apply was running.
+    int32 CurrentNumFrames;
+    UAnimationBlueprintLibrary::GetNumFrames(AnimationSequence, CurrentNumFrames);
+    if (CurrentNumFrames != NumFrames) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: '%s' changed from %d to %d frames during processing"), *AnimationSequence->GetName(), NumFrames, CurrentNumFrames);
         return;
     }
 
-    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Processing %d frames..."), NumFrames);
+    // A partial result is patched into the existing speed curves.
+    const bool bPartial = Result.IsPartial();
+    if (bPartial && !HasSpeedCurves(AnimationSequence, Settings.Profile, NumFrames)) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Speed curves of '%s' were removed during processing"), *AnimationSequence->GetName());
+        return;
+    }
+
+    const FReferenceSkeleton& RefSkeleton = AnimationSequence->GetSkeleton()->GetReferenceSkeleton();
 
     // Get animation data controller
     IAnimationDataController& Controller = AnimationSequence->GetController();
@@ -106,323 +566,310 @@ void UMotionMatchingPrep::OnApply_Implementation(UAnimSequence* AnimationSequenc
         }
     }
 
+    // Now write the tracks back. Only the analyzed frames for a partial result.
+    const FInt32Range FrameRange(Result.FirstFrame, Result.FirstFrame + Result.Root.Positions.Num());
+    Controller.UpdateBoneTrackKeys(Settings.Profile[EMMBoneRole::Root], FrameRange, Result.Root.Positions, Result.Root.Rotations, Result.Root.Scales);
+    Controller.UpdateBoneTrackKeys(Settings.Profile[EMMBoneRole::Pelvis], FrameRange, Result.Pelvis.Positions, Result.Pelvis.Rotations, Result.Pelvis.Scales);
+    Controller.UpdateBoneTrackKeys(Settings.Profile[EMMBoneRole::IkFootL], FrameRange, Result.IkLeftFoot.Positions, Result.IkLeftFoot.Rotations, Result.IkLeftFoot.Scales);
+    Controller.UpdateBoneTrackKeys(Settings.Profile[EMMBoneRole::IkFootR], FrameRange, Result.IkRightFoot.Positions, Result.IkRightFoot.Rotations, Result.IkRightFoot.Scales);
+    Controller.UpdateBoneTrackKeys(Settings.Profile[EMMBoneRole::IkHandGun], FrameRange, Result.IkRightHand.Positions, Result.IkRightHand.Rotations, Result.IkRightHand.Scales);
+    Controller.UpdateBoneTrackKeys(Settings.Profile[EMMBoneRole::IkHandL], FrameRange, Result.IkLeftHand.Positions, Result.IkLeftHand.Rotations, Result.IkLeftHand.Scales);
+
+    // Replaces a float curve with one linear key per frame.
+    auto WriteCurve = [&](const FName CurveName, const TConstArrayView<float> Values) {
+        const FAnimationCurveIdentifier CurveId(CurveName, ERawCurveTrackTypes::RCT_Float);
+
+        // Check if curve already exists, if so remove it first
+        if (DataModel->FindCurve(CurveId)) {
+            Controller.RemoveCurve(CurveId);
+        }
+
+        Controller.AddCurve(CurveId);
+
+        TArray<FRichCurveKey> Keys;
+        Keys.Reserve(NumFrames);
+
+        for (int32 i = 0; i < NumFrames; ++i) {
+            FRichCurveKey Key;
+            Key.Time = i * FrameTime;
+            Key.Value = Values[i];
+            Key.InterpMode = RCIM_Linear;
+            Keys.Add(Key);
+        }
+
+        Controller.SetCurveKeys(CurveId, Keys);
+    };
+
     //
-    // TRANSFER SMOOTHED PELVIS TRANSLATION/ROTATION TO ROOT, AND USE THE NORMAL OF THREE HIP BONES
-    // AS THE FACING DIRECTION
+    // CREATE FOOT SPEED CURVES
     //
 
-    // Build new key arrays by sampling every frame
-    TArray<FVector3f> RootPositions;
-    TArray<FQuat4f> RootRotations;
-    TArray<FVector3f> RootScales;
+    const TArray Feet = {Settings.Profile[EMMBoneRole::LeftBall], Settings.Profile[EMMBoneRole::RightBall]};
+    const TArray<const TArray<float>*> FootSpeeds = {&Result.LeftBallSpeeds, &Result.RightBallSpeeds};
+    TArray<float> FullFootSpeeds[2]; // For the exports
 
-    TArray<FVector3f> PelvisPositions;
-    TArray<FQuat4f> PelvisRotations;
-    TArray<FVector3f> PelvisScales;
+    for (int32 FootIndex = 0; FootIndex < Feet.Num(); ++FootIndex) {
+        const FName FootName = Feet[FootIndex];
 
-    TArray<FVector3f> IkLeftFootPositions;
-    TArray<FQuat4f> IkLeftFootRotations;
-    TArray<FVector3f> IkLeftFootScales;
+        // Add the curve to the animation
+        const FName CurveName = SpeedCurveName(FootName);
 
-    TArray<FVector3f> IkRightFootPositions;
-    TArray<FQuat4f> IkRightFootRotations;
-    TArray<FVector3f> IkRightFootScales;
+        TArray<float>& CurveValues = FullFootSpeeds[FootIndex];
+        if (bPartial) {
+            const FFloatCurve* ExistingCurve = DataModel->FindFloatCurve(FAnimationCurveIdentifier(CurveName, ERawCurveTrackTypes::RCT_Float));
+            for (const FRichCurveKey& ExistingKey : ExistingCurve->FloatCurve.GetConstRefOfKeys()) {
+                CurveValues.Add(ExistingKey.Value);
+            }
+            for (int32 Index = 0; Index < FootSpeeds[FootIndex]->Num(); ++Index) {
+                CurveValues[Result.FirstFrame + Index] = (*FootSpeeds[FootIndex])[Index];
+            }
+        } else {
+            CurveValues = *FootSpeeds[FootIndex];
+        }
 
-    TArray<FVector3f> IkLeftHandPositions;
-    TArray<FQuat4f> IkLeftHandRotations;
-    TArray<FVector3f> IkLeftHandScales;
+        WriteCurve(CurveName, CurveValues);
+    }
 
-    TArray<FVector3f> IkRightHandPositions;
-    TArray<FQuat4f> IkRightHandRotations;
-    TArray<FVector3f> IkRightHandScales;
+    //
+    // BAKE FOOT CONTACT AND LOCK CURVES
+    //
 
-    // Reserve space
-    RootPositions.Reserve(NumFrames);
-    RootRotations.Reserve(NumFrames);
-    RootScales.Reserve(NumFrames);
+    if (Settings.Core.FootContact.bEnabled) {
+        // Analyzed with the rest, over the whole sequence, since a contact depends on every frame
+        // before it and can't be patched like the speeds.
+        check(!bPartial);
 
-    PelvisPositions.Reserve(NumFrames);
-    PelvisRotations.Reserve(NumFrames);
-    PelvisScales.Reserve(NumFrames);
+        const EMMBoneRole ContactFeet[] = {EMMBoneRole::LeftFoot, EMMBoneRole::RightFoot};
+        const TArray<float>* Contacts[] = {&Result.LeftFootContact, &Result.RightFootContact};
+        const TArray<float>* Locks[] = {&Result.LeftFootLock, &Result.RightFootLock};
 
-    IkLeftFootPositions.Reserve(NumFrames);
-    IkLeftFootRotations.Reserve(NumFrames);
-    IkLeftFootScales.Reserve(NumFrames);
+        for (int32 FootIndex = 0; FootIndex < 2; ++FootIndex) {
+            const FName FootName = Settings.Profile[ContactFeet[FootIndex]];
+            WriteCurve(ContactCurveName(FootName), *Contacts[FootIndex]);
+            WriteCurve(LockCurveName(FootName), *Locks[FootIndex]);
+        }
+    }
 
-    IkRightFootPositions.Reserve(NumFrames);
-    IkRightFootRotations.Reserve(NumFrames);
-    IkRightFootScales.Reserve(NumFrames);
+    // Close Bracket
+    Controller.CloseBracket();
 
-    IkLeftHandPositions.Reserve(NumFrames);
-    IkLeftHandRotations.Reserve(NumFrames);
-    IkLeftHandScales.Reserve(NumFrames);
+    if (bExportTrajectoryFeatures || bExportRootTrajectory) {
+        // A partial result only holds the reprocessed frames. The root is the top of the
+        // hierarchy, so its keys are the world space root track.
+        TArray<FTransform> WrittenRootTrack;
+        if (bPartial) {
+            DataModel->GetBoneTrackTransforms(Settings.Profile[EMMBoneRole::Root], WrittenRootTrack);
+        }
+        const TArray<FTransform>& RootTrack = bPartial ? WrittenRootTrack : Result.RootTrack;
 
-    IkRightHandPositions.Reserve(NumFrames);
-    IkRightHandRotations.Reserve(NumFrames);
-    IkRightHandScales.Reserve(NumFrames);
+        if (bExportTrajectoryFeatures) {
+            ExportTrajectoryFeatures(AnimationSequence, RootTrack, FullFootSpeeds[0], FullFootSpeeds[1], Result.FrameRate, Settings.Core.bCyclic);
+        }
+        if (bExportRootTrajectory) {
+            ExportRootTrajectory(AnimationSequence, RootTrack, Result.FrameRate);
+        }
+    }
 
-    UE_LOG(LogTemp, Log, TEXT("Processing animation modifier"));
+    // The baseline for the next incremental reapply, including the keys just written.
+    AppliedBlockHashes = HashSourceBlocks(AnimationSequence, Settings, NumFrames);
+    AppliedSettingsHash = Settings.Hash;
 
-    // Timing
-    const float SequenceLength = AnimationSequence->GetPlayLength();
-    const float FrameRate = (NumFrames > 1) ? (NumFrames - 1) / SequenceLength : 30.0f;
-    const float FrameTime = 1.0f / FrameRate;
+    if (bPartial) {
+        UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Successfully reprocessed frames %d to %d of %d"), FrameRange.GetLowerBoundValue(), FrameRange.GetUpperBoundValue() - 1, NumFrames);
+    } else {
+        UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Successfully processed %d frames"), NumFrames);
+    }
+}
 
-    // Create smoothing margins in actual frames, based on window size in seconds.
-    TranslationSmoothingMinMargin = FrameRate * TranslationSmoothingMinSeconds / 2;
-    TranslationSmoothingMaxMargin = FrameRate * TranslationSmoothingMaxSeconds / 2;
+bool UMotionMatchingPrep::GetDirtyFrameRange(const UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const int32 NumFrames, const float FrameRate, FInt32Range& OutFrameRange) const
+{
+    // The frames a reapply has to recompute. Compares the source keys against the hashes saved by
+    // the last apply, and widens the changed blocks by the analysis reach, since an edited frame
+    // moves the smoothed root that far. Edits in several places are merged into one range, which
+    // keeps committing simple and is rarely much wider in practice. Returns false if nothing
+    // changed at all.
 
-    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: SequenceLength=%f, FrameRate=%f, FrameTime=%f"), SequenceLength, FrameRate, FrameTime);
+    OutFrameRange = FInt32Range(0, NumFrames);
 
-    const TArray<TMap<FName, FTransform>> WorldTransforms = GetBoneWorldTransformsOverTime(AnimationSequence, NumFrames);
+    if (!bIncrementalReapply || AppliedBlockHashes.Num() == 0) {
+        return true;
+    }
 
-    // Get smoothed velocities of the pelvis bone for the whole sequence. We'll then analyze a
-    // window around current time and use the lowest found velocity to scale the root smoothing
-    // window size. This way, we can have a high degree of smoothing when we're far away from
-    // starts/stops/turns, and a lower degree of smoothing when the character is taking detailed
-    // actions.
-    const int32 SmoothVelocityMargin = 0.41f * FrameRate;
-    const auto SmoothVelocities = GetSmoothVelocitiesForBone(WorldTransforms, PelvisBoneName, SmoothVelocityMargin, FrameRate);
+    if (AppliedSettingsHash != Settings.Hash || !HasSpeedCurves(AnimationSequence, Settings.Profile, NumFrames)) {
+        UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Settings changed since the last apply, processing all frames"));
+        return true;
+    }
 
-    // Convert world -> local and fill track key arrays
-    for (int32 FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
-        const TMap<FName, FTransform>& FrameWorld = WorldTransforms[FrameIndex];
-
-        // Raw, unfiltered pelvis and root info
-        const FTransform* RootWorld = FrameWorld.Find(RootBoneName);
-        const FTransform* PelvisWorld = FrameWorld.Find(PelvisBoneName);
-        const FVector PelvisWorldLocation = PelvisWorld->GetLocation();
-
-        const float LowestVelocityInRange = LowestFloatValueInRange(SmoothVelocities, FrameIndex, TranslationSmoothingMaxMargin);
-
-        const int32 RootSmoothing = FMath::GetMappedRangeValueClamped(
-            FVector2D(TranslationVelocityMin, TranslationVelocityMax),
-            FVector2D(TranslationSmoothingMinMargin, TranslationSmoothingMaxMargin),
-            LowestVelocityInRange
-        );
-
-        UE_LOG(LogTemp, Log, TEXT("Frame %d: LowestVelocityInRange: %f, SmoothingWindowSize = %d"), FrameIndex, LowestVelocityInRange, RootSmoothing);
-
-        // Smooth sample pelvis
-        const FTransform SmoothPelvis = SmoothWorldTransformSingleBone(WorldTransforms, PelvisBoneName, FrameIndex, RootSmoothing);
-        const FVector SmoothPelvisLocation = SmoothPelvis.GetLocation();
-        const FQuat SmoothPelvisOrientation = SmoothPelvis.GetRotation();
-        // const FTransform SmoothCenter = SmoothCenterOfGravity(WorldTransforms, FrameIndex, TranslationSmoothing);
-
-        // Smooth sample average of balls of foot as an alternative root.
-        const FTransform SmoothLeftBall = SmoothWorldTransformSingleBone(WorldTransforms, LeftBallBoneName, FrameIndex, RootSmoothing);
-        const FTransform SmoothRightBall = SmoothWorldTransformSingleBone(WorldTransforms, RightBallBoneName, FrameIndex, RootSmoothing);
-        const FTransform SmoothLeftFoot = SmoothWorldTransformSingleBone(WorldTransforms, LeftFootBoneName, FrameIndex, RootSmoothing);
-        const FTransform SmoothRightFoot = SmoothWorldTransformSingleBone(WorldTransforms, RightFootBoneName, FrameIndex, RootSmoothing);
-        const FVector SmoothFootCenter = (SmoothLeftBall.GetLocation() + SmoothRightBall.GetLocation() + SmoothLeftFoot.GetLocation() + SmoothRightFoot.GetLocation()) / 4;
-
-        if (!RootWorld || !PelvisWorld) {
-            // If either is missing, keep arrays in sync with a safe default and continue.
-            // (You could also choose to break/ensure here.)
-            RootPositions.Add(FVector3f::ZeroVector);
-            RootRotations.Add(FQuat4f::Identity);
-            RootScales.Add(FVector3f(1.0f, 1.0f, 1.0f));
-
-            PelvisPositions.Add(FVector3f::ZeroVector);
-            PelvisRotations.Add(FQuat4f::Identity);
-            PelvisScales.Add(FVector3f(1.0f, 1.0f, 1.0f));
-            UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Missing bone data at frame %d"), FrameIndex);
-            continue;
+    const TArray<uint32> BlockHashes = HashSourceBlocks(AnimationSequence, Settings, NumFrames);
+    if (BlockHashes.Num() != AppliedBlockHashes.Num()) {
+        return true;
+    }
+
+    int32 FirstDirtyBlock = INDEX_NONE;
+    int32 LastDirtyBlock = INDEX_NONE;
+
+    for (int32 BlockIndex = 0; BlockIndex < BlockHashes.Num(); ++BlockIndex) {
+        if (BlockHashes[BlockIndex] != AppliedBlockHashes[BlockIndex]) {
+            if (FirstDirtyBlock == INDEX_NONE) {
+                FirstDirtyBlock = BlockIndex;
+            }
+            LastDirtyBlock = BlockIndex;
         }
+    }
 
-#if true
-        // Get the forward vector from the normal of thigh_r, thigh_l and spine_01. Then convert to pure yaw and assign to root.
-        const FTransform SmoothThighR = SmoothWorldTransformSingleBone(WorldTransforms, RightThighBoneName, FrameIndex, RootSmoothing);
-        const FTransform SmoothThighL = SmoothWorldTransformSingleBone(WorldTransforms, LeftThighBoneName, FrameIndex, RootSmoothing);
-        const FTransform SmoothSpine01 = SmoothWorldTransformSingleBone(WorldTransforms, Spine01BoneName, FrameIndex, RootSmoothing);
-
-        FVector ThighR = SmoothThighR.GetLocation();
-        FVector ThighL = SmoothThighL.GetLocation();
-        FVector Spine = SmoothSpine01.GetLocation();
-
-        // Create edges from thigh_r to the other two points. Cross product to get normal
-        // (right-hand rule: Edge2 x Edge1 to reverse direction)
-        FVector Edge1 = ThighL - ThighR;  // thigh_r to thigh_l (points left)
-        FVector Edge2 = Spine - ThighR;   // thigh_r to spine_01 (points up/forward)
-        FVector Normal = FVector::CrossProduct(Edge2, Edge1);  // Swapped order to reverse
-        Normal.Normalize();
-
-        // Flatten on ground
-        Normal.Z = 0.0f;
-        Normal.Normalize();
-
-        // Normal is hips/spine facing, flattened on ground
-        FQuat FacingRotation;
-        if (FinalFacingDirection == EMMFacingDirection::X) {
-            float YawRadians = FMath::Atan2(Normal.Y, Normal.X);
-            FacingRotation = FQuat(FVector::UpVector, YawRadians);
-        }
-
-        else if (FinalFacingDirection == EMMFacingDirection::Y) {
-            // For Y-forward, rotate Normal 90 degrees: swap X/Y and negate
-            float YawRadians = FMath::Atan2(-Normal.X, Normal.Y);
-            FacingRotation = FQuat(FVector::UpVector, YawRadians);
-        }
-
-        else { // EMMFacingDirection::Z
-            // For Z-forward, use Normal.Z component with X for pitch
-            float YawRadians = FMath::Atan2(Normal.Y, Normal.X);
-            FacingRotation = FQuat(FVector::UpVector, YawRadians);
-        }
-
-        // Create the root motion (original)
-        // FTransform RootWorldShifted = *RootWorld;
-        // const FVector RootPos = FVector(SmoothFootCenter.X, SmoothFootCenter.Y, 0.0f);
-        // RootWorldShifted.SetLocation(RootPos);
-        // RootWorldShifted.SetRotation(FacingRotation);
-
-        // Create the root motion by combining forward motion of pelvis, orientation of hip, and
-        // side-to-side motion of the foot average.
-        FTransform RootWorldShifted = *RootWorld;
-        const FVector SmoothFootCenterGround = FVector(SmoothFootCenter.X, SmoothFootCenter.Y, 0);
-        const FVector RootPos = ComposeGroundMotion(SmoothPelvisLocation, SmoothFootCenterGround, FacingRotation);
-        RootWorldShifted.SetLocation(RootPos);
-        RootWorldShifted.SetRotation(FacingRotation);
-
-        // Update root (absolute) and pelvis (relative)
-        const FTransform RootLocal = RootWorldShifted;
-        const FTransform PelvisLocal = PelvisWorld->GetRelativeTransform(RootWorldShifted);
-#endif
-
-#if false
-        // Original, without changes
-        const FTransform RootLocal = *RootWorld;
-        const FTransform PelvisLocal = PelvisWorld->GetRelativeTransform(*RootWorld);
-#endif
-        // Push keys (convert to UE's float types used by the controller)
-        RootPositions.Add(FVector3f(RootLocal.GetTranslation()));
-        RootRotations.Add(FQuat4f(RootLocal.GetRotation()));
-        RootScales.Add(FVector3f(RootLocal.GetScale3D()));
-
-        PelvisPositions.Add(FVector3f(PelvisLocal.GetTranslation()));
-        PelvisRotations.Add(FQuat4f(PelvisLocal.GetRotation()));
-        PelvisScales.Add(FVector3f(PelvisLocal.GetScale3D()));
-
-        // Reconstruct IK Foot positions. The IK bones are attached to root, but since we're now
-        // shifting root around, we need to counter that movement in the IK Bones (which used to
-        // have feet and hands relative to 0, 0, 0).
-        const FTransform* LeftFootWorld = FrameWorld.Find(LeftFootBoneName);
-        const FTransform NewLeftFootIk = LeftFootWorld->GetRelativeTransform(RootWorldShifted);
-        IkLeftFootPositions.Add(FVector3f(NewLeftFootIk.GetTranslation()));
-        IkLeftFootRotations.Add(FQuat4f(NewLeftFootIk.GetRotation()));
-        IkLeftFootScales.Add(FVector3f(NewLeftFootIk.GetScale3D()));
-
-        const FTransform* RightFootWorld = FrameWorld.Find(RightFootBoneName);
-        const FTransform NewRightFootIk = RightFootWorld->GetRelativeTransform(RootWorldShifted);
-        IkRightFootPositions.Add(FVector3f(NewRightFootIk.GetTranslation()));
-        IkRightFootRotations.Add(FQuat4f(NewRightFootIk.GetRotation()));
-        IkRightFootScales.Add(FVector3f(NewRightFootIk.GetScale3D()));
-
-        // Reconstruct IK Hand positions. The Hand Gun bone is the real right hand (the right hand
-        // bone is just a null transform off of right hand gun). So we set Hand Gun and Left Hand to
-        // the world coordinates of their FK counterparts, and then redo their local coordinates off
-        // of the IK Hand Root, which is just a null transform all the way down to the ultimate
-        // root. But since we've shifted the root around with filtering, we'll get new local
-        // transforms that will maintain the IK positions correctly. We do the right-hand first,
-        // because the left hand is relative to the right hand for the IK bones.
-        const FTransform* RightHandWorld = FrameWorld.Find(RightHandBoneName);
-        const FTransform NewRightHandIk = RightHandWorld->GetRelativeTransform(RootWorldShifted);
-        IkRightHandPositions.Add(FVector3f(NewRightHandIk.GetTranslation()));
-        IkRightHandRotations.Add(FQuat4f(NewRightHandIk.GetRotation()));
-        IkRightHandScales.Add(FVector3f(NewRightHandIk.GetScale3D()));
-
-        const FTransform* LeftHandWorld = FrameWorld.Find(LeftHandBoneName);
-        const FTransform NewLeftHandIk = LeftHandWorld->GetRelativeTransform(*RightHandWorld);
-        IkLeftHandPositions.Add(FVector3f(NewLeftHandIk.GetTranslation()));
-        IkLeftHandRotations.Add(FQuat4f(NewLeftHandIk.GetRotation()));
-        IkLeftHandScales.Add(FVector3f(NewLeftHandIk.GetScale3D()));
-    }
-
-    // Now write the complete tracks back
-    Controller.UpdateBoneTrackKeys(RootBoneName, FInt32Range(0, NumFrames), RootPositions, RootRotations, RootScales);
-    Controller.UpdateBoneTrackKeys(PelvisBoneName, FInt32Range(0, NumFrames), PelvisPositions, PelvisRotations, PelvisScales);
-    Controller.UpdateBoneTrackKeys(IkFootLBoneName, FInt32Range(0, NumFrames), IkLeftFootPositions, IkLeftFootRotations, IkLeftFootScales);
-    Controller.UpdateBoneTrackKeys(IkFootRBoneName, FInt32Range(0, NumFrames), IkRightFootPositions, IkRightFootRotations, IkRightFootScales);
-    Controller.UpdateBoneTrackKeys(IkHandGunBoneName, FInt32Range(0, NumFrames), IkRightHandPositions, IkRightHandRotations, IkRightHandScales);
-    Controller.UpdateBoneTrackKeys(IkHandLBoneName, FInt32Range(0, NumFrames), IkLeftHandPositions, IkLeftHandRotations, IkLeftHandScales);
+    if (FirstDirtyBlock == INDEX_NONE) {
+        return false;
+    }
 
-    //
-    // CREATE FOOT SPEED CURVES
-    //
+    // A contact depends on every frame before it, and in a loop on every frame of the cycle, so the
+    // contact and lock curves only come out as in a full apply when the whole clip is analyzed.
+    if (Settings.Core.FootContact.bEnabled) {
+        UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Foot contact is baked, processing all frames"));
+        return true;
+    }
 
-    const TArray Feet = {LeftBallBoneName, RightBallBoneName};
+    const int32 Reach = MMCore::GetAnalysisReach(Settings.Core, FrameRate);
+    const int32 FirstFrame = FMath::Max(0, FirstDirtyBlock * IncrementalBlockFrames - Reach);
+    const int32 EndFrame = FMath::Min(NumFrames, (LastDirtyBlock + 1) * IncrementalBlockFrames + Reach);
 
-    for (const auto& FootName : Feet) {
-        // Arrays to store curve data
-        TArray<float> CurveTimes;
-        TArray<float> CurveValues;
+    // In a loop, frames near one end also reach around to the other end, and the first and last
+    // frames define the motion of the cycle, which shifts every wrapped frame. Simply process the
+    // whole loop when an edit gets near either end.
+    if (Settings.Core.bCyclic && (FirstFrame == 0 || EndFrame == NumFrames)) {
+        UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Loop changed near its ends, processing all frames"));
+        return true;
+    }
 
-        CurveTimes.Reserve(NumFrames);
-        CurveValues.Reserve(NumFrames);
+    OutFrameRange = FInt32Range(FirstFrame, EndFrame);
 
-        // Calculate foot speed for each frame
-        for (int32 FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
-            const TMap<FName, FTransform>& CurrentFrame = WorldTransforms[FrameIndex];
-            const FTransform* CurrentFootTransform = CurrentFrame.Find(FootName);
+    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Frames %d to %d changed, reprocessing frames %d to %d"),
+        FirstDirtyBlock * IncrementalBlockFrames, FMath::Min(NumFrames, (LastDirtyBlock + 1) * IncrementalBlockFrames) - 1, FirstFrame, EndFrame - 1);
 
-            if (!CurrentFootTransform) {
-                CurveTimes.Add(FrameIndex * FrameTime);
-                CurveValues.Add(0.0f);
-                continue;
-            }
+    return true;
+}
 
-            float Speed = 0.0f;
+TArray<uint32> UMotionMatchingPrep::HashSourceBlocks(const UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const int32 NumFrames)
+{
+    // Hashes the keys of every bone the analysis reads or writes, per block of frames. The stored
+    // keys are hashed rather than sampled poses, which is cheap and exact. Hashing right after an
+    // apply makes its own changes part of the baseline, and output bones are included so manual
+    // edits to them are overwritten like a full apply would.
 
-            // For the last frame, just use the same velocity as the previous frame
-            if (FrameIndex == NumFrames - 1) {
-                // Copy the previous frame's value (or set to 0 if this is the only frame)
-                Speed = (CurveValues.Num() > 0) ? CurveValues.Last() : 0.0f;
-            } else {
-                // Normal case: calculate velocity to next frame
-                const TMap<FName, FTransform>& NextFrame = WorldTransforms[FrameIndex + 1];
-                const FTransform* NextFootTransform = NextFrame.Find(FootName);
-
-                if (NextFootTransform) {
-                    FVector Displacement = NextFootTransform->GetLocation() - CurrentFootTransform->GetLocation();
-                    Speed = Displacement.Size() / FrameTime;
-                }
-            }
+    TArray<uint32> BlockHashes;
 
-            CurveTimes.Add(FrameIndex * FrameTime);
-            CurveValues.Add(Speed);
+    if (!Settings.Binding.IsValid()) {
+        return BlockHashes;
+    }
+
+    TArray<FName> HashedBones = Settings.Binding->GetRequiredBoneNames();
+    HashedBones.Append(Settings.Profile.GetIkBoneNames());
+
+    const IAnimationDataModel* DataModel = AnimationSequence->GetDataModel();
+
+    BlockHashes.Init(0, FMath::DivideAndRoundUp(NumFrames, IncrementalBlockFrames));
+
+    // Tracks that don't have a key per frame affect every block.
+    uint32 SharedHash = 0;
+    TArray<FTransform> Keys;
+
+    for (const FName& BoneName : HashedBones) {
+        if (!DataModel->IsValidBoneTrackName(BoneName)) {
+            SharedHash = HashCombine(SharedHash, GetTypeHash(BoneName.ToString()));
+            continue;
         }
 
-        // Add the curve to the animation
-        const FName CurveName = FName(FootName.ToString() + "_speed");
+        Keys.Reset();
+        DataModel->GetBoneTrackTransforms(BoneName, Keys);
 
-        // Check if curve already exists, if so remove it first
-        if (DataModel->FindCurve(FAnimationCurveIdentifier(CurveName, ERawCurveTrackTypes::RCT_Float))) {
-            Controller.RemoveCurve(FAnimationCurveIdentifier(CurveName, ERawCurveTrackTypes::RCT_Float));
+        if (Keys.Num() != NumFrames) {
+            for (const FTransform& Key : Keys) {
+                SharedHash = HashBoneKey(Key, SharedHash);
+            }
+            continue;
         }
 
-        // Add new curve
-        FAnimationCurveIdentifier CurveId(CurveName, ERawCurveTrackTypes::RCT_Float);
-        Controller.AddCurve(CurveId);
+        for (int32 FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+            uint32& BlockHash = BlockHashes[FrameIndex / IncrementalBlockFrames];
+            BlockHash = HashBoneKey(Keys[FrameIndex], BlockHash);
+        }
+    }
 
-        // Set curve keys
-        TArray<FRichCurveKey> Keys;
-        Keys.Reserve(NumFrames);
+    for (uint32& BlockHash : BlockHashes) {
+        BlockHash = HashCombine(BlockHash, SharedHash);
+    }
 
-        for (int32 i = 0; i < NumFrames; ++i) {
-            FRichCurveKey Key;
-            Key.Time = CurveTimes[i];
-            Key.Value = CurveValues[i];
-            Key.InterpMode = RCIM_Linear;
-            Keys.Add(Key);
+    return BlockHashes;
+}
+
+uint32 UMotionMatchingPrep::HashApplySettings(const int32 NumFrames, const float FrameRate) const
+{
+    // Everything besides the source keys that changes what an apply writes. The hash is saved with
+    // the modifier, so names are hashed as strings, not by their session dependent FName index.
+
+    uint32 Hash = GetTypeHash(AnalysisVersion);
+
+    if (SkeletonBinding.IsValid()) {
+        for (const FName& BoneName : SkeletonBinding->GetRequiredBoneNames()) {
+            Hash = HashCombine(Hash, GetTypeHash(BoneName.ToString()));
         }
+    }
 
-        Controller.SetCurveKeys(CurveId, Keys);
+    for (const FName& BoneName : Profile.BoneNames) {
+        Hash = HashCombine(Hash, GetTypeHash(BoneName.ToString()));
     }
 
-    // Close Bracket
-    Controller.CloseBracket();
+    Hash = HashCombine(Hash, GetTypeHash(static_cast<uint8>(FinalFacingDirection)));
+    Hash = HashCombine(Hash, GetTypeHash(TranslationVelocityMin));
+    Hash = HashCombine(Hash, GetTypeHash(TranslationVelocityMax));
+    Hash = HashCombine(Hash, GetTypeHash(TranslationSmoothingMinSeconds));
+    Hash = HashCombine(Hash, GetTypeHash(TranslationSmoothingMaxSeconds));
+    Hash = HashCombine(Hash, GetTypeHash(bSeparateFootSmoothing));
+    Hash = HashCombine(Hash, GetTypeHash(GetDecimationFactor(FrameRate)));
+    Hash = HashCombine(Hash, GetTypeHash(bCyclic));
+
+    // The contact curves are rewritten in full by every apply, but an apply is skipped altogether
+    // when nothing changed, so their settings still need to be part of the hash.
+    Hash = HashCombine(Hash, GetTypeHash(bBakeFootContact));
+    Hash = HashCombine(Hash, GetTypeHash(FootContactEnterSpeed));
+    Hash = HashCombine(Hash, GetTypeHash(FootContactExitSpeed));
+    Hash = HashCombine(Hash, GetTypeHash(FootContactEnterHeight));
+    Hash = HashCombine(Hash, GetTypeHash(FootContactExitHeight));
+    Hash = HashCombine(Hash, GetTypeHash(FootContactMinSeconds));
+    Hash = HashCombine(Hash, GetTypeHash(FootLockBlendSeconds));
+
+    // Same for the exports. Turning one on, or moving it, for a clip that hasn't changed still has
+    // to write the file.
+    Hash = HashCombine(Hash, GetTypeHash(bExportTrajectoryFeatures));
+    for (const float Offset : TrajectoryFeatureOffsets) {
+        Hash = HashCombine(Hash, GetTypeHash(Offset));
+    }
+    Hash = HashCombine(Hash, GetTypeHash(bExportRootTrajectory));
+    Hash = HashCombine(Hash, GetTypeHash(bExportCorePoses));
+    Hash = HashCombine(Hash, GetTypeHash(GetExportDirectory()));
+
+    Hash = HashCombine(Hash, GetTypeHash(NumFrames));
+    Hash = HashCombine(Hash, GetTypeHash(FrameRate));
+
+    return Hash;
+}
+
+bool UMotionMatchingPrep::HasSpeedCurves(const UAnimSequence* AnimationSequence, const FMMRuntimeSkeletonProfile& BoneProfile, const int32 NumFrames)
+{
+    const IAnimationDataModel* DataModel = AnimationSequence->GetDataModel();
 
-    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Successfully processed %d frames"), NumFrames);
+    for (const FName& BallBoneName : { BoneProfile[EMMBoneRole::LeftBall], BoneProfile[EMMBoneRole::RightBall] }) {
+        const FFloatCurve* Curve = DataModel->FindFloatCurve(FAnimationCurveIdentifier(SpeedCurveName(BallBoneName), ERawCurveTrackTypes::RCT_Float));
+        if (!Curve || Curve->FloatCurve.GetNumKeys() != NumFrames) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int32 UMotionMatchingPrep::GetDecimationFactor(const float FrameRate) const
+{
+    return MMCore::GetDecimationFactor(GetCoreSettings(), FrameRate);
 }
 
 void UMotionMatchingPrep::OnRevert_Implementation(UAnimSequence* AnimationSequence)
@@ -430,6 +877,10 @@ void UMotionMatchingPrep::OnRevert_Implementation(UAnimSequence* AnimationSequen
     // WARNING! Reverting hasn't been well maintained, and nobody knows if it works. I've been
     // deleting clips that failed processing and processed them again from an original copy.
 
+    // Whatever the revert manages to do, the next apply starts from scratch.
+    AppliedBlockHashes.Empty();
+    AppliedSettingsHash = 0;
+
     if (!AnimationSequence || OriginalTransforms.Num() == 0) {
         return;
     }
@@ -478,11 +929,11 @@ void UMotionMatchingPrep::OnRevert_Implementation(UAnimSequence* AnimationSequen
 
     // Controller.AddBoneTrack(RootBoneName);
     // Controller.SetBoneTrackKeys(RootBoneName, RootPositions, RootRotations, RootScales);
-    Controller.UpdateBoneTrackKeys(RootBoneName, FInt32Range(0, NumFrames), RootPositions, RootRotations, RootScales);
+    Controller.UpdateBoneTrackKeys(Profile[EMMBoneRole::Root], FInt32Range(0, NumFrames), RootPositions, RootRotations, RootScales);
 
     // Controller.AddBoneTrack(PelvisBoneName);
     // Controller.SetBoneTrackKeys(PelvisBoneName, PelvisPositions, PelvisRotations, PelvisScales);
-    Controller.UpdateBoneTrackKeys(PelvisBoneName, FInt32Range(0, NumFrames), PelvisPositions, PelvisRotations, PelvisScales);
+    Controller.UpdateBoneTrackKeys(Profile[EMMBoneRole::Pelvis], FInt32Range(0, NumFrames), PelvisPositions, PelvisRotations, PelvisScales);
 
     Controller.CloseBracket();
 
@@ -491,36 +942,214 @@ void UMotionMatchingPrep::OnRevert_Implementation(UAnimSequence* AnimationSequen
     UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Reverted changes"));
 }
 
-FTransform UMotionMatchingPrep::SmoothWorldTransformSingleBone(const TArray<TMap<FName, FTransform>>& WorldTransforms, FName Bone, const int32 FrameIndex, const int32 Margin)
+TArray<FMMMatchQuality> UMotionMatchingPrep::EvaluateMatchQuality(UAnimSequence* AnimationSequence, const TArray<FMMEvaluationSettings>& SettingsSweep)
+{
+    // Scores how closely the composed root follows the capsule a player would have driven along the
+    // same path. The capsule is steered by the raw pelvis ground velocity and the raw hip facing,
+    // and lags behind them according to its spring halflives. Position and facing error tell how
+    // far Pose Search has to stretch to match the trajectory, and foot slide tells how much work is
+    // left for foot IK.
+    //
+    // Root tracks only depend on the velocity range, so sweep entries sharing a range share a
+    // track, and all capsules in the sweep are simulated together in one vectorized pass.
+
+    TArray<FMMMatchQuality> Results;
+
+    if (SettingsSweep.Num() == 0 || !PrepareBoneNames(AnimationSequence)) {
+        return Results;
+    }
+
+    int32 NumFrames;
+    UAnimationBlueprintLibrary::GetNumFrames(AnimationSequence, NumFrames);
+
+    if (NumFrames < 2) {
+        UE_LOG(LogAnimation, Warning, TEXT("MotionMatchingPrep: Not enough frames to evaluate '%s'"), *AnimationSequence->GetName());
+        return Results;
+    }
+
+    const float SequenceLength = AnimationSequence->GetPlayLength();
+    const float FrameRate = (NumFrames - 1) / SequenceLength;
+    const float FrameTime = 1.0f / FrameRate;
+
+    std::vector<MMCore::FPose> WorldTransforms;
+    if (!GetBoneWorldTransformsOverTime(AnimationSequence, SkeletonBinding, 0, NumFrames, WorldTransforms)) {
+        UE_LOG(LogAnimation, Warning, TEXT("MotionMatchingPrep: Couldn't read the poses of '%s'"), *AnimationSequence->GetName());
+        return Results;
+    }
+
+    const MMCore::FSettings CoreSettings = GetCoreSettings();
+
+    auto FacingYaw = [this](const FQuat& Rotation) {
+        const FVector Axis = GetFacingAxis(Rotation);
+        return static_cast<float>(FMath::Atan2(Axis.Y, Axis.X));
+    };
+
+    // Capsule input. Yaw is unwrapped so the rotation spring never takes the long way around.
+    TArray<FVector2D> DesiredVelocities;
+    TArray<float> DesiredYaws;
+    DesiredVelocities.Reserve(NumFrames);
+    DesiredYaws.Reserve(NumFrames);
+
+    MMCore::FPositionTrack RawThighsL;
+    MMCore::FPositionTrack RawThighsR;
+    MMCore::FPositionTrack RawSpines01;
+    RawThighsL.Reserve(NumFrames);
+    RawThighsR.Reserve(NumFrames);
+    RawSpines01.Reserve(NumFrames);
+
+    for (int32 FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+        const MMCore::FPose& FrameWorld = WorldTransforms[FrameIndex];
+
+        const int32 NextIndex = FMath::Max(FrameIndex, 1);
+        const MMCore::FVec3 PelvisDelta = WorldTransforms[NextIndex][MMCore::EBone::Pelvis].Translation - WorldTransforms[NextIndex - 1][MMCore::EBone::Pelvis].Translation;
+        DesiredVelocities.Add(FVector2D(PelvisDelta.X, PelvisDelta.Y) * FrameRate);
+
+        RawThighsL.Add(FrameWorld[MMCore::EBone::LeftThigh].Translation);
+        RawThighsR.Add(FrameWorld[MMCore::EBone::RightThigh].Translation);
+        RawSpines01.Add(FrameWorld[MMCore::EBone::Spine01].Translation);
+    }
+
+    const std::vector<MMCore::FQuat4> RawFacings = MMCore::FacingRotationsFromHips(RawThighsL, RawThighsR, RawSpines01, CoreSettings.FacingAxis);
+
+    for (int32 FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+        float Yaw = FacingYaw(FromCore(RawFacings[FrameIndex]));
+        if (FrameIndex > 0) {
+            Yaw = DesiredYaws.Last() + FMath::FindDeltaAngleRadians(DesiredYaws.Last(), Yaw);
+        }
+        DesiredYaws.Add(Yaw);
+    }
+
+    // One root track per distinct velocity range.
+    TArray<TArray<FTransform>> RootTracks;
+    TArray<FVector2D> RootTrackRanges;
+    TArray<int32> LaneRootTracks;
+
+    for (const FMMEvaluationSettings& Settings : SettingsSweep) {
+        const FVector2D Range(Settings.TranslationVelocityMin, Settings.TranslationVelocityMax);
+
+        int32 TrackIndex = RootTrackRanges.Find(Range);
+        if (TrackIndex == INDEX_NONE) {
+            MMCore::FSettings SweepSettings = CoreSettings;
+            SweepSettings.TranslationVelocityMin = Settings.TranslationVelocityMin;
+            SweepSettings.TranslationVelocityMax = Settings.TranslationVelocityMax;
+
+            TrackIndex = RootTracks.Add(FromCore(MMCore::ComputeRootTrack(WorldTransforms, FrameRate, SweepSettings)));
+            RootTrackRanges.Add(Range);
+        }
+
+        LaneRootTracks.Add(TrackIndex);
+    }
+
+    // Every capsule starts where its root starts, already moving along with the input.
+    TArray<float> PositionHalflives;
+    TArray<float> RotationHalflives;
+
+    for (const FMMEvaluationSettings& Settings : SettingsSweep) {
+        PositionHalflives.Add(Settings.CapsulePositionHalflife);
+        RotationHalflives.Add(Settings.CapsuleRotationHalflife);
+    }
+
+    FMMCapsuleSimulator Simulator;
+    Simulator.Reset(PositionHalflives, RotationHalflives, FrameTime);
+
+    for (int32 Lane = 0; Lane < SettingsSweep.Num(); ++Lane) {
+        const FTransform& StartRoot = RootTracks[LaneRootTracks[Lane]][0];
+        const float StartYaw = DesiredYaws[0] + FMath::FindDeltaAngleRadians(DesiredYaws[0], FacingYaw(StartRoot.GetRotation()));
+        Simulator.SetInitialState(Lane, FVector2D(StartRoot.GetLocation()), DesiredVelocities[0], StartYaw);
+    }
+
+    Simulator.Simulate(DesiredVelocities, DesiredYaws);
+
+    const std::vector<float> LeftBallSpeeds = MMCore::GetBoneSpeeds(WorldTransforms, MMCore::EBone::LeftBall, FrameTime);
+    const std::vector<float> RightBallSpeeds = MMCore::GetBoneSpeeds(WorldTransforms, MMCore::EBone::RightBall, FrameTime);
+
+    for (int32 Lane = 0; Lane < SettingsSweep.Num(); ++Lane) {
+        const FMMEvaluationSettings& Settings = SettingsSweep[Lane];
+        const TArray<FTransform>& RootTrack = RootTracks[LaneRootTracks[Lane]];
+
+        FMMMatchQuality Quality;
+        Quality.Settings = Settings;
+        Quality.NumFrames = NumFrames;
+
+        double PositionErrorSum = 0.0;
+        double FacingErrorSum = 0.0;
+
+        for (int32 FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+            const FVector2D RootPosition(RootTrack[FrameIndex].GetLocation());
+
+            const float PositionError = FVector2D::Distance(Simulator.GetPosition(FrameIndex, Lane), RootPosition);
+            const float FacingError = FMath::Abs(FMath::RadiansToDegrees(FMath::FindDeltaAngleRadians(Simulator.GetYaw(FrameIndex, Lane), FacingYaw(RootTrack[FrameIndex].GetRotation()))));
+
+            PositionErrorSum += PositionError;
+            FacingErrorSum += FacingError;
+            Quality.MaxPositionError = FMath::Max(Quality.MaxPositionError, PositionError);
+            Quality.MaxFacingErrorDegrees = FMath::Max(Quality.MaxFacingErrorDegrees, FacingError);
+
+            // While a foot is planted, any difference between how the capsule moves and how the
+            // animation root moves shows up as sliding. The mismatch is the same for both feet, so a
+            // frame counts once however many feet are planted, and double support doesn't weigh
+            // twice.
+            const bool bFootPlanted = LeftBallSpeeds[FrameIndex] < Settings.FootContactSpeed || RightBallSpeeds[FrameIndex] < Settings.FootContactSpeed;
+            if (FrameIndex > 0 && bFootPlanted) {
+                const FVector2D RootVelocity = (RootPosition - FVector2D(RootTrack[FrameIndex - 1].GetLocation())) * FrameRate;
+                const float SlideSpeed = FVector2D::Distance(Simulator.GetVelocity(FrameIndex, Lane), RootVelocity);
+
+                Quality.FootContactSeconds += FrameTime;
+                Quality.FootSlideDistance += SlideSpeed * FrameTime;
+            }
+        }
+
+        Quality.MeanPositionError = PositionErrorSum / NumFrames;
+        Quality.MeanFacingErrorDegrees = FacingErrorSum / NumFrames;
+        Quality.MeanFootSlideSpeed = (Quality.FootContactSeconds > 0.0f) ? Quality.FootSlideDistance / Quality.FootContactSeconds : 0.0f;
+
+        Results.Add(Quality);
+    }
+
+    return Results;
+}
+
+TArray<FMMMatchQuality> UMotionMatchingPrep::EvaluateMatchQualityForLibrary(const TArray<UAnimSequence*>& AnimationSequences, const TArray<FMMEvaluationSettings>& SettingsSweep)
 {
-    // Get the moving average of the bone's transform in a window of plus/minus Margin around
-    // FrameIndex.
+    // Frame-weighted totals of EvaluateMatchQuality over a whole library, one entry per parameter
+    // set. Sequences that can't be evaluated are skipped.
 
-    const int32 TotalFrames = WorldTransforms.Num();
-    const int32 StartFrame = FMath::Max(0, FrameIndex - Margin);
-    const int32 EndFrame = FMath::Min(TotalFrames - 1, FrameIndex + Margin);
+    TArray<FMMMatchQuality> Totals;
+    Totals.SetNum(SettingsSweep.Num());
 
-    FVector Location = FVector::ZeroVector;
-    FVector Scale = FVector::ZeroVector;
-    TArray<FQuat> Orientations;
-    int32 Count = 0;
+    for (int32 Index = 0; Index < SettingsSweep.Num(); ++Index) {
+        Totals[Index].Settings = SettingsSweep[Index];
+    }
 
-    for (int32 Index = StartFrame; Index <= EndFrame; ++Index) {
-        const TMap<FName, FTransform>& FrameWorld = WorldTransforms[Index];
-        const FTransform* BoneTransformPtr = FrameWorld.Find(Bone);
-        check(BoneTransformPtr); // Assert if bone not found
+    for (UAnimSequence* AnimationSequence : AnimationSequences) {
+        const TArray<FMMMatchQuality> SequenceResults = EvaluateMatchQuality(AnimationSequence, SettingsSweep);
+        if (SequenceResults.Num() != SettingsSweep.Num()) {
+            continue;
+        }
 
-        Location += BoneTransformPtr->GetLocation();
-        Scale += BoneTransformPtr->GetScale3D();
-        Orientations.Add(BoneTransformPtr->GetRotation());
-        ++Count;
+        for (int32 Index = 0; Index < SettingsSweep.Num(); ++Index) {
+            const FMMMatchQuality& Result = SequenceResults[Index];
+            FMMMatchQuality& Total = Totals[Index];
+
+            Total.NumFrames += Result.NumFrames;
+            Total.MeanPositionError += Result.MeanPositionError * Result.NumFrames;
+            Total.MeanFacingErrorDegrees += Result.MeanFacingErrorDegrees * Result.NumFrames;
+            Total.MaxPositionError = FMath::Max(Total.MaxPositionError, Result.MaxPositionError);
+            Total.MaxFacingErrorDegrees = FMath::Max(Total.MaxFacingErrorDegrees, Result.MaxFacingErrorDegrees);
+            Total.FootContactSeconds += Result.FootContactSeconds;
+            Total.FootSlideDistance += Result.FootSlideDistance;
+        }
     }
 
-    Location /= static_cast<float>(Count);
-    Scale /= static_cast<float>(Count);
-    const FQuat Orientation = AverageQuaternions(Orientations);
+    for (FMMMatchQuality& Total : Totals) {
+        if (Total.NumFrames > 0) {
+            Total.MeanPositionError /= Total.NumFrames;
+            Total.MeanFacingErrorDegrees /= Total.NumFrames;
+        }
+        Total.MeanFootSlideSpeed = (Total.FootContactSeconds > 0.0f) ? Total.FootSlideDistance / Total.FootContactSeconds : 0.0f;
+    }
 
-    return FTransform(Orientation, Location, Scale);
+    return Totals;
 }
 
 // FTransform UMotionMatchingPrep::SmoothCenterOfGravity(const TArray<TMap<FName, FTransform>>& WorldTransforms, const int32 FrameIndex, const int32 Margin)
@@ -557,361 +1186,329 @@ FTransform UMotionMatchingPrep::SmoothWorldTransformSingleBone(const TArray<TMap
 //     return FTransform(Orientation, Location, Scale);
 // }
 
-FQuat UMotionMatchingPrep::AverageQuaternions(const TArray<FQuat>& Quaternions)
+bool UMotionMatchingPrep::GetBoneWorldTransformsOverTime(UAnimSequence* AnimSequence, const TSharedPtr<const FMMSkeletonBinding>& Binding, int32 StartFrame, int32 NumFrames, std::vector<MMCore::FPose>& OutPoses, FMMApplyProgress* Progress)
 {
-    if (Quaternions.Num() == 0) {
-        return FQuat::Identity;
-    }
+    // Get all transforms for NumFrames frames from StartFrame for the tracked bones. They come from
+    // the shared pose cache, which only samples frames that no modifier on this sequence has read
+    // since the last change, and then for the bones of all of them at once.
+    //
+    // Returns false if cancelled, or if the cache can't provide the poses, which happens when the
+    // sequence was changed after its bones were requested. OutPoses is left empty then, never
+    // filled with identity poses a caller could mistake for the animation.
 
-    if (Quaternions.Num() == 1) {
-        return Quaternions[0];
-    }
+    OutPoses.clear();
 
-    // Start with the first quaternion as reference
-    FQuat Average = Quaternions[0];
+    if (!Binding.IsValid()) {
+        return false;
+    }
 
-    // Accumulate the rest
-    for (int32 i = 1; i < Quaternions.Num(); i++) {
-        FQuat Q = Quaternions[i];
+    if (Progress) {
+        Progress->EnterStage(FMMApplyProgress::EStage::Sampling, NumFrames);
+    }
 
-        // Ensure we're taking the shortest path (same hemisphere)
-        // If dot product is negative, negate the quaternion
-        if ((Average | Q) < 0.0f)  // | is dot product operator in Unreal
-        {
-            Q = Q * -1.0f;
+    TArray<TArray<FTransform>> Tracks;
+    const bool bSampled = FMMPoseCache::Get().GetBoneTracks(AnimSequence, Binding->GetTrackedBoneNames(), StartFrame, NumFrames, Tracks, [Progress]() {
+        if (Progress) {
+            if (Progress->IsCancelled()) {
+                return false;
+            }
+            Progress->Step();
         }
+        return true;
+    });
 
-        // Accumulate
-        Average.X += Q.X;
-        Average.Y += Q.Y;
-        Average.Z += Q.Z;
-        Average.W += Q.W;
+    if (!bSampled) {
+        return false;
     }
 
-    // Normalize the result
-    Average.Normalize();
+    // The binding was resolved from the tracked bones in role order.
+    check(Tracks.Num() == MMNumTrackedBoneRoles);
+
+    OutPoses.resize(NumFrames);
+    for (int32 Role = 0; Role < MMNumTrackedBoneRoles; ++Role) {
+        const TArray<FTransform>& Track = Tracks[Role];
+        for (int32 Index = 0; Index < NumFrames; ++Index) {
+            OutPoses[Index].Bones[Role] = ToCore(Track[Index]);
+        }
+    }
 
-    return Average;
+    return true;
 }
 
-TMap<FName, FTransform> UMotionMatchingPrep::GetBoneWorldTransformsSingleFrame(UAnimSequence* AnimSequence, int32 FrameIndex, const TArray<FName>& RequestedBones)
+bool UMotionMatchingPrep::GetContextWorldTransforms(UAnimSequence* AnimSequence, const FMMApplySettings& Settings, const FInt32Range& ContextRange, const int32 NumFrames, std::vector<MMCore::FPose>& OutPoses, FMMApplyProgress* Progress)
 {
-    // Get the world transform for the bone names at the given frame by recursively adding
-    // transforms.
+    // Poses for the analysis context. A cyclic context may extend past either end of the loop, in
+    // which case the whole loop is sampled once, and the core continues it into the neighbouring
+    // cycles. Fails like GetBoneWorldTransformsOverTime.
 
-    TMap<FName, FTransform> Results;
+    const int32 ContextStart = ContextRange.GetLowerBoundValue();
+    const int32 ContextEnd = ContextRange.GetUpperBoundValue();
 
-    if (!AnimSequence || RequestedBones.Num() == 0) {
-        return Results;
+    if (ContextStart >= 0 && ContextEnd <= NumFrames) {
+        return GetBoneWorldTransformsOverTime(AnimSequence, Settings.Binding, ContextStart, ContextEnd - ContextStart, OutPoses, Progress);
     }
 
-    USkeleton* Skeleton = AnimSequence->GetSkeleton();
-    if (!Skeleton) {
-        return Results;
+    std::vector<MMCore::FPose> Cycle;
+    if (!GetBoneWorldTransformsOverTime(AnimSequence, Settings.Binding, 0, NumFrames, Cycle, Progress)) {
+        OutPoses.clear();
+        return false;
     }
 
-    const FReferenceSkeleton& RefSkeleton = Skeleton->GetReferenceSkeleton();
+    const MMCore::FFrameRange Context = { ContextStart, ContextEnd };
+    OutPoses = MMCore::ExtendCyclic(Cycle, Context, Settings.Core.FacingAxis);
+    return true;
+}
 
-    // Build set of target bone indices for quick lookup
-    TSet<int32> TargetBoneIndices;
-    for (const FName& BoneName : BoneNames) {
-        int32 BoneIndex = RefSkeleton.FindBoneIndex(BoneName);
-        if (BoneIndex != INDEX_NONE) {
-            TargetBoneIndices.Add(BoneIndex);
-        }
-    }
+FVector UMotionMatchingPrep::GetFacingAxis(const FQuat& Rotation) const
+{
+    // The axis of a root rotation that points in the chosen facing direction.
 
-    if (TargetBoneIndices.Num() == 0) {
-        return Results;
-    }
+    return FromCore(MMCore::GetFacingAxis(ToCore(Rotation), ToCore(FinalFacingDirection)));
+}
 
-    // Build set of all bone indices we need to process
-    // (target bones + all their ancestors up to root)
-    TSet<int32> RequiredBoneIndices;
-    for (int32 TargetIndex : TargetBoneIndices) {
-        int32 CurrentIndex = TargetIndex;
-        while (CurrentIndex != INDEX_NONE) {
-            RequiredBoneIndices.Add(CurrentIndex);
-            CurrentIndex = RefSkeleton.GetParentIndex(CurrentIndex);
-        }
-    }
+FTransform UMotionMatchingPrep::SampleTransformTrack(const TArray<FTransform>& Track, const float FrameTime, const bool bCyclicTrack) const
+{
+    // Samples a per-frame transform track at a fractional frame, clamped to the ends of the track.
+    // A cyclic track wraps around instead. As in the analysis, the last frame is the first frame of
+    // the next cycle, and a sample in a neighbouring cycle is moved by the motion of one cycle per
+    // cycle away, so a walk loop keeps moving forward past its end instead of jumping back.
 
-    // Build a map of parent to children for required bones
-    TMap<int32, TArray<int32>> ChildrenMap;
-    for (int32 BoneIndex : RequiredBoneIndices) {
-        int32 ParentIndex = RefSkeleton.GetParentIndex(BoneIndex);
-        if (ParentIndex != INDEX_NONE) {
-            if (!ChildrenMap.Contains(ParentIndex)) {
-                ChildrenMap.Add(ParentIndex, TArray<int32>());
-            }
-            ChildrenMap[ParentIndex].Add(BoneIndex);
+    const int32 LastFrame = Track.Num() - 1;
+
+    float CycleTime = FrameTime;
+    FTransform Shift = FTransform::Identity;
+
+    if (bCyclicTrack && LastFrame > 0) {
+        const int32 NumCycles = FMath::FloorToInt32(FrameTime / LastFrame);
+        CycleTime = FrameTime - NumCycles * LastFrame;
+
+        const FTransform CycleTransform = Track[0].Inverse() * Track[LastFrame];
+        const FTransform Step = (NumCycles > 0) ? CycleTransform : CycleTransform.Inverse();
+        for (int32 CycleIndex = 0; CycleIndex < FMath::Abs(NumCycles); ++CycleIndex) {
+            Shift = Shift * Step;
         }
     }
 
-    // Store component space transforms as we compute them
-    TMap<int32, FTransform> ComponentSpaceTransforms;
+    const float ClampedTime = FMath::Clamp(CycleTime, 0.0f, static_cast<float>(LastFrame));
+    const int32 Frame0 = FMath::FloorToInt32(ClampedTime);
+    const int32 Frame1 = FMath::Min(Frame0 + 1, LastFrame);
+    const float Alpha = ClampedTime - Frame0;
 
-    // Queue for breadth-first traversal: (BoneIndex, ParentComponentTransform)
-    TQueue<TPair<int32, FTransform>> ProcessQueue;
+    const FVector Location = FMath::Lerp(Track[Frame0].GetLocation(), Track[Frame1].GetLocation(), Alpha);
+    const FQuat Rotation = FQuat::Slerp(Track[Frame0].GetRotation(), Track[Frame1].GetRotation(), Alpha);
 
-    // Start with root bone (index 0)
-    ProcessQueue.Enqueue(TPair<int32, FTransform>(0, FTransform::Identity));
+    return FTransform(Rotation, Location) * Shift;
+}
 
-    // Process bones breadth-first
-    while (!ProcessQueue.IsEmpty()) {
-        TPair<int32, FTransform> Current;
-        ProcessQueue.Dequeue(Current);
+void UMotionMatchingPrep::ExportTrajectoryFeatures(const UAnimSequence* AnimSequence, const TArray<FTransform>& RootTrack, const TArray<float>& LeftBallSpeeds, const TArray<float>& RightBallSpeeds, const float FrameRate, const bool bCyclicTrack)
+{
+    // Writes the trajectory feature block described by FMMTrajectoryFeatureHeader. Pose Search
+    // builds its trajectory channel from past and future root samples expressed in the space of
+    // the current root, which is exactly what we already have after composing the smoothed root,
+    // so we bake the samples here once instead of having every database build resample them.
 
-        int32 BoneIndex = Current.Key;
-        FTransform ParentComponentTransform = Current.Value;
+    const int32 NumFrames = RootTrack.Num();
+    const int32 NumOffsets = TrajectoryFeatureOffsets.Num();
 
-        // Get this bone's local transform
-        FName BoneName = RefSkeleton.GetBoneName(BoneIndex);
-        FTransform LocalTransform;
-        UAnimationBlueprintLibrary::GetBonePoseForFrame(
-            AnimSequence,
-            BoneName,
-            FrameIndex,
-            true,
-            LocalTransform
-        );
+    FMMTrajectoryFeatureHeader Header;
+    Header.NumFrames = NumFrames;
+    Header.NumOffsets = NumOffsets;
+    Header.FloatsPerFrame = NumOffsets * FMMTrajectoryFeatureHeader::FloatsPerOffset + FMMTrajectoryFeatureHeader::FloatsPerFrameSuffix;
+    Header.FrameRate = FrameRate;
 
-        // Compute component space transform
-        FTransform ComponentTransform = LocalTransform * ParentComponentTransform;
-        ComponentSpaceTransforms.Add(BoneIndex, ComponentTransform);
+    TArray<float> Features;
+    Features.Reserve(NumFrames * Header.FloatsPerFrame);
 
-        // If this is one of our target bones, store the result
-        if (TargetBoneIndices.Contains(BoneIndex)) {
-            Results.Add(BoneName, ComponentTransform);
-        }
+    for (int32 FrameIndex = 0; FrameIndex < NumFrames; ++FrameIndex) {
+        const FTransform& CurrentRoot = RootTrack[FrameIndex];
 
-        // If we've found all target bones, we can early exit
-        if (Results.Num() == TargetBoneIndices.Num()) {
-            break;
-        }
+        for (const float Offset : TrajectoryFeatureOffsets) {
+            const FTransform SampledRoot = SampleTransformTrack(RootTrack, FrameIndex + Offset * FrameRate, bCyclicTrack);
 
-        // Queue child bones from our children map
-        if (ChildrenMap.Contains(BoneIndex)) {
-            for (int32 ChildIndex : ChildrenMap[BoneIndex]) {
-                ProcessQueue.Enqueue(TPair<int32, FTransform>(ChildIndex, ComponentTransform));
-            }
+            const FVector Position = CurrentRoot.InverseTransformPositionNoScale(SampledRoot.GetLocation());
+            FVector Facing = CurrentRoot.InverseTransformVectorNoScale(GetFacingAxis(SampledRoot.GetRotation()));
+            Facing.Z = 0.0f;
+            Facing.Normalize();
+
+            Features.Add(Position.X);
+            Features.Add(Position.Y);
+            Features.Add(Position.Z);
+            Features.Add(Facing.X);
+            Features.Add(Facing.Y);
         }
-    }
 
-    return Results;
-}
+        Features.Add(LeftBallSpeeds.IsValidIndex(FrameIndex) ? LeftBallSpeeds[FrameIndex] : 0.0f);
+        Features.Add(RightBallSpeeds.IsValidIndex(FrameIndex) ? RightBallSpeeds[FrameIndex] : 0.0f);
+    }
 
-TArray<TMap<FName, FTransform>> UMotionMatchingPrep::GetBoneWorldTransformsOverTime(UAnimSequence* AnimSequence, int32 NumFrames)
-{
-    // Get all transforms for all frames for the tracked bones.
+    TArray<uint8> Bytes;
+    Bytes.Append(reinterpret_cast<const uint8*>(&Header), sizeof(Header));
+    Bytes.Append(reinterpret_cast<const uint8*>(TrajectoryFeatureOffsets.GetData()), NumOffsets * sizeof(float));
+    Bytes.Append(reinterpret_cast<const uint8*>(Features.GetData()), Features.Num() * sizeof(float));
 
-    TArray<TMap<FName, FTransform>> Result;
+    const FString FilePath = GetExportDirectory() / (AnimSequence->GetName() + TEXT(".mmtf"));
 
-    for (int32 Index = 0; Index < NumFrames; ++Index) {
-        Result.Add(GetBoneWorldTransformsSingleFrame(AnimSequence, Index, BoneNames));
+    if (!FFileHelper::SaveArrayToFile(Bytes, *FilePath)) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Failed to write trajectory features to '%s'"), *FilePath);
+        return;
     }
 
-    return Result;
+    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Wrote trajectory features for %d frames to '%s'"), NumFrames, *FilePath);
 }
 
-TArray<float> UMotionMatchingPrep::GetSmoothVelocitiesForBone(const TArray<TMap<FName, FTransform>>& WorldTransforms, const FName Bone, const int32 Margin, const int32 FrameRate)
+void UMotionMatchingPrep::ExportRootTrajectory(const UAnimSequence* AnimSequence, const TArray<FTransform>& RootTrack, const float FrameRate)
 {
-    TArray<float> Result;
-    FVector PreviousPosition = FVector::ZeroVector;
+    // Writes the final root as an FMMRootTrajectory sidecar. Gameplay code asks where a candidate
+    // clip will take the character, and answering that from the root we composed here is much
+    // cheaper than evaluating the animation tracks at runtime.
+
+    TArray<FMMRootTrajectoryFrame> Frames;
+    Frames.Reserve(RootTrack.Num());
 
-    for (int32 Frame = 0; Frame < WorldTransforms.Num(); ++Frame) {
-        FVector Position = FVector::ZeroVector;
-        const auto& FrameMap = WorldTransforms[Frame];
+    for (const FTransform& Root : RootTrack) {
+        const FVector Location = Root.GetLocation();
+        const FVector Facing = GetFacingAxis(Root.GetRotation());
 
-        if (const auto BoneTransform = FrameMap.Find(Bone)) {
-            Position = BoneTransform->GetLocation();
+        float Yaw = FMath::Atan2(Facing.Y, Facing.X);
+        if (Frames.Num() > 0) {
+            Yaw = Frames.Last().Yaw + FMath::FindDeltaAngleRadians(Frames.Last().Yaw, Yaw);
         }
 
-        const float Velocity = FrameRate * (Position - PreviousPosition).Size();
-        Result.Add(Velocity);
+        FMMRootTrajectoryFrame& Frame = Frames.AddDefaulted_GetRef();
+        Frame.X = Location.X;
+        Frame.Y = Location.Y;
+        Frame.Z = Location.Z;
+        Frame.Yaw = Yaw;
+    }
+
+    const FString FilePath = GetExportDirectory() / (AnimSequence->GetName() + TEXT(".mmrt"));
 
-        PreviousPosition = Position;
+    if (!FMMRootTrajectory::Write(FilePath, Frames, FrameRate)) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Failed to write root trajectory to '%s'"), *FilePath);
+        return;
     }
 
-    return GetSmoothedFloats(Result, Margin);
+    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Wrote root trajectory for %d frames to '%s'"), Frames.Num(), *FilePath);
 }
 
-TArray<float> UMotionMatchingPrep::GetSmoothedFloats(const TArray<float>& Values, const int32 Margin)
+void UMotionMatchingPrep::ExportCorePoses(UAnimSequence* AnimSequence, const int32 NumFrames, const float FrameRate)
 {
-    // Takes an arbitrary array of floats, and smoothes it with a rolling average window clamped to
-    // valid index range.
-
-    TArray<float> Result;
-    const int32 NumValues = Values.Num();
+    // Writes the source poses of the whole sequence as a pose file, for the standalone mmprep tool
+    // to process outside the editor. Written before the apply changes any keys, and sampled through
+    // the pose cache, so the apply that follows doesn't sample the frames again.
 
-    if (NumValues == 0) {
-        return Result;
+    std::vector<MMCore::FPose> Poses;
+    if (!GetBoneWorldTransformsOverTime(AnimSequence, SkeletonBinding, 0, NumFrames, Poses)) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Couldn't read the poses of '%s' to export"), *AnimSequence->GetName());
+        return;
     }
 
-    Result.Reserve(NumValues);
-
-    for (int32 Index = 0; Index < NumValues; ++Index) {
-        const int32 StartIndex = FMath::Max(0, Index - Margin);
-        const int32 EndIndex = FMath::Min(NumValues - 1, Index + Margin);
+    const std::vector<uint8_t> Bytes = MMCore::SavePoseFile(Poses, FrameRate);
 
-        float Sum = 0.0f;
-        int32 Count = 0;
-
-        for (int32 i = StartIndex; i <= EndIndex; ++i) {
-            Sum += Values[i];
-            ++Count;
-        }
+    const FString FilePath = GetExportDirectory() / (AnimSequence->GetName() + TEXT(".mmpose"));
 
-        const float Average = Sum / static_cast<float>(Count);
-        Result.Add(Average);
+    if (!FFileHelper::SaveArrayToFile(TArrayView<const uint8>(Bytes.data(), Bytes.size()), *FilePath)) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Failed to write poses to '%s'"), *FilePath);
+        return;
     }
 
-    return Result;
+    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Wrote poses for %d frames to '%s'"), NumFrames, *FilePath);
 }
 
-float UMotionMatchingPrep::LowestFloatValueInRange(const TArray<float>& Values, const int32 FrameIndex, const int32 Margin)
+FString UMotionMatchingPrep::GetExportDirectory() const
 {
-    const auto NumValues = Values.Num();
-    TOptional<float> Result;
+    return TrajectoryExportDirectory.Path.IsEmpty()
+        ? FPaths::ProjectSavedDir() / TEXT("MotionMatchingPrep")
+        : TrajectoryExportDirectory.Path;
+}
 
-    const int32 StartIndex = FMath::Max(0, FrameIndex - Margin);
-    const int32 EndIndex = FMath::Min(NumValues - 1, FrameIndex + Margin);
+bool UMotionMatchingPrep::LoadTrajectoryFeatures(const FString& FilePath, FMMTrajectoryFeatureHeader& OutHeader, TArray<float>& OutOffsets, TArray<float>& OutFeatures)
+{
+    // Bulk-loads a block written by ExportTrajectoryFeatures. Returns false if the file is missing,
+    // truncated, was written with a different layout version, or has a header that doesn't describe
+    // that layout.
 
-    for (int32 i = StartIndex; i <= EndIndex; ++i) {
-        const float Value = Values[i];
-        if (!Result.IsSet() || Value < Result.GetValue()) {
-            Result = Value;
-        }
+    TArray<uint8> Bytes;
+    if (!FFileHelper::LoadFileToArray(Bytes, *FilePath) || Bytes.Num() < sizeof(FMMTrajectoryFeatureHeader)) {
+        return false;
     }
 
-    if (Result.IsSet()) {
-        return Result.GetValue();
-    } else {
-        return 0;
+    FMemory::Memcpy(&OutHeader, Bytes.GetData(), sizeof(FMMTrajectoryFeatureHeader));
+    if (OutHeader.Magic != FMMTrajectoryFeatureHeader::ExpectedMagic || OutHeader.Version != FMMTrajectoryFeatureHeader::CurrentVersion) {
+        return false;
     }
-}
-
-float UMotionMatchingPrep::HighestFloatValueInRange(const TArray<float>& Values, const int32 FrameIndex, const int32 Margin)
-{
-    const auto NumValues = Values.Num();
-    TOptional<float> Result;
-
-    const int32 StartIndex = FMath::Max(0, FrameIndex - Margin);
-    const int32 EndIndex = FMath::Min(NumValues - 1, FrameIndex + Margin);
 
-    for (int32 i = StartIndex; i <= EndIndex; ++i) {
-        const float Value = Values[i];
-        if (!Result.IsSet() || Value > Result.GetValue()) {
-            Result = Value;
-        }
+    // The counts are checked before they size anything, and the row stride has to be the one the
+    // offsets imply, since every consumer indexes rows with it.
+    if (OutHeader.NumFrames < 0 || OutHeader.NumOffsets < 0 || OutHeader.FrameRate <= 0.0f
+        || OutHeader.FloatsPerFrame != OutHeader.NumOffsets * FMMTrajectoryFeatureHeader::FloatsPerOffset + FMMTrajectoryFeatureHeader::FloatsPerFrameSuffix) {
+        return false;
     }
 
-    if (Result.IsSet()) {
-        return Result.GetValue();
-    } else {
-        return 999;
+    const int64 NumFeatures = static_cast<int64>(OutHeader.NumFrames) * OutHeader.FloatsPerFrame;
+    const int64 ExpectedSize = sizeof(FMMTrajectoryFeatureHeader) + (OutHeader.NumOffsets + NumFeatures) * sizeof(float);
+    if (Bytes.Num() != ExpectedSize) {
+        return false;
     }
+
+    const float* Data = reinterpret_cast<const float*>(Bytes.GetData() + sizeof(FMMTrajectoryFeatureHeader));
+    OutOffsets = TArray<float>(Data, OutHeader.NumOffsets);
+    OutFeatures = TArray<float>(Data + OutHeader.NumOffsets, NumFeatures);
+
+    return true;
 }
 
-int32 UMotionMatchingPrep::WindowSizeFromDivergence(const TArray<float>& Values, const int32 FrameIndex, const float PercentDivergence)
+bool UMotionMatchingPrep::PrepareBoneNames(UAnimSequence* AnimationSequence)
 {
-    // NOTE: Currently not used. Having a dynamic window size this way caused artifacts around
-    // changes in window size, jumping as glitches in the root path.
-    //
-    // Detects a window size we can use for translation and rotation smoothing based on changes in
-    // velocity. We start from a center value, and expand outwards until we find a velocity value
-    // that diverges more than e.g. 10% (PercentDivergence = 0.1). This auto-sizes the window to
-    // velocities that are more or less similar. Returns the margin that can be used for root
-    // smoothing and facing smoothing. NOTE: This expects the Values to be valocity values that are
-    // already smoothed. Without pre-smoothing, we can get some drastic edge effects as the window
-    // size changes from frame to frame and we suddenly include frames in the smoothing or not. By
-    // pre-smoothing, we ensure that there are no surprises lurking right outside the horizon that
-    // suddenly change the averaging when we expand to include them.
-
-    const auto NumValues = Values.Num();
-    const float InitialValue = Values[FrameIndex];
-
-    // When we stop, we want to return the previous spread value, not the current value where we
-    // overshot.
-    int32 PreviousSpread = 0;
-
-    for (int32 Spread = 0; Spread < 1000; ++Spread) {
-        const int32 LeftIndex = FrameIndex - Spread;
-        if (LeftIndex >= 0) {
-            const float ValueAtIndex = Values[LeftIndex];
-            if (FMath::Abs(ValueAtIndex - InitialValue) / InitialValue > PercentDivergence) {
-                return PreviousSpread;
-            }
-        }
+    // Resolves the skeleton profile into bone names by role, and verifies that they exist in the
+    // sequence skeleton.
 
-        const int32 RightIndex = FrameIndex + Spread;
-        if (RightIndex < NumValues) {
-            const float ValueAtIndex = Values[RightIndex];
-            if (FMath::Abs(ValueAtIndex - InitialValue) / InitialValue > PercentDivergence) {
-                return PreviousSpread;
-            }
-        }
+    if (SkeletonProfile == EMMSkeletonProfile::MannyQuinn) {
+        static const FMMRuntimeSkeletonProfile MannyQuinn(MMMannyQuinnProfile);
+        Profile = MannyQuinn;
+    } else {
+        Profile[EMMBoneRole::Root] = RootBoneName;
+        Profile[EMMBoneRole::Pelvis] = PelvisBoneName;
+        Profile[EMMBoneRole::LeftThigh] = LeftThighBoneName;
+        Profile[EMMBoneRole::RightThigh] = RightThighBoneName;
+        Profile[EMMBoneRole::Spine01] = Spine01BoneName;
+        // Spine02BoneName, // Center of gravity calculation is disabled. Didn't meaningfully improve path
+        // Spine03BoneName,
+        // Neck01BoneName,
+        Profile[EMMBoneRole::LeftFoot] = LeftFootBoneName;
+        Profile[EMMBoneRole::RightFoot] = RightFootBoneName;
+        Profile[EMMBoneRole::LeftBall] = LeftBallBoneName;
+        Profile[EMMBoneRole::RightBall] = RightBallBoneName;
+        Profile[EMMBoneRole::LeftHand] = LeftHandBoneName;
+        Profile[EMMBoneRole::RightHand] = RightHandBoneName;
+        Profile[EMMBoneRole::IkFootL] = IkFootLBoneName;
+        Profile[EMMBoneRole::IkFootR] = IkFootRBoneName;
+        Profile[EMMBoneRole::IkHandGun] = IkHandGunBoneName;
+        Profile[EMMBoneRole::IkHandL] = IkHandLBoneName;
+    }
 
-        PreviousSpread = Spread;
+    if (!AnimationSequence) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Invalid animation sequence"));
+        return false;
     }
 
-    // Return a zero window size. I don't know exactly what this would mean.
-    return 0;
-}
+    USkeleton* Skeleton = AnimationSequence->GetSkeleton();
+    if (!Skeleton) {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: No skeleton found"));
+        return false;
+    }
 
-FVector UMotionMatchingPrep::ComposeGroundMotion(const FVector& PelvisPos, const FVector& FootPlanePos, const FQuat& FootPlaneRot)
-{
-    // This function composes the ground motion from a combination of pelvis and foot motion. The
-    // most reliable forward/backward movement comes from the pelvis bone, because it moves along
-    // with the body's mass, and has realistic intertia. But this bone has sideways bobbing, and
-    // doesn't do a good job of creating a path through the middle of the character's motion, which
-    // is preferred for motion matching. Conversely, the most reliable lateral position comes from
-    // an average of the foot bones (ball + foot in each side), which creates a sort of virtual bone
-    // suspended between the feet. The sideways motion of this virtual bone is extremely stable, but
-    // its forward motion speeds up and slows down along with the walking motion.
-    //
-    // This function expects a smoothed PelvisPos and a smoothed FootPlanePos and Rotation, which
-    // has +X pointing forwards (will later be adapted to also accept +Y as the chosen forward
-    // direction). It projects the pelvis down on to the foot plane, and then projects that plane
-    // point onto the plane's X axis.
-
-    // 1. Get the foot plane's normal (Z axis) and forward (X axis)
-    FVector FootPlaneNormal = FootPlaneRot.GetAxisZ();
-    // FVector FootPlaneForward = FootPlaneRot.GetAxisX();
-
-    // New addition that properly honors the chosen forward direction. But to be clear, this worked
-    // even by always getting the X axis, so mathematically, this is not so important.
-    // This forward direction isn't used as deeply as one would think. After
-    // all, we're just piecing together a ground position by duct-taping different axis of several
-    // inputs together.
-    FVector FootPlaneForward;
-    switch (FinalFacingDirection) {
-    case EMMFacingDirection::Y:
-        FootPlaneForward = FootPlaneRot.GetAxisY();
-        break;
-    case EMMFacingDirection::Z:
-        // If you ever use Z, define what “forward on the plane” means here.
-        FootPlaneForward = FootPlaneRot.GetAxisX(); // or some custom mapping
-        break;
-    case EMMFacingDirection::X:
-    default:
-        FootPlaneForward = FootPlaneRot.GetAxisX();
-        break;
-    }
-    FootPlaneForward.Normalize();
-
-    // 2. Project pelvis onto the foot plane
-    FVector PelvisToPlane = PelvisPos - FootPlanePos;
-    float DistanceToPlane = FVector::DotProduct(PelvisToPlane, FootPlaneNormal);
-    FVector PelvisOnPlane = PelvisPos - (FootPlaneNormal * DistanceToPlane);
-
-    // 3. Project pelvis onto the foot plane's X axis
-    FVector PelvisOnPlaneDelta = PelvisOnPlane - FootPlanePos;
-    float ForwardDistance = FVector::DotProduct(PelvisOnPlaneDelta, FootPlaneForward);
-
-    // 4. Composed position on the plane's X axis
-    FVector ComposedPosition = FootPlanePos + (FootPlaneForward * ForwardDistance);
-
-    return ComposedPosition;
-}
+    // Resolve all bones, including the IK bones we write to, against the skeleton. The binding is
+    // shared with every other sequence on the same skeleton, and logs any bone that's missing.
+    // Tracked bones are resolved in role order, so their binding slots line up with the roles.
+    SkeletonBinding = FMMSkeletonBinding::Get(Skeleton, Profile.GetTrackedBoneNames(), Profile.GetIkBoneNames());
+    if (!SkeletonBinding.IsValid()) {
+        return false;
+    }
+
+    // Announce the bones to the pose cache, so they're sampled together with the bones of other
+    // modifiers on this sequence.
+    FMMPoseCache::Get().RequestBones(AnimationSequence, Profile.GetTrackedBoneNames());
 
+    return true;
+}
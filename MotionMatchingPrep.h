@@ -4,6 +4,13 @@
 
 #include "CoreMinimal.h"
 #include "AnimationModifier.h"
+#include "Engine/EngineTypes.h"
+#include "MotionMatchingCore.h"
+#include "MotionMatchingSkeletonProfile.h"
+#include "MotionMatchingTelemetry.h"
+#include <atomic>
+
+class FMMSkeletonBinding;
 #include "MotionMatchingPrep.generated.h"
 
 UENUM()
@@ -14,6 +21,261 @@ enum class EMMFacingDirection
     Z,
 };
 
+UENUM()
+enum class EMMSkeletonProfile
+{
+    MannyQuinn UMETA(DisplayName = "Manny/Quinn"),
+    Custom,
+};
+
+// Layout of the trajectory feature block that can be exported for every processed sequence. The
+// header is followed by NumOffsets floats holding the sample offsets in seconds, and then by
+// NumFrames rows of FloatsPerFrame floats. Each row holds, for every offset, the root position
+// (X, Y, Z) and ground facing (X, Y) relative to that frame's root, followed by the left and right
+// ball speeds. Rows are contiguous so a database build can bulk-load the whole block in one read.
+struct FMMTrajectoryFeatureHeader
+{
+    static constexpr uint32 ExpectedMagic = 0x46544D4D; // "MMTF"
+    static constexpr uint32 CurrentVersion = 1;
+    static constexpr int32 FloatsPerOffset = 5;
+    static constexpr int32 FloatsPerFrameSuffix = 2;
+
+    uint32 Magic = ExpectedMagic;
+    uint32 Version = CurrentVersion;
+    int32 NumFrames = 0;
+    int32 NumOffsets = 0;
+    int32 FloatsPerFrame = 0;
+    float FrameRate = 0.0f;
+};
+
+// Position/rotation/scale keys for one bone track, in the float types the data controller takes.
+struct FMMBoneTrackKeys
+{
+    TArray<FVector3f> Positions;
+    TArray<FQuat4f> Rotations;
+    TArray<FVector3f> Scales;
+
+    void Reserve(const int32 NumFrames)
+    {
+        Positions.Reserve(NumFrames);
+        Rotations.Reserve(NumFrames);
+        Scales.Reserve(NumFrames);
+    }
+
+    void Add(const FTransform& Transform)
+    {
+        Positions.Add(FVector3f(Transform.GetTranslation()));
+        Rotations.Add(FQuat4f(Transform.GetRotation()));
+        Scales.Add(FVector3f(Transform.GetScale3D()));
+    }
+
+    SIZE_T GetAllocatedSize() const
+    {
+        return Positions.GetAllocatedSize() + Rotations.GetAllocatedSize() + Scales.GetAllocatedSize();
+    }
+};
+
+// Everything an apply writes to the sequence, computed up front so it can be produced off the game
+// thread and committed in one controller bracket.
+struct FMMApplyResult
+{
+    int32 NumFrames = 0;
+    float FrameRate = 30.0f;
+
+    // The arrays below cover the frames from FirstFrame on. An incremental reapply only produces the
+    // frames affected by edits, a full apply produces all NumFrames.
+    int32 FirstFrame = 0;
+
+    bool IsPartial() const { return FirstFrame > 0 || Root.Positions.Num() < NumFrames; }
+
+    FMMBoneTrackKeys Root;
+    FMMBoneTrackKeys Pelvis;
+    FMMBoneTrackKeys IkLeftFoot;
+    FMMBoneTrackKeys IkRightFoot;
+    FMMBoneTrackKeys IkLeftHand;  // Relative to the right hand
+    FMMBoneTrackKeys IkRightHand; // Written to the hand gun bone
+
+    TArray<FTransform> RootTrack; // World space, for the trajectory export
+    TArray<float> LeftBallSpeeds;
+    TArray<float> RightBallSpeeds;
+    TArray<float> LeftFootContact; // Only with foot contact baked, which always processes all frames
+    TArray<float> RightFootContact;
+    TArray<float> LeftFootLock;
+    TArray<float> RightFootLock;
+
+    SIZE_T GetAllocatedSize() const
+    {
+        return Root.GetAllocatedSize() + Pelvis.GetAllocatedSize() + IkLeftFoot.GetAllocatedSize() + IkRightFoot.GetAllocatedSize()
+            + IkLeftHand.GetAllocatedSize() + IkRightHand.GetAllocatedSize() + RootTrack.GetAllocatedSize()
+            + LeftBallSpeeds.GetAllocatedSize() + RightBallSpeeds.GetAllocatedSize()
+            + LeftFootContact.GetAllocatedSize() + RightFootContact.GetAllocatedSize() + LeftFootLock.GetAllocatedSize() + RightFootLock.GetAllocatedSize();
+    }
+};
+
+// The settings an apply runs with, captured from the modifier on the game thread when the apply
+// starts. The analysis reads only this and the pose cache, never the modifier, so a background
+// apply doesn't read UPROPERTYs off the game thread, and editing the modifier while the apply is
+// queued or running doesn't change its settings halfway through. The commit writes with the same
+// profile and saves the same settings hash, so the result stays consistent with what was analyzed.
+struct FMMApplySettings
+{
+    MMCore::FSettings Core;
+    FMMRuntimeSkeletonProfile Profile;
+    TSharedPtr<const FMMSkeletonBinding> Binding;
+    uint32 Hash = 0; // HashApplySettings when captured
+};
+
+// Progress and cancellation shared between a background apply and the game thread. The worker
+// enters stages and steps through them, the game thread reads the description and may cancel. The
+// worker also accounts for its large buffers here, so the peak working set can be reported. With a
+// telemetry channel attached, entering and leaving stages is also emitted as timed events.
+class FMMApplyProgress
+{
+public:
+    enum class EStage : uint8
+    {
+        Queued,
+        Sampling,
+        VelocityTable,
+        Smoothing,
+        Rebasing,
+        Curves,
+        Num,
+    };
+
+    void EnterStage(const EStage InStage, const int32 InNumSteps)
+    {
+        LeaveStage();
+
+        NumSteps = InNumSteps;
+        CompletedSteps = 0;
+        Stage = InStage;
+        bInStage = true;
+
+        if (Telemetry) {
+            Telemetry->Emit(FMMTelemetryEvent::EType::Enter, static_cast<uint8>(InStage), InNumSteps);
+        }
+    }
+
+    // Entering a stage leaves the previous one, so this is only needed after the last stage.
+    void LeaveStage()
+    {
+        if (bInStage && Telemetry) {
+            Telemetry->Emit(FMMTelemetryEvent::EType::Exit, static_cast<uint8>(Stage.load()), CompletedSteps);
+        }
+        bInStage = false;
+    }
+
+    void Step() { ++CompletedSteps; }
+    void Cancel() { bCancelled = true; }
+    void Finish() { bFinished = true; }
+
+    bool IsCancelled() const { return bCancelled; }
+    bool IsFinished() const { return bFinished; }
+
+    void AddWorkingSet(const int64 Bytes)
+    {
+        // Only the worker changes the working set, so the peak doesn't need a compare-exchange.
+        const int64 Current = WorkingSetBytes += Bytes;
+        if (Current > PeakWorkingSetBytes) {
+            PeakWorkingSetBytes = Current;
+        }
+    }
+
+    void ReleaseWorkingSet(const int64 Bytes) { WorkingSetBytes -= Bytes; }
+    int64 GetPeakWorkingSet() const { return PeakWorkingSetBytes; }
+
+    // Attached before the apply starts. Only the thread currently running the apply emits to it.
+    TSharedPtr<FMMTelemetryChannel> Telemetry;
+
+    FText GetDescription() const
+    {
+        static const FText StageNames[] = {
+            NSLOCTEXT("TransferPelvisToRoot", "StageQueued", "Waiting for memory budget"),
+            NSLOCTEXT("TransferPelvisToRoot", "StageSampling", "Sampling bones"),
+            NSLOCTEXT("TransferPelvisToRoot", "StageVelocityTable", "Building velocity table"),
+            NSLOCTEXT("TransferPelvisToRoot", "StageSmoothing", "Smoothing and composing root"),
+            NSLOCTEXT("TransferPelvisToRoot", "StageRebasing", "Rebasing pelvis and IK bones"),
+            NSLOCTEXT("TransferPelvisToRoot", "StageCurves", "Computing foot speeds"),
+        };
+
+        const int32 StageIndex = FMath::Min(static_cast<int32>(Stage.load()), static_cast<int32>(EStage::Num) - 1);
+        const int32 Total = FMath::Max(NumSteps.load(), 1);
+        const int32 Percent = 100 * FMath::Min(CompletedSteps.load(), Total) / Total;
+
+        return FText::Format(NSLOCTEXT("TransferPelvisToRoot", "StageProgress", "{0} ({1}%)"), StageNames[StageIndex], Percent);
+    }
+
+private:
+    std::atomic<EStage> Stage = EStage::Queued;
+    std::atomic<int32> NumSteps = 0;
+    std::atomic<int32> CompletedSteps = 0;
+    std::atomic<bool> bCancelled = false;
+    std::atomic<bool> bFinished = false;
+    std::atomic<int64> WorkingSetBytes = 0;
+    std::atomic<int64> PeakWorkingSetBytes = 0;
+    bool bInStage = false; // Only touched by the thread running the apply
+};
+
+// One parameter set for the offline match-quality evaluator.
+USTRUCT(BlueprintType)
+struct FMMEvaluationSettings
+{
+    GENERATED_BODY()
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Evaluation", meta = (ToolTip = "Same as the modifier setting, in units/sec."))
+    float TranslationVelocityMin = 5;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Evaluation", meta = (ToolTip = "Same as the modifier setting, in units/sec."))
+    float TranslationVelocityMax = 25;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Evaluation", meta = (ToolTip = "Halflife in seconds of the simulated capsule's velocity spring."))
+    float CapsulePositionHalflife = 0.2f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Evaluation", meta = (ToolTip = "Halflife in seconds of the simulated capsule's facing spring."))
+    float CapsuleRotationHalflife = 0.2f;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Evaluation", meta = (ToolTip = "A ball of foot slower than this, in units/sec, is considered planted when measuring foot slide."))
+    float FootContactSpeed = 15;
+};
+
+// Match-quality scores for one parameter set. Errors compare the composed root against the
+// simulated capsule. Foot slide is the capsule/root velocity mismatch accumulated while at least one
+// foot is planted, which is the sliding that foot IK has to hide at runtime. Frames where both feet
+// are planted count once.
+USTRUCT(BlueprintType)
+struct FMMMatchQuality
+{
+    GENERATED_BODY()
+
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Evaluation")
+    FMMEvaluationSettings Settings;
+
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Evaluation")
+    int32 NumFrames = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Evaluation")
+    float MeanPositionError = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Evaluation")
+    float MaxPositionError = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Evaluation")
+    float MeanFacingErrorDegrees = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Evaluation")
+    float MaxFacingErrorDegrees = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Evaluation", meta = (ToolTip = "Time in seconds during which at least one foot is planted."))
+    float FootContactSeconds = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Evaluation", meta = (ToolTip = "Slide accumulated while at least one foot is planted, counted once per frame."))
+    float FootSlideDistance = 0;
+
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Evaluation", meta = (ToolTip = "Foot slide distance per second of foot contact."))
+    float MeanFootSlideSpeed = 0;
+};
+
 UCLASS()
 class GAMEANIMATIONSAMPLE2_API UMotionMatchingPrep : public UAnimationModifier
 {
@@ -25,20 +287,33 @@ public:
     virtual void OnApply_Implementation(UAnimSequence* AnimationSequence) override;
     virtual void OnRevert_Implementation(UAnimSequence* AnimationSequence) override;
 
+    // Offline evaluation. Scores the composed root against simulated gameplay capsules for every
+    // parameter set, without modifying the sequence. Meant to be driven from editor scripts.
+    UFUNCTION(BlueprintCallable, Category = "Evaluation")
+    TArray<FMMMatchQuality> EvaluateMatchQuality(UAnimSequence* AnimationSequence, const TArray<FMMEvaluationSettings>& SettingsSweep);
+
+    UFUNCTION(BlueprintCallable, Category = "Evaluation")
+    TArray<FMMMatchQuality> EvaluateMatchQualityForLibrary(const TArray<UAnimSequence*>& AnimationSequences, const TArray<FMMEvaluationSettings>& SettingsSweep);
+
+    static bool LoadTrajectoryFeatures(const FString& FilePath, FMMTrajectoryFeatureHeader& OutHeader, TArray<float>& OutOffsets, TArray<float>& OutFeatures);
+
 protected:
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Root bone that will receive the smoothed translation."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Manny/Quinn uses the built-in bone names of the UE5 mannequins. Custom uses the bone names below."))
+    EMMSkeletonProfile SkeletonProfile = EMMSkeletonProfile::Custom;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Root bone that will receive the smoothed translation."))
     FName RootBoneName = TEXT("root");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Pelvis bone that currently holds the actor translation."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Pelvis bone that currently holds the actor translation."))
     FName PelvisBoneName = TEXT("pelvis");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "The normal of Left Thigh, Right Thing and First Spine Joint is used as the facing direction."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "The normal of Left Thigh, Right Thing and First Spine Joint is used as the facing direction."))
     FName LeftThighBoneName = TEXT("thigh_l");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "The normal of Left Thigh, Right Thing and First Spine Joint is used as the facing direction."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "The normal of Left Thigh, Right Thing and First Spine Joint is used as the facing direction."))
     FName RightThighBoneName = TEXT("thigh_r");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "The normal of Left Thigh, Right Thing and Spine_01 Joint is used as the facing direction."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "The normal of Left Thigh, Right Thing and Spine_01 Joint is used as the facing direction."))
     FName Spine01BoneName = TEXT("spine_01");
 
     // UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Spine_02, Spine_03 and Neck_01 are used in center-of-gravity calculations."))
@@ -53,34 +328,34 @@ protected:
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Axis to be the forward/facing direction of the root node."))
     EMMFacingDirection FinalFacingDirection = EMMFacingDirection::Y;
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "A curve channel will record the Left Foot speed."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "A curve channel will record the Left Foot speed."))
     FName LeftFootBoneName = TEXT("foot_l");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "A curve channel will record the Right Foot speed."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "A curve channel will record the Right Foot speed."))
     FName RightFootBoneName = TEXT("foot_r");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Left/Right ball of foot are use as an alternative root."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Left/Right ball of foot are use as an alternative root."))
     FName LeftBallBoneName = TEXT("ball_l");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Left/Right ball of foot are use as an alternative root."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Left/Right ball of foot are use as an alternative root."))
     FName RightBallBoneName = TEXT("ball_r");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Left FK hand"))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Left FK hand"))
     FName LeftHandBoneName = TEXT("hand_l");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Right FK hand"))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Right FK hand"))
     FName RightHandBoneName = TEXT("hand_r");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Attached to ik_foot_root, which is a null transform and therefore root. We conform this to the FK hand position after shifting around the root."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Attached to ik_foot_root, which is a null transform and therefore root. We conform this to the FK hand position after shifting around the root."))
     FName IkFootLBoneName = TEXT("ik_foot_l");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Attached to ik_foot_root, which is a null transform and therefore root. We conform this to the FK hand position after shifting around the root."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Attached to ik_foot_root, which is a null transform and therefore root. We conform this to the FK hand position after shifting around the root."))
     FName IkFootRBoneName = TEXT("ik_foot_r");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Attached to IK Hand Run to define the left hand relative to the right."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Attached to IK Hand Run to define the left hand relative to the right."))
     FName IkHandLBoneName = TEXT("ik_hand_l");
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Right hand bone, attached to ik_hand_gun with null transform. IK Hand Gun is the real right hand."))
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "SkeletonProfile == EMMSkeletonProfile::Custom", ToolTip = "Right hand bone, attached to ik_hand_gun with null transform. IK Hand Gun is the real right hand."))
     FName IkHandRBoneName = TEXT("ik_hand_r");
 
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = ""))
@@ -98,6 +373,66 @@ protected:
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "The window in seconds around current time to use for translation moving average."))
     float TranslationSmoothingMaxSeconds = 0.41;
 
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Smooth the feet and balls of foot with their own window sizes, mapped from the lowest average speed of both balls instead of the pelvis speed. Keeps foot work that barely moves the pelvis, like shuffling and side steps, sharper in the root."))
+    bool bSeparateFootSmoothing = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "When reapplying, only recompute and write the frames that can be affected by bone keys edited since the last apply. Changing any setting or the frame count still processes the whole sequence."))
+    bool bIncrementalReapply = true;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Run the analysis as a background task with a cancellable progress notification, and only write the result to the sequence when it's done. Reverting through the modifier framework is not supported in this mode."))
+    bool bApplyInBackground = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "bApplyInBackground", ClampMin = "64", ToolTip = "Memory in MB that concurrent background applies may use together. Sequences are queued until their estimated working set fits, so applying to many long takes at once doesn't exhaust RAM."))
+    int32 BackgroundMemoryBudgetMB = 4096;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "bApplyInBackground", ToolTip = "When a batch of background applies is done, write the time every sequence spent in every stage, on every worker, as a Chrome trace to the trajectory export directory. The timings are always logged."))
+    bool bWriteStageTrace = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Foot Contact", meta = (ToolTip = "Bake foot_l/foot_r _contact (0 or 1) and _lock (0 to 1, ramped at either end of a contact) curves, so foot IK doesn't have to detect contacts from the speed curves at runtime. Contacts depend on the whole clip, so reapplies then always process every frame."))
+    bool bBakeFootContact = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Foot Contact", meta = (EditCondition = "bBakeFootContact", ToolTip = "A foot slower than this, in units/sec, and lower than the enter height, starts a contact. Speed is the slower of the foot and ball bones."))
+    float FootContactEnterSpeed = 15;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Foot Contact", meta = (EditCondition = "bBakeFootContact", ToolTip = "A contact ends when the foot gets faster than this, in units/sec."))
+    float FootContactExitSpeed = 30;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Foot Contact", meta = (EditCondition = "bBakeFootContact", ToolTip = "A foot lower than this, in units above the local ground, and slower than the enter speed, starts a contact. The ground is the lowest the foot gets relative to the root within half a second."))
+    float FootContactEnterHeight = 5;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Foot Contact", meta = (EditCondition = "bBakeFootContact", ToolTip = "A contact ends when the foot gets higher than this, in units above the local ground."))
+    float FootContactExitHeight = 10;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Foot Contact", meta = (EditCondition = "bBakeFootContact", ToolTip = "Contacts shorter than this, in seconds, are dropped."))
+    float FootContactMinSeconds = 0.1;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Foot Contact", meta = (EditCondition = "bBakeFootContact", ToolTip = "Time in seconds over which the lock curve ramps up at the start of a contact, and down at its end."))
+    float FootLockBlendSeconds = 0.15;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Trajectory Export", meta = (ToolTip = "Write a precomputed Pose Search trajectory feature block for the sequence, so database builds don't have to resample the root."))
+    bool bExportTrajectoryFeatures = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Trajectory Export", meta = (EditCondition = "bExportTrajectoryFeatures", ToolTip = "Time offsets in seconds relative to current time where root position and facing are sampled. Negative values are past samples."))
+    TArray<float> TrajectoryFeatureOffsets;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Trajectory Export", meta = (ToolTip = "Write the final root positions and facings to a compact sidecar file, which gameplay code can memory map with FMMRootTrajectory for cheap trajectory lookups."))
+    bool bExportRootTrajectory = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Trajectory Export", meta = (ToolTip = "Write the sampled bones of the whole sequence to a .mmpose file, which the standalone mmprep tool processes into the same keys and curves outside the editor."))
+    bool bExportCorePoses = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Trajectory Export", meta = (ToolTip = "Directory for the feature blocks, root trajectories and pose files. Empty writes to Saved/MotionMatchingPrep."))
+    FDirectoryPath TrajectoryExportDirectory;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Run the velocity analysis and the wide smoothing windows on a decimated copy of the bone tracks and upsample the result. Much faster on high frame rate clips. Narrow smoothing windows still use every frame."))
+    bool bMultiResolutionAnalysis = false;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (EditCondition = "bMultiResolutionAnalysis", ClampMin = "1", ToolTip = "Frame rate of the decimated level used by multi-resolution analysis."))
+    float AnalysisFrameRate = 30;
+
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "Treat the sequence as a loop whose last frame is the first frame of the next cycle. Windows wrap around the ends instead of being clamped, with the motion of one cycle added, so walk and run cycles don't need to be duplicated before processing."))
+    bool bCyclic = false;
+
     // UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Settings", meta = (ToolTip = "The margin around current time to use for translation moving average. Window size is 2 * margin."))
     // int32 TranslationSmoothingMin = 10;
     //
@@ -108,20 +443,44 @@ protected:
     // int32 RotationSmoothing = 40;
 
 private:
-    FTransform SmoothWorldTransformSingleBone(const TArray<TMap<FName, FTransform>>& WorldTransforms, FName Bone, const int32 FrameIndex, const int32 Margin);
+    bool PrepareBoneNames(UAnimSequence* AnimationSequence);
+    FMMApplySettings CaptureApplySettings(const int32 NumFrames, const float FrameRate) const;
+    void ApplyInBackground(UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const int32 NumFrames, const float FrameRate, const FInt32Range& FrameRange);
+    static bool AnalyzeSequence(UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const int32 NumFrames, const float FrameRate, const FInt32Range& FrameRange, FMMApplyResult& OutResult, FMMApplyProgress* Progress);
+    MMCore::FSettings GetCoreSettings() const;
+    static int64 EstimatePeakWorkingSet(const FMMApplySettings& Settings, const FInt32Range& FrameRange, const int32 NumFrames, const float FrameRate);
+    void CommitResult(UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const FMMApplyResult& Result);
+    bool GetDirtyFrameRange(const UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const int32 NumFrames, const float FrameRate, FInt32Range& OutFrameRange) const;
+    static TArray<uint32> HashSourceBlocks(const UAnimSequence* AnimationSequence, const FMMApplySettings& Settings, const int32 NumFrames);
+    uint32 HashApplySettings(const int32 NumFrames, const float FrameRate) const;
+    static bool HasSpeedCurves(const UAnimSequence* AnimationSequence, const FMMRuntimeSkeletonProfile& BoneProfile, const int32 NumFrames);
+    int32 GetDecimationFactor(const float FrameRate) const;
     // FTransform SmoothCenterOfGravity(const TArray<TMap<FName, FTransform>>& WorldTransforms, const int32 FrameIndex, const int32 Margin);
-    FQuat AverageQuaternions(const TArray<FQuat>& Quaternions);
-    TMap<FName, FTransform> GetBoneWorldTransformsSingleFrame(UAnimSequence* AnimSequence, int32 FrameIndex, const TArray<FName>& RequestedBones);
-    TArray<TMap<FName, FTransform>> GetBoneWorldTransformsOverTime(UAnimSequence* AnimSequence, int32 NumFrames);
-    TArray<float> GetSmoothVelocitiesForBone(const TArray<TMap<FName, FTransform>>& WorldTransforms, FName Bone, const int32 Margin, int32 FrameRate);
-    TArray<float> GetSmoothedFloats(const TArray<float>& Values, const int32 Margin);
-    float LowestFloatValueInRange(const TArray<float>& Values, const int32 FrameIndex, const int32 Margin);
-    float HighestFloatValueInRange(const TArray<float>& Values, const int32 FrameIndex, const int32 Margin);
-    int32 WindowSizeFromDivergence(const TArray<float>& Values, const int32 FrameIndex, const float PercentDivergence);
-    FVector ComposeGroundMotion(const FVector& PelvisPos, const FVector& FootPlanePos, const FQuat& FootPlaneRot);
-    int32 TranslationSmoothingMinMargin = 1; // Half the smoothing window size, adjusted to frame rate.
-    int32 TranslationSmoothingMaxMargin = 1; // Half the smoothing window size, adjusted to frame rate.
+    static bool GetBoneWorldTransformsOverTime(UAnimSequence* AnimSequence, const TSharedPtr<const FMMSkeletonBinding>& Binding, int32 StartFrame, int32 NumFrames, std::vector<MMCore::FPose>& OutPoses, FMMApplyProgress* Progress = nullptr);
+    static bool GetContextWorldTransforms(UAnimSequence* AnimSequence, const FMMApplySettings& Settings, const FInt32Range& ContextRange, const int32 NumFrames, std::vector<MMCore::FPose>& OutPoses, FMMApplyProgress* Progress);
+    FVector GetFacingAxis(const FQuat& Rotation) const;
+    FTransform SampleTransformTrack(const TArray<FTransform>& Track, const float FrameTime, const bool bCyclicTrack) const;
+    void ExportTrajectoryFeatures(const UAnimSequence* AnimSequence, const TArray<FTransform>& RootTrack, const TArray<float>& LeftBallSpeeds, const TArray<float>& RightBallSpeeds, const float FrameRate, const bool bCyclicTrack);
+    void ExportRootTrajectory(const UAnimSequence* AnimSequence, const TArray<FTransform>& RootTrack, const float FrameRate);
+    void ExportCorePoses(UAnimSequence* AnimSequence, const int32 NumFrames, const float FrameRate);
+    FString GetExportDirectory() const;
 
     TMap<int32, TPair<FTransform, FTransform>> OriginalTransforms;
-    TArray<FName> BoneNames;
+    FMMRuntimeSkeletonProfile Profile;
+    TSharedPtr<const FMMSkeletonBinding> SkeletonBinding;
+
+    // Set while a background apply is running.
+    TSharedPtr<FMMApplyProgress> ActiveProgress;
+
+    // Incremental reapply. Source keys are hashed per block of frames right after every apply, and
+    // saved with the modifier along with a hash of the settings. Bump AnalysisVersion whenever the
+    // analysis changes, so hashes saved by older versions force a full apply.
+    static constexpr int32 IncrementalBlockFrames = 32;
+    static constexpr uint32 AnalysisVersion = 4;
+
+    UPROPERTY()
+    TArray<uint32> AppliedBlockHashes;
+
+    UPROPERTY()
+    uint32 AppliedSettingsHash = 0;
 };
@@ -0,0 +1,111 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#include "MotionMatchingRootTrajectory.h"
+#include "Async/MappedFileHandle.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/FileHelper.h"
+
+FMMRootTrajectory::FMMRootTrajectory() = default;
+
+FMMRootTrajectory::~FMMRootTrajectory()
+{
+    Close();
+}
+
+bool FMMRootTrajectory::Write(const FString& FilePath, const TArray<FMMRootTrajectoryFrame>& Frames, const float FrameRate)
+{
+    FMMRootTrajectoryHeader Header;
+    Header.NumFrames = Frames.Num();
+    Header.FrameRate = FrameRate;
+
+    TArray<uint8> Bytes;
+    Bytes.Reserve(sizeof(Header) + Frames.Num() * sizeof(FMMRootTrajectoryFrame));
+    Bytes.Append(reinterpret_cast<const uint8*>(&Header), sizeof(Header));
+    Bytes.Append(reinterpret_cast<const uint8*>(Frames.GetData()), Frames.Num() * sizeof(FMMRootTrajectoryFrame));
+
+    return FFileHelper::SaveArrayToFile(Bytes, *FilePath);
+}
+
+bool FMMRootTrajectory::Open(const FString& FilePath)
+{
+    Close();
+
+    MappedFile.Reset(FPlatformFileManager::Get().GetPlatformFile().OpenMapped(*FilePath));
+    if (!MappedFile.IsValid() || MappedFile->GetFileSize() < static_cast<int64>(sizeof(FMMRootTrajectoryHeader))) {
+        Close();
+        return false;
+    }
+
+    MappedRegion.Reset(MappedFile->MapRegion(0, MappedFile->GetFileSize()));
+    if (!MappedRegion.IsValid()) {
+        Close();
+        return false;
+    }
+
+    const uint8* Data = MappedRegion->GetMappedPtr();
+    const FMMRootTrajectoryHeader* Header = reinterpret_cast<const FMMRootTrajectoryHeader*>(Data);
+
+    const int64 ExpectedSize = sizeof(FMMRootTrajectoryHeader) + static_cast<int64>(Header->NumFrames) * sizeof(FMMRootTrajectoryFrame);
+    if (Header->Magic != FMMRootTrajectoryHeader::ExpectedMagic || Header->Version != FMMRootTrajectoryHeader::CurrentVersion
+        || Header->NumFrames <= 0 || Header->FrameRate <= 0.0f || MappedRegion->GetMappedSize() != ExpectedSize) {
+        Close();
+        return false;
+    }
+
+    Frames = reinterpret_cast<const FMMRootTrajectoryFrame*>(Data + sizeof(FMMRootTrajectoryHeader));
+    NumFrames = Header->NumFrames;
+    FrameRate = Header->FrameRate;
+
+    return true;
+}
+
+void FMMRootTrajectory::Close()
+{
+    // The region has to go before the file it maps.
+    MappedRegion.Reset();
+    MappedFile.Reset();
+
+    Frames = nullptr;
+    NumFrames = 0;
+    FrameRate = 0.0f;
+}
+
+FMMRootTrajectorySample FMMRootTrajectory::Sample(const float Time) const
+{
+    FMMRootTrajectorySample Result;
+    if (!Frames) {
+        return Result;
+    }
+
+    const int32 LastFrame = NumFrames - 1;
+    const float FrameTime = FMath::Clamp(Time * FrameRate, 0.0f, static_cast<float>(LastFrame));
+    const int32 Frame0 = FMath::FloorToInt32(FrameTime);
+    const int32 Frame1 = FMath::Min(Frame0 + 1, LastFrame);
+    const float Alpha = FrameTime - Frame0;
+
+    const FMMRootTrajectoryFrame& A = Frames[Frame0];
+    const FMMRootTrajectoryFrame& B = Frames[Frame1];
+
+    Result.Position = FVector3f(FMath::Lerp(A.X, B.X, Alpha), FMath::Lerp(A.Y, B.Y, Alpha), FMath::Lerp(A.Z, B.Z, Alpha));
+    Result.Yaw = FMath::Lerp(A.Yaw, B.Yaw, Alpha);
+
+    return Result;
+}
+
+FMMRootTrajectorySample FMMRootTrajectory::SampleRelative(const float Time, const float DeltaTime) const
+{
+    const FMMRootTrajectorySample Current = Sample(Time);
+    const FMMRootTrajectorySample Other = Sample(Time + DeltaTime);
+
+    // The root is pure yaw, so going into its space is a rotation about Z.
+    float Sin, Cos;
+    FMath::SinCos(&Sin, &Cos, -Current.Yaw);
+
+    const FVector3f Delta = Other.Position - Current.Position;
+
+    FMMRootTrajectorySample Result;
+    Result.Position = FVector3f(Delta.X * Cos - Delta.Y * Sin, Delta.X * Sin + Delta.Y * Cos, Delta.Z);
+    Result.Yaw = Other.Yaw - Current.Yaw;
+
+    return Result;
+}
@@ -0,0 +1,93 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class IMappedFileHandle;
+class IMappedFileRegion;
+
+// Layout of the root trajectory sidecar that can be written for every processed sequence. It's the
+// final smoothed root, one fixed-size frame per sample, behind a 16 byte header. Frames are 16 byte
+// aligned in the file, and a memory mapping is page aligned, so the frames can be used in place.
+struct FMMRootTrajectoryHeader
+{
+    static constexpr uint32 ExpectedMagic = 0x54524D4D; // "MMRT"
+    static constexpr uint32 CurrentVersion = 1;
+
+    uint32 Magic = ExpectedMagic;
+    uint32 Version = CurrentVersion;
+    int32 NumFrames = 0;
+    float FrameRate = 0.0f;
+};
+
+// Root position in world space, and the yaw of the facing axis in radians. Yaw is unwrapped over
+// the sequence, so it can be interpolated linearly.
+struct alignas(16) FMMRootTrajectoryFrame
+{
+    float X = 0.0f;
+    float Y = 0.0f;
+    float Z = 0.0f;
+    float Yaw = 0.0f;
+};
+
+static_assert(sizeof(FMMRootTrajectoryHeader) == 16, "Frames must start 16 byte aligned");
+static_assert(sizeof(FMMRootTrajectoryFrame) == 16, "Frames must be tightly packed");
+
+struct FMMRootTrajectorySample
+{
+    FVector3f Position = FVector3f::ZeroVector;
+    float Yaw = 0.0f;
+
+    FVector3f GetFacing() const
+    {
+        float Sin, Cos;
+        FMath::SinCos(&Sin, &Cos, Yaw);
+        return FVector3f(Cos, Sin, 0.0f);
+    }
+};
+
+// Read-only view of a root trajectory sidecar, for gameplay code that needs future root positions
+// of candidate clips, e.g. to validate transitions, without evaluating animation tracks. The file
+// is memory mapped and validated once when opened. After that, lookups read the mapped frames
+// directly, without decoding or allocating, so they're cheap enough to run per candidate per tick.
+// Lookups are const and safe to call from any thread while the trajectory stays open.
+class GAMEANIMATIONSAMPLE2_API FMMRootTrajectory
+{
+public:
+    FMMRootTrajectory();
+    ~FMMRootTrajectory();
+
+    FMMRootTrajectory(const FMMRootTrajectory&) = delete;
+    FMMRootTrajectory& operator=(const FMMRootTrajectory&) = delete;
+
+    static bool Write(const FString& FilePath, const TArray<FMMRootTrajectoryFrame>& Frames, const float FrameRate);
+
+    // Returns false if the file is missing, truncated, or was written with a different layout
+    // version.
+    bool Open(const FString& FilePath);
+    void Close();
+
+    bool IsOpen() const { return Frames != nullptr; }
+
+    int32 GetNumFrames() const { return NumFrames; }
+    float GetFrameRate() const { return FrameRate; }
+    float GetPlayLength() const { return NumFrames > 1 ? (NumFrames - 1) / FrameRate : 0.0f; }
+
+    TConstArrayView<FMMRootTrajectoryFrame> GetFrames() const { return TConstArrayView<FMMRootTrajectoryFrame>(Frames, NumFrames); }
+
+    // Root at a time in seconds, linearly interpolated and clamped to the sequence.
+    FMMRootTrajectorySample Sample(const float Time) const;
+
+    // Root at Time + DeltaTime relative to the root at Time, with X along its facing and Y to the
+    // right of it, as usual in Unreal.
+    FMMRootTrajectorySample SampleRelative(const float Time, const float DeltaTime) const;
+
+private:
+    TUniquePtr<IMappedFileHandle> MappedFile;
+    TUniquePtr<IMappedFileRegion> MappedRegion;
+
+    const FMMRootTrajectoryFrame* Frames = nullptr;
+    int32 NumFrames = 0;
+    float FrameRate = 0.0f;
+};
@@ -0,0 +1,169 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#include "MotionMatchingSkeletonBinding.h"
+#include "Animation/Skeleton.h"
+#include "Misc/ScopeLock.h"
+
+namespace
+{
+    // The names are kept in the key, and compared in full, so two bone lists whose hashes collide
+    // never share a binding. The hash only picks the bucket.
+    struct FBindingKey
+    {
+        TWeakObjectPtr<const USkeleton> Skeleton;
+        TArray<FName> TrackedBones;
+        TArray<FName> IkBones;
+        uint32 NamesHash = 0;
+
+        bool operator==(const FBindingKey& Other) const
+        {
+            return Skeleton == Other.Skeleton && NamesHash == Other.NamesHash && TrackedBones == Other.TrackedBones && IkBones == Other.IkBones;
+        }
+
+        friend uint32 GetTypeHash(const FBindingKey& Key)
+        {
+            return HashCombine(GetTypeHash(Key.Skeleton), Key.NamesHash);
+        }
+    };
+
+    FCriticalSection BindingCacheLock;
+    TMap<FBindingKey, TSharedPtr<const FMMSkeletonBinding>> BindingCache;
+}
+
+TSharedPtr<const FMMSkeletonBinding> FMMSkeletonBinding::Get(const USkeleton* Skeleton, const TArray<FName>& TrackedBones, const TArray<FName>& IkBones)
+{
+    if (!Skeleton) {
+        return nullptr;
+    }
+
+    const FBindingKey Key = { Skeleton, TrackedBones, IkBones, HashBoneNames(TrackedBones, IkBones) };
+    const uint32 HierarchyHash = HashHierarchy(Skeleton);
+
+    FScopeLock Lock(&BindingCacheLock);
+
+    // Drop bindings of skeletons that have been garbage collected.
+    for (auto It = BindingCache.CreateIterator(); It; ++It) {
+        if (!It.Key().Skeleton.IsValid()) {
+            It.RemoveCurrent();
+        }
+    }
+
+    if (const TSharedPtr<const FMMSkeletonBinding>* Cached = BindingCache.Find(Key)) {
+        if ((*Cached)->HierarchyHash == HierarchyHash) {
+            return *Cached;
+        }
+    }
+
+    const TSharedRef<FMMSkeletonBinding> Binding = MakeShared<FMMSkeletonBinding>();
+    if (!Binding->Resolve(Skeleton, TrackedBones, IkBones)) {
+        BindingCache.Remove(Key);
+        return nullptr;
+    }
+
+    Binding->HierarchyHash = HierarchyHash;
+    BindingCache.Add(Key, Binding);
+
+    return Binding;
+}
+
+void FMMSkeletonBinding::Invalidate(const USkeleton* Skeleton)
+{
+    FScopeLock Lock(&BindingCacheLock);
+
+    for (auto It = BindingCache.CreateIterator(); It; ++It) {
+        if (It.Key().Skeleton == Skeleton || !It.Key().Skeleton.IsValid()) {
+            It.RemoveCurrent();
+        }
+    }
+}
+
+void FMMSkeletonBinding::InvalidateAll()
+{
+    FScopeLock Lock(&BindingCacheLock);
+    BindingCache.Empty();
+}
+
+int32 FMMSkeletonBinding::FindBoneIndex(const FName BoneName) const
+{
+    const int32* Index = BoneIndices.Find(BoneName);
+    return Index ? *Index : INDEX_NONE;
+}
+
+uint32 FMMSkeletonBinding::HashBoneNames(const TArray<FName>& TrackedBones, const TArray<FName>& IkBones)
+{
+    uint32 Hash = 0;
+
+    for (const FName& BoneName : TrackedBones) {
+        Hash = HashCombine(Hash, GetTypeHash(BoneName));
+    }
+
+    // Keep tracked and IK names apart, so moving a name from one list to the other changes the hash.
+    Hash = HashCombine(Hash, GetTypeHash(TrackedBones.Num()));
+
+    for (const FName& BoneName : IkBones) {
+        Hash = HashCombine(Hash, GetTypeHash(BoneName));
+    }
+
+    return Hash;
+}
+
+uint32 FMMSkeletonBinding::HashHierarchy(const USkeleton* Skeleton)
+{
+    // Names and parents of all bones. Cheap compared to resolving, and catches bones being added,
+    // removed, renamed or reparented without relying on the skeleton to bump a guid.
+
+    const FReferenceSkeleton& RefSkeleton = Skeleton->GetReferenceSkeleton();
+
+    uint32 Hash = GetTypeHash(RefSkeleton.GetNum());
+    for (int32 BoneIndex = 0; BoneIndex < RefSkeleton.GetNum(); ++BoneIndex) {
+        Hash = HashCombine(Hash, GetTypeHash(RefSkeleton.GetBoneName(BoneIndex)));
+        Hash = HashCombine(Hash, GetTypeHash(RefSkeleton.GetParentIndex(BoneIndex)));
+    }
+
+    return Hash;
+}
+
+bool FMMSkeletonBinding::Resolve(const USkeleton* Skeleton, const TArray<FName>& TrackedBones, const TArray<FName>& IkBones)
+{
+    const FReferenceSkeleton& RefSkeleton = Skeleton->GetReferenceSkeleton();
+
+    for (const TArray<FName>* Bones : { &TrackedBones, &IkBones }) {
+        for (const FName& BoneName : *Bones) {
+            const int32 BoneIndex = RefSkeleton.FindBoneIndex(BoneName);
+            if (BoneIndex == INDEX_NONE) {
+                UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Bone '%s' not found in skeleton '%s'"), *BoneName.ToString(), *Skeleton->GetName());
+                return false;
+            }
+
+            BoneIndices.Add(BoneName, BoneIndex);
+        }
+    }
+
+    // Mark the tracked bones and all their ancestors. The reference skeleton stores parents before
+    // children, so walking the marks in index order is parent-first.
+    TBitArray<> Required(false, RefSkeleton.GetNum());
+    for (const FName& BoneName : TrackedBones) {
+        for (int32 BoneIndex = BoneIndices[BoneName]; BoneIndex != INDEX_NONE && !Required[BoneIndex]; BoneIndex = RefSkeleton.GetParentIndex(BoneIndex)) {
+            Required[BoneIndex] = true;
+        }
+    }
+
+    TArray<int32> SlotByBoneIndex;
+    SlotByBoneIndex.Init(INDEX_NONE, RefSkeleton.GetNum());
+
+    for (TConstSetBitIterator<> It(Required); It; ++It) {
+        const int32 BoneIndex = It.GetIndex();
+        const int32 ParentIndex = RefSkeleton.GetParentIndex(BoneIndex);
+
+        SlotByBoneIndex[BoneIndex] = RequiredBoneIndices.Add(BoneIndex);
+        RequiredBoneNames.Add(RefSkeleton.GetBoneName(BoneIndex));
+        RequiredParentSlots.Add(ParentIndex != INDEX_NONE ? SlotByBoneIndex[ParentIndex] : INDEX_NONE);
+    }
+
+    TrackedBoneNames = TrackedBones;
+    for (const FName& BoneName : TrackedBones) {
+        TrackedBoneSlots.Add(SlotByBoneIndex[BoneIndices[BoneName]]);
+    }
+
+    return true;
+}
@@ -0,0 +1,58 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class USkeleton;
+
+// The modifier's bone names resolved against one skeleton. Resolving names and walking ancestor
+// chains is the same work for every sequence on a skeleton, so bindings are cached and shared by
+// every apply on that skeleton, which matters when batch processing hundreds of clips on the same
+// Manny/Quinn rig.
+//
+// A binding holds the reference skeleton indices of the tracked bones and the IK bones, and the
+// "required" bones: the tracked bones plus all their ancestors, in parent-first order, with the
+// position of each bone's parent in that list. Evaluating the required bones in order yields the
+// component space transforms of the tracked bones without any lookups.
+//
+// Cached bindings are keyed by skeleton and by the bone names, so changing the bone-name settings
+// simply resolves a new binding. A binding is rebuilt when the skeleton's bone hierarchy
+// changes, and dropped when the skeleton is garbage collected.
+class FMMSkeletonBinding
+{
+public:
+    // Returns the shared binding for the skeleton and bone names. Logs and returns null if any of
+    // the bones doesn't exist in the skeleton. Thread safe.
+    static TSharedPtr<const FMMSkeletonBinding> Get(const USkeleton* Skeleton, const TArray<FName>& TrackedBones, const TArray<FName>& IkBones);
+
+    static void Invalidate(const USkeleton* Skeleton);
+    static void InvalidateAll();
+
+    const TArray<FName>& GetTrackedBoneNames() const { return TrackedBoneNames; }
+    const TArray<int32>& GetTrackedBoneSlots() const { return TrackedBoneSlots; }
+
+    const TArray<int32>& GetRequiredBoneIndices() const { return RequiredBoneIndices; }
+    const TArray<FName>& GetRequiredBoneNames() const { return RequiredBoneNames; }
+    const TArray<int32>& GetRequiredParentSlots() const { return RequiredParentSlots; }
+
+    // Reference skeleton index of a tracked or IK bone, or INDEX_NONE.
+    int32 FindBoneIndex(const FName BoneName) const;
+
+private:
+    static uint32 HashBoneNames(const TArray<FName>& TrackedBones, const TArray<FName>& IkBones);
+    static uint32 HashHierarchy(const USkeleton* Skeleton);
+
+    bool Resolve(const USkeleton* Skeleton, const TArray<FName>& TrackedBones, const TArray<FName>& IkBones);
+
+    uint32 HierarchyHash = 0;
+
+    TArray<FName> TrackedBoneNames;
+    TArray<int32> TrackedBoneSlots; // Slot in the required bones for every tracked bone
+
+    TMap<FName, int32> BoneIndices; // Tracked and IK bones
+
+    TArray<int32> RequiredBoneIndices;
+    TArray<FName> RequiredBoneNames;
+    TArray<int32> RequiredParentSlots; // INDEX_NONE for the root
+};
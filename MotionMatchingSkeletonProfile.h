@@ -0,0 +1,104 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MotionMatchingCore.h"
+
+// What the modifier uses a bone for. The tracked roles come first: their world transforms are
+// sampled for every frame and stored in role order, so the analysis indexes them by role instead of
+// looking them up by name. The IK roles are only written to.
+enum class EMMBoneRole : uint8
+{
+    Root,
+    Pelvis,
+    LeftThigh,
+    RightThigh,
+    Spine01,
+    LeftFoot,
+    RightFoot,
+    LeftBall,
+    RightBall,
+    LeftHand,
+    RightHand,
+
+    IkFootL,
+    IkFootR,
+    IkHandGun,
+    IkHandL,
+
+    Num,
+};
+
+constexpr int32 MMNumBoneRoles = static_cast<int32>(EMMBoneRole::Num);
+constexpr int32 MMNumTrackedBoneRoles = static_cast<int32>(EMMBoneRole::IkFootL);
+
+// Bone names of a known rig, as a table from role to name that's fixed at compile time.
+struct FMMSkeletonProfile
+{
+    const TCHAR* BoneNames[MMNumBoneRoles];
+
+    constexpr const TCHAR* GetBoneName(const EMMBoneRole Role) const
+    {
+        return BoneNames[static_cast<int32>(Role)];
+    }
+
+    constexpr bool IsComplete() const
+    {
+        for (const TCHAR* BoneName : BoneNames) {
+            if (!BoneName || !BoneName[0]) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// The UE5 Manny/Quinn mannequins.
+inline constexpr FMMSkeletonProfile MMMannyQuinnProfile = { {
+    TEXT("root"),
+    TEXT("pelvis"),
+    TEXT("thigh_l"),
+    TEXT("thigh_r"),
+    TEXT("spine_01"),
+    TEXT("foot_l"),
+    TEXT("foot_r"),
+    TEXT("ball_l"),
+    TEXT("ball_r"),
+    TEXT("hand_l"),
+    TEXT("hand_r"),
+    TEXT("ik_foot_l"),
+    TEXT("ik_foot_r"),
+    TEXT("ik_hand_gun"),
+    TEXT("ik_hand_l"),
+} };
+
+static_assert(MMMannyQuinnProfile.IsComplete(), "Every bone role needs a bone");
+
+// The bone names the modifier actually works with, in the same role layout. Either converted from
+// a compile-time profile, or filled in from the bone name settings for custom rigs.
+struct FMMRuntimeSkeletonProfile
+{
+    FName BoneNames[MMNumBoneRoles];
+
+    FMMRuntimeSkeletonProfile() = default;
+
+    explicit FMMRuntimeSkeletonProfile(const FMMSkeletonProfile& Profile)
+    {
+        for (int32 Role = 0; Role < MMNumBoneRoles; ++Role) {
+            BoneNames[Role] = FName(Profile.BoneNames[Role]);
+        }
+    }
+
+    FName operator[](const EMMBoneRole Role) const { return BoneNames[static_cast<int32>(Role)]; }
+    FName& operator[](const EMMBoneRole Role) { return BoneNames[static_cast<int32>(Role)]; }
+
+    TArray<FName> GetTrackedBoneNames() const { return TArray<FName>(BoneNames, MMNumTrackedBoneRoles); }
+    TArray<FName> GetIkBoneNames() const { return TArray<FName>(BoneNames + MMNumTrackedBoneRoles, MMNumBoneRoles - MMNumTrackedBoneRoles); }
+};
+
+// The core analysis stores the world transforms of the tracked bones of every frame in an
+// MMCore::FPose, indexed by the same order as the tracked roles.
+static_assert(MMNumTrackedBoneRoles == MMCore::NumBones, "Every tracked role needs a core bone");
+static_assert(static_cast<int32>(EMMBoneRole::Spine01) == static_cast<int32>(MMCore::EBone::Spine01), "Tracked roles must be in core bone order");
+static_assert(static_cast<int32>(EMMBoneRole::RightHand) == static_cast<int32>(MMCore::EBone::RightHand), "Tracked roles must be in core bone order");
@@ -0,0 +1,267 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#include "MotionMatchingTelemetry.h"
+#include "MotionMatchingPrep.h"
+#include "Containers/Ticker.h"
+#include "EngineLogs.h"
+#include "HAL/PlatformTLS.h"
+#include "Misc/AsyncTaskNotification.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+namespace
+{
+    constexpr int32 NumStages = static_cast<int32>(FMMApplyProgress::EStage::Num);
+
+    const TCHAR* const StageNames[] = {
+        TEXT("Queued"),
+        TEXT("Sampling"),
+        TEXT("VelocityTable"),
+        TEXT("Smoothing"),
+        TEXT("Rebasing"),
+        TEXT("Curves"),
+    };
+
+    static_assert(UE_ARRAY_COUNT(StageNames) == NumStages, "Every stage needs a name");
+
+    const TCHAR* GetStageName(const int32 Stage)
+    {
+        return (Stage >= 0 && Stage < NumStages) ? StageNames[Stage] : TEXT("Unknown");
+    }
+
+    double CyclesToMicroseconds(const uint64 Cycles)
+    {
+        return Cycles * FPlatformTime::GetSecondsPerCycle64() * 1000000.0;
+    }
+
+    // The contents of a JSON string literal. Only quotes, backslashes and control characters have
+    // to be escaped, everything else is written as is, and the file is saved as UTF-8.
+    FString EscapeJsonString(const FString& Value)
+    {
+        FString Result;
+        Result.Reserve(Value.Len());
+
+        for (const TCHAR Char : Value) {
+            switch (Char) {
+            case TCHAR('"'):
+                Result += TEXT("\\\"");
+                break;
+            case TCHAR('\\'):
+                Result += TEXT("\\\\");
+                break;
+            case TCHAR('\n'):
+                Result += TEXT("\\n");
+                break;
+            case TCHAR('\r'):
+                Result += TEXT("\\r");
+                break;
+            case TCHAR('\t'):
+                Result += TEXT("\\t");
+                break;
+            default:
+                if (Char < 0x20) {
+                    Result += FString::Printf(TEXT("\\u%04x"), static_cast<uint32>(Char));
+                } else {
+                    Result.AppendChar(Char);
+                }
+                break;
+            }
+        }
+
+        return Result;
+    }
+
+    // Calls Visit(Enter, Exit) for every completed stage of a job, in order.
+    template <typename VisitorType>
+    void ForEachStageSpan(const TArray<FMMTelemetryEvent>& Events, VisitorType&& Visit)
+    {
+        const FMMTelemetryEvent* Enter = nullptr;
+        for (const FMMTelemetryEvent& Event : Events) {
+            if (Event.Type == FMMTelemetryEvent::EType::Enter) {
+                Enter = &Event;
+            } else if (Enter && Enter->Stage == Event.Stage) {
+                Visit(*Enter, Event);
+                Enter = nullptr;
+            }
+        }
+    }
+}
+
+void FMMTelemetryChannel::Emit(const FMMTelemetryEvent::EType Type, const uint8 Stage, const int32 NumFrames)
+{
+    FMMTelemetryEvent Event;
+    Event.Type = Type;
+    Event.Stage = Stage;
+    Event.NumFrames = NumFrames;
+    Event.ThreadId = FPlatformTLS::GetCurrentThreadId();
+    Event.Cycles = FPlatformTime::Cycles64();
+
+    // Never wait for the game thread. A dropped event only costs a span in the timings.
+    if (!Events.Push(Event)) {
+        NumDropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+FMMTelemetryCollector& FMMTelemetryCollector::Get()
+{
+    static FMMTelemetryCollector Collector;
+    return Collector;
+}
+
+void FMMTelemetryCollector::AddChannel(const TSharedRef<FMMTelemetryChannel>& Channel)
+{
+    check(IsInGameThread());
+
+    // The first channel of a batch starts the ticker and the batch notification. Both go away when
+    // every job of the batch is done.
+    if (Jobs.Num() == 0) {
+        FAsyncTaskNotificationConfig NotificationConfig;
+        NotificationConfig.TitleText = NSLOCTEXT("TransferPelvisToRoot", "BatchTitle", "Motion Matching Prep");
+        NotificationConfig.LogCategory = &LogAnimation;
+        Notification = MakeShared<FAsyncTaskNotification>(NotificationConfig);
+
+        FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateRaw(this, &FMMTelemetryCollector::Tick), 0.1f);
+    }
+
+    FJobTimeline& Job = Jobs.AddDefaulted_GetRef();
+    Job.Channel = Channel;
+}
+
+bool FMMTelemetryCollector::Tick(float DeltaTime)
+{
+    bool bAllDone = true;
+    for (FJobTimeline& Job : Jobs) {
+        Drain(Job);
+        bAllDone &= Job.bDone;
+    }
+
+    if (!bAllDone) {
+        Notification->SetProgressText(GetLiveView());
+        return true;
+    }
+
+    LogTimingTable();
+
+    // Any job of the batch asking for a trace gets one for the whole batch.
+    for (const FJobTimeline& Job : Jobs) {
+        if (!Job.Channel->TraceDirectory.IsEmpty()) {
+            WriteChromeTrace(Job.Channel->TraceDirectory);
+            break;
+        }
+    }
+
+    Notification->SetComplete(FText::Format(NSLOCTEXT("TransferPelvisToRoot", "BatchDone", "Processed {0} sequences"), Jobs.Num()), FText(), true);
+    Notification.Reset();
+    Jobs.Reset();
+
+    return false;
+}
+
+void FMMTelemetryCollector::Drain(FJobTimeline& Job)
+{
+    if (Job.bDone) {
+        return;
+    }
+
+    // Check for closing before draining. Everything emitted before closing is then visible to
+    // this drain, so the job can't be marked done with events still in the ring.
+    const bool bClosed = Job.Channel->IsClosed();
+
+    FMMTelemetryEvent Event;
+    while (Job.Channel->Poll(Event)) {
+        Job.Events.Add(Event);
+        Job.CurrentStage = (Event.Type == FMMTelemetryEvent::EType::Enter) ? Event.Stage : INDEX_NONE;
+    }
+
+    Job.bDone = bClosed;
+}
+
+FText FMMTelemetryCollector::GetLiveView() const
+{
+    int32 NumDone = 0;
+    TArray<FString> Running;
+
+    for (const FJobTimeline& Job : Jobs) {
+        if (Job.bDone) {
+            ++NumDone;
+        } else if (Job.CurrentStage != INDEX_NONE) {
+            Running.Add(FString::Printf(TEXT("%s: %s"), *Job.Channel->SequenceName, GetStageName(Job.CurrentStage)));
+        }
+    }
+
+    return FText::FromString(FString::Printf(TEXT("%d of %d done\n%s"), NumDone, Jobs.Num(), *FString::Join(Running, TEXT("\n"))));
+}
+
+void FMMTelemetryCollector::LogTimingTable() const
+{
+    // One row per sequence, with the time in every stage in milliseconds and the frames sampled.
+
+    FString Header = FString::Printf(TEXT("%-32s"), TEXT("Sequence"));
+    for (int32 Stage = 0; Stage < NumStages; ++Stage) {
+        Header += FString::Printf(TEXT(" %13s"), GetStageName(Stage));
+    }
+    Header += FString::Printf(TEXT(" %10s %8s"), TEXT("Total"), TEXT("Frames"));
+
+    UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Stage timings (ms)"));
+    UE_LOG(LogAnimation, Log, TEXT("%s"), *Header);
+
+    for (const FJobTimeline& Job : Jobs) {
+        double Milliseconds[NumStages] = {};
+        int32 NumSampledFrames = 0;
+
+        ForEachStageSpan(Job.Events, [&](const FMMTelemetryEvent& Enter, const FMMTelemetryEvent& Exit) {
+            Milliseconds[Enter.Stage] += CyclesToMicroseconds(Exit.Cycles - Enter.Cycles) / 1000.0;
+            if (Enter.Stage == static_cast<uint8>(FMMApplyProgress::EStage::Sampling)) {
+                NumSampledFrames += Exit.NumFrames;
+            }
+        });
+
+        FString Row = FString::Printf(TEXT("%-32s"), *Job.Channel->SequenceName);
+        double Total = 0.0;
+        for (int32 Stage = 0; Stage < NumStages; ++Stage) {
+            Row += FString::Printf(TEXT(" %13.1f"), Milliseconds[Stage]);
+            Total += Milliseconds[Stage];
+        }
+        Row += FString::Printf(TEXT(" %10.1f %8d"), Total, NumSampledFrames);
+
+        UE_LOG(LogAnimation, Log, TEXT("%s"), *Row);
+
+        if (Job.Channel->GetNumDropped() > 0) {
+            UE_LOG(LogAnimation, Warning, TEXT("MotionMatchingPrep: %d telemetry events of '%s' were dropped"), Job.Channel->GetNumDropped(), *Job.Channel->SequenceName);
+        }
+    }
+}
+
+void FMMTelemetryCollector::WriteChromeTrace(const FString& Directory) const
+{
+    // Chrome trace event format. Every stage is a complete event on the thread that entered it,
+    // so the trace shows how the jobs were spread over the workers.
+
+    uint64 FirstCycles = MAX_uint64;
+    for (const FJobTimeline& Job : Jobs) {
+        for (const FMMTelemetryEvent& Event : Job.Events) {
+            FirstCycles = FMath::Min(FirstCycles, Event.Cycles);
+        }
+    }
+
+    TArray<FString> TraceEvents;
+    for (const FJobTimeline& Job : Jobs) {
+        const FString SequenceName = EscapeJsonString(Job.Channel->SequenceName);
+
+        ForEachStageSpan(Job.Events, [&](const FMMTelemetryEvent& Enter, const FMMTelemetryEvent& Exit) {
+            TraceEvents.Add(FString::Printf(
+                TEXT("{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%u,\"args\":{\"sequence\":\"%s\",\"frames\":%d}}"),
+                GetStageName(Enter.Stage), *SequenceName, CyclesToMicroseconds(Enter.Cycles - FirstCycles), CyclesToMicroseconds(Exit.Cycles - Enter.Cycles),
+                Enter.ThreadId, *SequenceName, Exit.NumFrames));
+        });
+    }
+
+    const FString Json = FString::Printf(TEXT("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n%s\n]}\n"), *FString::Join(TraceEvents, TEXT(",\n")));
+    const FString FilePath = FPaths::Combine(Directory, FString::Printf(TEXT("Trace_%s.json"), *FDateTime::Now().ToString()));
+
+    if (FFileHelper::SaveStringToFile(Json, *FilePath, FFileHelper::EEncodingOptions::ForceUTF8WithoutBOM)) {
+        UE_LOG(LogAnimation, Log, TEXT("MotionMatchingPrep: Wrote stage trace to '%s'"), *FilePath);
+    } else {
+        UE_LOG(LogAnimation, Error, TEXT("MotionMatchingPrep: Failed to write stage trace to '%s'"), *FilePath);
+    }
+}
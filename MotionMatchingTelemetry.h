@@ -0,0 +1,127 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include <atomic>
+
+class FAsyncTaskNotification;
+
+// Bounded single-producer, single-consumer queue. The producer only writes the write index and the
+// consumer only writes the read index, so neither ever waits on the other. A full queue rejects the
+// element instead of blocking the producer.
+template <typename ElementType, uint32 Capacity>
+class TMMSpscRing
+{
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    // Producer only.
+    bool Push(const ElementType& Element)
+    {
+        const uint32 Write = WriteIndex.load(std::memory_order_relaxed);
+        if (Write - ReadIndex.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+
+        Elements[Write & (Capacity - 1)] = Element;
+        WriteIndex.store(Write + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only.
+    bool Pop(ElementType& OutElement)
+    {
+        const uint32 Read = ReadIndex.load(std::memory_order_relaxed);
+        if (Read == WriteIndex.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        OutElement = Elements[Read & (Capacity - 1)];
+        ReadIndex.store(Read + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    ElementType Elements[Capacity];
+
+    // On separate cache lines, so the two sides don't keep stealing the line from each other.
+    alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint32> WriteIndex = 0;
+    alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint32> ReadIndex = 0;
+};
+
+struct FMMTelemetryEvent
+{
+    enum class EType : uint8
+    {
+        Enter,
+        Exit,
+    };
+
+    EType Type = EType::Enter;
+    uint8 Stage = 0;     // FMMApplyProgress::EStage
+    int32 NumFrames = 0; // Frames to process on enter, frames processed on exit
+    uint32 ThreadId = 0;
+    uint64 Cycles = 0;
+};
+
+// Stage events of one background apply. Only the thread currently running the apply emits, so
+// there's a single producer, and only the game thread collects. Emitting is a couple of stores,
+// without locks, allocations or logging.
+class GAMEANIMATIONSAMPLE2_API FMMTelemetryChannel
+{
+public:
+    FMMTelemetryChannel(const FString& InSequenceName, const FString& InTraceDirectory)
+        : SequenceName(InSequenceName)
+        , TraceDirectory(InTraceDirectory)
+    {
+    }
+
+    // Producer side.
+    void Emit(const FMMTelemetryEvent::EType Type, const uint8 Stage, const int32 NumFrames);
+    void Close() { bClosed.store(true, std::memory_order_release); }
+
+    // Consumer side. Closed means that every event has been emitted, not that they've been polled.
+    bool Poll(FMMTelemetryEvent& OutEvent) { return Events.Pop(OutEvent); }
+    bool IsClosed() const { return bClosed.load(std::memory_order_acquire); }
+    int32 GetNumDropped() const { return NumDropped.load(std::memory_order_relaxed); }
+
+    const FString SequenceName;
+    const FString TraceDirectory; // Empty if no trace was requested
+
+private:
+    // A full apply emits about a dozen events, and the game thread polls several times a second.
+    TMMSpscRing<FMMTelemetryEvent, 64> Events;
+    std::atomic<int32> NumDropped = 0;
+    std::atomic<bool> bClosed = false;
+};
+
+// Game thread side of the telemetry. Drains the channels of all background applies, shows the stage
+// every apply is in on one batch notification, and when the batch is done, logs a timing table per
+// sequence and optionally writes a Chrome trace (chrome://tracing, Perfetto) of all stages on all
+// workers.
+class GAMEANIMATIONSAMPLE2_API FMMTelemetryCollector
+{
+public:
+    static FMMTelemetryCollector& Get();
+
+    void AddChannel(const TSharedRef<FMMTelemetryChannel>& Channel);
+
+private:
+    struct FJobTimeline
+    {
+        TSharedPtr<FMMTelemetryChannel> Channel;
+        TArray<FMMTelemetryEvent> Events;
+        int32 CurrentStage = INDEX_NONE;
+        bool bDone = false;
+    };
+
+    bool Tick(float DeltaTime);
+    void Drain(FJobTimeline& Job);
+    FText GetLiveView() const;
+    void LogTimingTable() const;
+    void WriteChromeTrace(const FString& Directory) const;
+
+    TArray<FJobTimeline> Jobs;
+    TSharedPtr<FAsyncTaskNotification> Notification;
+};
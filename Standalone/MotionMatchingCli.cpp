@@ -0,0 +1,307 @@
+﻿// Created by Hollywood Camera Work - Public Domain
+
+// Command line front end of the core analysis, for processing exported pose files on machines
+// without the editor. Only built by the CMake project next to this file, which defines
+// MM_CORE_STANDALONE. The editor module compiles every source file under it, and skips this one.
+#if defined(MM_CORE_STANDALONE)
+
+#include "MotionMatchingCore.h"
+#include "MotionMatchingCoreFormat.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace
+{
+    struct FOptions
+    {
+        MMCore::FSettings Settings;
+        std::string OutputDirectory;
+        int32_t NumJobs = 0;
+        int32_t NumBenchRuns = 0;
+        std::vector<std::string> Inputs;
+    };
+
+    struct FClipResult
+    {
+        bool bSucceeded = false;
+        int32_t NumFrames = 0;
+        double Milliseconds = 0.0;
+        std::string Error;
+    };
+
+    void PrintUsage()
+    {
+        std::fprintf(stderr,
+            "Usage: mmprep [options] <clip.mmpose>...\n"
+            "\n"
+            "Runs the motion matching root analysis on exported pose files, and writes a .mmtrack\n"
+            "with the root, pelvis and IK keys and the foot speed curves of each.\n"
+            "\n"
+            "  --velocity-min <units/s>     Translation velocity min (default 5)\n"
+            "  --velocity-max <units/s>     Translation velocity max (default 25)\n"
+            "  --smoothing-min <seconds>    Translation smoothing min (default 0.083)\n"
+            "  --smoothing-max <seconds>    Translation smoothing max (default 0.41)\n"
+            "  --facing x|y|z               Facing axis (default y)\n"
+            "  --foot-smoothing             Smooth the feet with margins from their own speed\n"
+            "  --analysis-rate <fps>        Multi-resolution analysis at this frame rate\n"
+            "  --cyclic                     Treat clips as loops\n"
+            "  --foot-contact               Also write foot contact and lock curves\n"
+            "  --out <directory>            Where to write tracks (default: next to each input)\n"
+            "  --jobs <n>                   Clips processed in parallel (default: all cores)\n"
+            "  --bench <n>                  Analyze every clip n times, write nothing, report timings\n");
+    }
+
+    bool ParseOptions(const int Argc, char** Argv, FOptions& OutOptions)
+    {
+        for (int Index = 1; Index < Argc; ++Index) {
+            const std::string Argument = Argv[Index];
+
+            // Every option except the flags takes a value.
+            auto NextValue = [&]() -> const char* {
+                return (Index + 1 < Argc) ? Argv[++Index] : nullptr;
+            };
+
+            if (Argument == "--cyclic") {
+                OutOptions.Settings.bCyclic = true;
+            } else if (Argument == "--foot-smoothing") {
+                OutOptions.Settings.bSeparateFootSmoothing = true;
+            } else if (Argument == "--foot-contact") {
+                OutOptions.Settings.FootContact.bEnabled = true;
+            } else if (Argument == "--help" || Argument == "-h") {
+                return false;
+            } else if (Argument.rfind("--", 0) == 0) {
+                const char* Value = NextValue();
+                if (!Value) {
+                    std::fprintf(stderr, "mmprep: %s needs a value\n", Argument.c_str());
+                    return false;
+                }
+
+                if (Argument == "--velocity-min") {
+                    OutOptions.Settings.TranslationVelocityMin = std::strtof(Value, nullptr);
+                } else if (Argument == "--velocity-max") {
+                    OutOptions.Settings.TranslationVelocityMax = std::strtof(Value, nullptr);
+                } else if (Argument == "--smoothing-min") {
+                    OutOptions.Settings.TranslationSmoothingMinSeconds = std::strtof(Value, nullptr);
+                } else if (Argument == "--smoothing-max") {
+                    OutOptions.Settings.TranslationSmoothingMaxSeconds = std::strtof(Value, nullptr);
+                } else if (Argument == "--facing") {
+                    const std::string Axis = Value;
+                    if (Axis == "x") {
+                        OutOptions.Settings.FacingAxis = MMCore::EFacingAxis::X;
+                    } else if (Axis == "y") {
+                        OutOptions.Settings.FacingAxis = MMCore::EFacingAxis::Y;
+                    } else if (Axis == "z") {
+                        OutOptions.Settings.FacingAxis = MMCore::EFacingAxis::Z;
+                    } else {
+                        std::fprintf(stderr, "mmprep: Unknown facing axis '%s'\n", Value);
+                        return false;
+                    }
+                } else if (Argument == "--analysis-rate") {
+                    OutOptions.Settings.bMultiResolutionAnalysis = true;
+                    OutOptions.Settings.AnalysisFrameRate = std::strtof(Value, nullptr);
+                } else if (Argument == "--out") {
+                    OutOptions.OutputDirectory = Value;
+                } else if (Argument == "--jobs") {
+                    OutOptions.NumJobs = std::atoi(Value);
+                } else if (Argument == "--bench") {
+                    OutOptions.NumBenchRuns = std::atoi(Value);
+                } else {
+                    std::fprintf(stderr, "mmprep: Unknown option '%s'\n", Argument.c_str());
+                    return false;
+                }
+            } else {
+                OutOptions.Inputs.push_back(Argument);
+            }
+        }
+
+        if (OutOptions.Settings.bMultiResolutionAnalysis && OutOptions.Settings.AnalysisFrameRate <= 0.0f) {
+            std::fprintf(stderr, "mmprep: The analysis rate has to be positive\n");
+            return false;
+        }
+
+        return !OutOptions.Inputs.empty();
+    }
+
+    bool ReadFile(const std::string& Path, std::vector<uint8_t>& OutBytes)
+    {
+        std::ifstream Stream(Path, std::ios::binary);
+        if (!Stream) {
+            return false;
+        }
+        OutBytes.assign(std::istreambuf_iterator<char>(Stream), std::istreambuf_iterator<char>());
+        return !Stream.bad();
+    }
+
+    bool WriteFile(const std::string& Path, const std::vector<uint8_t>& Bytes)
+    {
+        std::ofstream Stream(Path, std::ios::binary);
+        Stream.write(reinterpret_cast<const char*>(Bytes.data()), static_cast<std::streamsize>(Bytes.size()));
+        return static_cast<bool>(Stream);
+    }
+
+    std::string GetTrackPath(const std::string& InputPath, const std::string& OutputDirectory)
+    {
+        const size_t SlashIndex = InputPath.find_last_of("/\\");
+        const size_t NameStart = (SlashIndex == std::string::npos) ? 0 : SlashIndex + 1;
+        const size_t DotIndex = InputPath.find_last_of('.');
+        const size_t NameEnd = (DotIndex == std::string::npos || DotIndex < NameStart) ? InputPath.size() : DotIndex;
+
+        const std::string Directory = !OutputDirectory.empty() ? OutputDirectory + "/" : InputPath.substr(0, NameStart);
+        return Directory + InputPath.substr(NameStart, NameEnd - NameStart) + ".mmtrack";
+    }
+
+    // Whole clip, like the modifier's full apply. A loop is extended into its neighbouring cycles,
+    // everything else is analyzed as it is.
+    bool AnalyzeClip(const std::vector<MMCore::FPose>& ClipPoses, const float FrameRate, const MMCore::FSettings& Settings, MMCore::FAnalysisOutput& OutOutput)
+    {
+        const int32_t NumFrames = static_cast<int32_t>(ClipPoses.size());
+        const MMCore::FFrameRange FrameRange = { 0, NumFrames };
+        const MMCore::FFrameRange Context = MMCore::GetAnalysisContext(Settings, FrameRange, NumFrames, FrameRate);
+
+        if (Context.Start == 0 && Context.End == NumFrames) {
+            return MMCore::Analyze(ClipPoses, 0, FrameRange, FrameRate, Settings, OutOutput);
+        }
+
+        return MMCore::Analyze(MMCore::ExtendCyclic(ClipPoses, Context, Settings.FacingAxis), Context.Start, FrameRange, FrameRate, Settings, OutOutput);
+    }
+
+    FClipResult ProcessClip(const std::string& InputPath, const FOptions& Options)
+    {
+        FClipResult Result;
+
+        std::vector<uint8_t> Bytes;
+        if (!ReadFile(InputPath, Bytes)) {
+            Result.Error = "Can't read file";
+            return Result;
+        }
+
+        std::vector<MMCore::FPose> Poses;
+        float FrameRate = 0.0f;
+        if (!MMCore::LoadPoseFile(Bytes, Poses, FrameRate, Result.Error)) {
+            return Result;
+        }
+
+        Result.NumFrames = static_cast<int32_t>(Poses.size());
+
+        MMCore::FAnalysisOutput Output;
+
+        // Benchmarks time the analysis alone, the part that runs in the editor too.
+        const int32_t NumRuns = std::max(1, Options.NumBenchRuns);
+        const auto StartTime = std::chrono::steady_clock::now();
+        for (int32_t Run = 0; Run < NumRuns; ++Run) {
+            AnalyzeClip(Poses, FrameRate, Options.Settings, Output);
+        }
+        Result.Milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - StartTime).count() / NumRuns;
+
+        if (Options.NumBenchRuns > 0) {
+            Result.bSucceeded = true;
+            return Result;
+        }
+
+        // Named after the bones of the default Manny profile.
+        MMCore::FTrackFile TrackFile;
+        TrackFile.NumFrames = Result.NumFrames;
+        TrackFile.FirstFrame = Output.FirstFrame;
+        TrackFile.FrameRate = FrameRate;
+        TrackFile.TransformTracks = {
+            { "root", Output.Root },
+            { "pelvis", Output.Pelvis },
+            { "ik_foot_l", Output.IkLeftFoot },
+            { "ik_foot_r", Output.IkRightFoot },
+            { "ik_hand_gun", Output.IkRightHand },
+            { "ik_hand_l", Output.IkLeftHand },
+        };
+        TrackFile.Curves = {
+            { "ball_l_speed", Output.LeftBallSpeeds },
+            { "ball_r_speed", Output.RightBallSpeeds },
+        };
+
+        if (Options.Settings.FootContact.bEnabled) {
+            TrackFile.Curves.push_back({ "foot_l_contact", Output.LeftFootContact });
+            TrackFile.Curves.push_back({ "foot_l_lock", Output.LeftFootLock });
+            TrackFile.Curves.push_back({ "foot_r_contact", Output.RightFootContact });
+            TrackFile.Curves.push_back({ "foot_r_lock", Output.RightFootLock });
+        }
+
+        const std::string TrackPath = GetTrackPath(InputPath, Options.OutputDirectory);
+        if (!WriteFile(TrackPath, MMCore::SaveTrackFile(TrackFile))) {
+            Result.Error = "Can't write '" + TrackPath + "'";
+            return Result;
+        }
+
+        Result.bSucceeded = true;
+        return Result;
+    }
+}
+
+int main(int Argc, char** Argv)
+{
+    FOptions Options;
+    if (!ParseOptions(Argc, Argv, Options)) {
+        PrintUsage();
+        return 2;
+    }
+
+    const int32_t NumClips = static_cast<int32_t>(Options.Inputs.size());
+    const int32_t NumJobs = std::min(NumClips, (Options.NumJobs > 0) ? Options.NumJobs : std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency())));
+
+    // Clips are independent, so every worker just takes the next one until there are none left.
+    std::vector<FClipResult> Results(NumClips);
+    std::atomic<int32_t> NextClip = 0;
+    std::mutex OutputMutex;
+
+    auto Worker = [&]() {
+        for (int32_t ClipIndex = NextClip++; ClipIndex < NumClips; ClipIndex = NextClip++) {
+            Results[ClipIndex] = ProcessClip(Options.Inputs[ClipIndex], Options);
+
+            const FClipResult& Result = Results[ClipIndex];
+            std::lock_guard<std::mutex> Lock(OutputMutex);
+            if (Result.bSucceeded) {
+                std::printf("%-48s %8d frames %10.2f ms\n", Options.Inputs[ClipIndex].c_str(), Result.NumFrames, Result.Milliseconds);
+            } else {
+                std::fprintf(stderr, "mmprep: %s: %s\n", Options.Inputs[ClipIndex].c_str(), Result.Error.c_str());
+            }
+        }
+    };
+
+    const auto StartTime = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> Threads;
+    for (int32_t Job = 1; Job < NumJobs; ++Job) {
+        Threads.emplace_back(Worker);
+    }
+    Worker();
+    for (std::thread& Thread : Threads) {
+        Thread.join();
+    }
+
+    const double WallMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - StartTime).count();
+
+    int32_t NumFailed = 0;
+    int64_t TotalFrames = 0;
+    double TotalMilliseconds = 0.0;
+    for (const FClipResult& Result : Results) {
+        NumFailed += Result.bSucceeded ? 0 : 1;
+        TotalFrames += Result.bSucceeded ? Result.NumFrames : 0;
+        TotalMilliseconds += Result.bSucceeded ? Result.Milliseconds : 0.0;
+    }
+
+    if (Options.NumBenchRuns > 0 && TotalMilliseconds > 0.0) {
+        std::printf("%d clips, %lld frames, %.2f ms per clip, %.0f frames/s per thread\n",
+            NumClips - NumFailed, static_cast<long long>(TotalFrames), TotalMilliseconds / std::max(1, NumClips - NumFailed), TotalFrames / (TotalMilliseconds / 1000.0));
+    } else {
+        std::printf("%d clips, %lld frames in %.1f ms on %d threads\n", NumClips - NumFailed, static_cast<long long>(TotalFrames), WallMilliseconds, NumJobs);
+    }
+
+    return (NumFailed > 0) ? 1 : 0;
+}
+
+#endif